@@ -256,6 +256,17 @@ m4_case([$#],
 	[m4_fatal([DPDK_CHECK_HEADERS requires 1-4 arguments])])
 ])]) # DPDK_CHECK_HEADERS
 
+# DPDK_CHECK_DECLS(SYMBOLS, [ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND], [INCLUDES])
+# ------------------------------------------------------------------------------
+# Like AC_CHECK_DECLS, but add DPDK_LIBS, DPDK_CFLAGS, DPDK_CPPFLAGS, and
+# DPDK_LDFLAGS to their respective variables first and restore them
+# afterward.  Use this instead of DPDK_CHECK_FUNCS for the many DPDK functions
+# which are static inline and so cannot be found by a link test.
+AC_DEFUN([DPDK_CHECK_DECLS], [
+_WITH_DPDK_FLAGS([
+AC_CHECK_DECLS([$1], [$2], [$3], [$4])
+])]) # DPDK_CHECK_DECLS
+
 # DPDK_CHECK_SIZEOF_PORT_ID()
 # -------------------------------------------------------------------------------------
 # Set HAVE_UINT16_T_PORT_ID if port_id arguments are uint16_t instead of uint8_t.
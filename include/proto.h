@@ -90,6 +90,40 @@ struct rdmap_untagged_packet {
 } __attribute__((__packed__));
 static_assert(sizeof(struct rdmap_untagged_packet) == 18, "unexpected sizeof(rdmap_untagged_packet)");
 
+/** Header of an Immediate Data message (RFC 7306) and of each segment of a
+ * SEND with Immediate Data message.  The rdma_length field carries the length
+ * of the RDMA WRITE that preceded an Immediate Data message, so that the
+ * consumer can be given the number of bytes written; it is zero for SEND with
+ * Immediate Data. */
+struct rdmap_immediate_packet {
+	struct rdmap_untagged_packet untagged;
+	uint32_t imm_data; /* network byte order, opaque to RDMAP */
+	uint32_t rdma_length;
+} __attribute__((__packed__));
+static_assert(sizeof(struct rdmap_immediate_packet) == 26, "unexpected sizeof(rdmap_immediate_packet)");
+
+/** Atomic Request.  This is sent on the RDMA READ Request queue and shares its
+ * MSN space, so that atomic operations are executed and responded to in order
+ * with RDMA READ Requests.  Unlike RFC 7306, the original value is returned in
+ * an 8-byte RDMA READ Response to sink_stag/sink_offset, in network byte
+ * order. */
+struct rdmap_atomicreq_packet {
+	struct rdmap_untagged_packet untagged;
+	uint64_t sink_offset;
+	uint32_t atomic_op; /* enum rdmap_atomic_op */
+	uint32_t source_stag;
+	uint64_t source_offset;
+	uint64_t swap_add_data;
+	uint64_t compare_data;
+} __attribute__((__packed__));
+static_assert(sizeof(struct rdmap_atomicreq_packet) == 58, "unexpected sizeof(rdmap_atomicreq_packet)");
+
+enum rdmap_atomic_op {
+	rdmap_atomic_none = 0,
+	rdmap_atomic_fetch_add = 1,
+	rdmap_atomic_cmp_swap = 2,
+};
+
 #define RDMAP_TAGGED_ALLOC_SIZE(len) (sizeof(struct rdmap_tagged_packet) + (len))
 #define RDMAP_UNTAGGED_ALLOC_SIZE(len) (sizeof(struct rdmap_untagged_packet) + (len))
 
@@ -102,6 +136,21 @@ struct rdmap_readreq_packet {
 } __attribute__((__packed__));
 static_assert(sizeof(struct rdmap_readreq_packet) == 42, "unexpected sizeof(rdmap_readreq_packet)");
 
+/** Our RDMA READ and Atomic Requests set RDMAP_READ_SCATTER_FLAG in
+ * sink_offset rather than naming a tagged buffer.  The remaining bits hold
+ * the low 31 bits of the request MSN and the 32-bit logical offset into the
+ * scatter list of the request; the responder treats sink_offset as opaque and
+ * just advances it per segment, and the requester uses the MSN to find the
+ * request and maps the offset back onto its scatter list when placing the
+ * response. */
+#define RDMAP_READ_SCATTER_FLAG (UINT64_C(1) << 63)
+#define RDMAP_READ_SCATTER_OFFSET(msn, offset) (RDMAP_READ_SCATTER_FLAG \
+		| ((uint64_t)((msn) & UINT32_C(0x7fffffff)) << 32) \
+		| (uint32_t)(offset))
+#define RDMAP_READ_SCATTER_GET_MSN(sink_offset) \
+	((uint32_t)((sink_offset) >> 32) & UINT32_C(0x7fffffff))
+#define RDMAP_READ_SCATTER_GET_OFFSET(sink_offset) ((uint32_t)(sink_offset))
+
 struct rdmap_terminate_packet {
 	struct rdmap_untagged_packet untagged;
 	uint16_t error_code; /* 0-3 layer 4-7 etype 8-16 code */
@@ -124,6 +173,15 @@ enum rdmap_packet_type {
 	rdmap_opcode_send_se = 5,
 	rdmap_opcode_send_se_inv = 6,
 	rdmap_opcode_terminate = 7,
+	rdmap_opcode_immediate_data = 8,
+	rdmap_opcode_immediate_data_se = 9,
+	rdmap_opcode_atomic_request = 10,
+	rdmap_opcode_send_imm = 12,
+		/**< Not part of RFC 5040/7306; a SEND message whose every
+		 * segment carries struct rdmap_immediate_packet. */
+	rdmap_opcode_send_imm_se = 13,
+		/**< As rdmap_opcode_send_imm, with the Solicited Event
+		 * flag. */
 };
 
 enum /*rdmap_hdrct*/ {
@@ -69,6 +69,10 @@ enum {
 		 * no data.  Rather, the psn and ack_psn fields indicate the
 		 * minimum and (maximum + 1) sequence numbers, respectively, in
 		 * a contiguous range that have been received. */
+	trp_ud = 0x6000,
+		/**< A datagram sent by an unreliable datagram queue pair.  The
+		 * psn and ack_psn fields are unused, and the packet carries a
+		 * single-segment untagged DDP SEND message. */
 	trp_opcode_mask = 0xf000,
 		/**< Mask of all bits used for opcode. */
 	trp_reserved_mask = 0x0fff,
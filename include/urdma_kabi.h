@@ -62,6 +62,10 @@ struct urdma_uresp_create_cq {
 	uint32_t	cq_id;
 };
 
+struct urdma_uresp_create_srq {
+	uint32_t	srq_id;
+};
+
 struct urdma_udata_create_qp {
 	uint32_t	ord_max;
 	uint32_t	ird_max;
@@ -85,6 +89,11 @@ struct urdma_cq_event {
 	uint32_t	cq_id;
 };
 
+struct urdma_srq_event {
+	uint32_t	event_type;
+	uint32_t	srq_id;
+};
+
 struct urdma_qp_connected_event {
 	uint32_t	event_type;
 	uint32_t	kmod_qp_id;
@@ -132,6 +141,11 @@ enum urdma_event_type {
 	SIW_EVENT_QP_DISCONNECTED = 3,
 		/**< Sent from the kernel to userspace to indicate that a
 		 * connection has been torn down. */
+	SIW_EVENT_SRQ_LIMIT_REACHED = 4,
+		/**< Sent from userspace to kernel to indicate that the number
+		 * of receive WQEs posted to a shared receive queue has dropped
+		 * below its armed limit, so that the kernel can raise the
+		 * corresponding asynchronous event. */
 };
 
 #endif
@@ -119,6 +119,8 @@ enum urdmad_sock_msg_op {
 	urdma_sock_destroy_qp_req = 3,
 	urdma_sock_hello_req = 4,
 	urdma_sock_hello_resp = 5,
+	urdma_sock_bind_ud_qp_req = 6,
+	urdma_sock_bind_ud_qp_resp = 7,
 };
 
 struct urdmad_sock_msg {
@@ -145,11 +147,21 @@ struct urdmad_sock_hello_resp {
 	uint16_t max_qp[];
 };
 
+/** Binds an unreliable datagram queue pair to a local UDP port.  The response
+ * echoes the request with status set to 0 or a positive errno value. */
+struct urdmad_sock_bind_ud_qp_msg {
+	struct urdmad_sock_msg hdr;
+	uint16_t udp_port; /* network byte order */
+	uint16_t reserved;
+	uint32_t status;
+};
+
 union urdmad_sock_any_msg {
 	struct urdmad_sock_msg hdr;
 	struct urdmad_sock_qp_msg qp;
 	struct urdmad_sock_hello_req hello_req;
 	struct urdmad_sock_hello_resp hello_resp;
+	struct urdmad_sock_bind_ud_qp_msg bind_ud_qp;
 };
 
 #endif
@@ -87,6 +87,21 @@ void siw_cq_event(struct siw_cq *cq, enum ib_event_type etype)
 	}
 }
 
+void siw_srq_event(struct siw_srq *srq, enum ib_event_type etype)
+{
+	struct ib_event event;
+	struct ib_srq	*ofa_srq = &srq->ofa_srq;
+
+	event.event = etype;
+	event.device = ofa_srq->device;
+	event.element.srq = ofa_srq;
+
+	if (ofa_srq->event_handler) {
+		pr_debug(DBG_EH ": reporting %d\n", etype);
+		(*ofa_srq->event_handler)(&event, ofa_srq->srq_context);
+	}
+}
+
 void siw_port_event(struct siw_dev *sdev, u8 port, enum ib_event_type etype)
 {
 	struct ib_event event;
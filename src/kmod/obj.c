@@ -58,6 +58,7 @@ void siw_idr_init(struct siw_dev *sdev)
 	idr_init(&sdev->qp_idr);
 	idr_init(&sdev->cq_idr);
 	idr_init(&sdev->pd_idr);
+	idr_init(&sdev->srq_idr);
 }
 
 void siw_idr_release(struct siw_dev *sdev)
@@ -65,6 +66,7 @@ void siw_idr_release(struct siw_dev *sdev)
 	idr_destroy(&sdev->qp_idr);
 	idr_destroy(&sdev->cq_idr);
 	idr_destroy(&sdev->pd_idr);
+	idr_destroy(&sdev->srq_idr);
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
@@ -167,6 +169,18 @@ struct siw_qp *siw_qp_id2obj(struct siw_dev *sdev, int id)
 	return NULL;
 }
 
+struct siw_srq *siw_srq_id2obj(struct siw_dev *sdev, int id)
+{
+	struct siw_objhdr *obj = siw_get_obj(&sdev->srq_idr, id);
+	if (obj) {
+		pr_debug(DBG_OBJ "(SRQ%d): New refcount: %d\n",
+			obj->id, kref_read(&obj->ref));
+		return container_of(obj, struct siw_srq, hdr);
+	}
+
+	return NULL;
+}
+
 int siw_qp_add(struct siw_dev *sdev, struct siw_qp *qp)
 {
 	int rv = siw_add_obj(&sdev->idr_lock, &sdev->qp_idr, &qp->hdr);
@@ -197,6 +211,16 @@ int siw_pd_add(struct siw_dev *sdev, struct siw_pd *pd)
 	return rv;
 }
 
+int siw_srq_add(struct siw_dev *sdev, struct siw_srq *srq)
+{
+	int rv = siw_add_obj(&sdev->idr_lock, &sdev->srq_idr, &srq->hdr);
+	if (!rv) {
+		pr_debug(DBG_OBJ "(SRQ%d): New Object\n", srq->hdr.id);
+		srq->hdr.sdev = sdev;
+	}
+	return rv;
+}
+
 void siw_remove_obj(spinlock_t *lock, struct idr *idr,
 		      struct siw_objhdr *hdr)
 {
@@ -254,6 +278,18 @@ static void siw_free_pd(struct kref *ref)
 	kfree(pd);
 }
 
+static void siw_free_srq(struct kref *ref)
+{
+	struct siw_srq	*srq =
+		container_of(container_of(ref, struct siw_objhdr, ref),
+			     struct siw_srq, hdr);
+
+	pr_debug(DBG_OBJ "(SRQ%d): Free Object\n", srq->hdr.id);
+
+	atomic_dec(&srq->hdr.sdev->num_srq);
+	kfree(srq);
+}
+
 
 void siw_cq_put(struct siw_cq *cq)
 {
@@ -275,3 +311,10 @@ void siw_pd_put(struct siw_pd *pd)
 		OBJ_ID(pd), kref_read(&pd->hdr.ref));
 	kref_put(&pd->hdr.ref, siw_free_pd);
 }
+
+void siw_srq_put(struct siw_srq *srq)
+{
+	pr_debug(DBG_OBJ "(SRQ%d): Old refcount: %d\n",
+		OBJ_ID(srq), kref_read(&srq->hdr.ref));
+	kref_put(&srq->hdr.ref, siw_free_srq);
+}
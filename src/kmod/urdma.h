@@ -51,10 +51,11 @@
 #include "backports.h"
 
 #define SIW_MAX_QP		(1024 * 100)
-#define SIW_MAX_ORD		128
-#define SIW_MAX_IRD		128
+#define SIW_MAX_ORD		255
+#define SIW_MAX_IRD		255
 #define SIW_MAX_CQ		(1024 * 100)
 #define SIW_MAX_PD		SIW_MAX_QP
+#define SIW_MAX_SRQ		SIW_MAX_QP
 #define SIW_MAX_CONTEXT		(SIW_MAX_PD * 10)
 
 #define ETHER_ADDR_LEN		6
@@ -73,6 +74,7 @@ struct siw_devinfo {
 	enum ib_device_cap_flags	cap_flags;
 	int			max_cq;
 	int			max_pd;
+	int			max_srq;
 	/* end ib_device_attr */
 };
 
@@ -100,11 +102,13 @@ struct siw_dev {
 	struct idr		qp_idr;
 	struct idr		cq_idr;
 	struct idr		pd_idr;
+	struct idr		srq_idr;
 
 	/* active objects statistics */
 	atomic_t		num_qp;
 	atomic_t		num_cq;
 	atomic_t		num_pd;
+	atomic_t		num_srq;
 	atomic_t		num_cep;
 	atomic_t		num_ctx;
 
@@ -138,6 +142,11 @@ struct siw_cq {
 	struct siw_objhdr	hdr;
 };
 
+struct siw_srq {
+	struct ib_srq		ofa_srq;
+	struct siw_objhdr	hdr;
+};
+
 enum siw_qp_state {
 	SIW_QP_STATE_IDLE	= 0,
 	SIW_QP_STATE_RTR	= 1,
@@ -224,6 +233,7 @@ enum siw_qp_state siw_map_ibstate(enum ib_qp_state);
 /* RDMA core event dipatching */
 void siw_qp_event(struct siw_qp *, enum ib_event_type);
 void siw_cq_event(struct siw_cq *, enum ib_event_type);
+void siw_srq_event(struct siw_srq *, enum ib_event_type);
 void siw_port_event(struct siw_dev *, u8, enum ib_event_type);
 
 
@@ -96,13 +96,20 @@ static inline struct siw_cq *siw_cq_ofa2siw(struct ib_cq *ofa_cq)
 	return container_of(ofa_cq, struct siw_cq, ofa_cq);
 }
 
+static inline struct siw_srq *siw_srq_ofa2siw(struct ib_srq *ofa_srq)
+{
+	return container_of(ofa_srq, struct siw_srq, ofa_srq);
+}
+
 static ssize_t siw_event_file_write(struct file *filp, const char __user *buf,
 		size_t count, loff_t *pos)
 {
 	struct siw_event_file *file;
 	struct urdma_event_storage event;
 	struct urdma_cq_event *cq_event;
+	struct urdma_srq_event *srq_event;
 	struct siw_cq *cq;
+	struct siw_srq *srq;
 	ssize_t rv;
 
 	if (count > sizeof(event)) {
@@ -135,6 +142,20 @@ static ssize_t siw_event_file_write(struct file *filp, const char __user *buf,
 		cq->ofa_cq.comp_handler(&cq->ofa_cq, cq->ofa_cq.cq_context);
 		siw_cq_put(cq);
 		break;
+	case SIW_EVENT_SRQ_LIMIT_REACHED:
+		if (count != sizeof(*srq_event)) {
+			rv = -EINVAL;
+			goto out;
+		}
+		srq_event = (struct urdma_srq_event *)&event;
+		srq = siw_srq_id2obj(file->ctx->sdev, srq_event->srq_id);
+		if (WARN_ON_ONCE(!srq)) {
+			rv = -EINVAL;
+			goto out;
+		}
+		siw_srq_event(srq, IB_EVENT_SRQ_LIMIT_REACHED);
+		siw_srq_put(srq);
+		break;
 	default:
 		pr_debug(" got invalid event type %u\n", event.event_type);
 		rv = -EINVAL;
@@ -298,6 +319,7 @@ int siw_query_device(struct ib_device *ofa_dev, struct ib_device_attr *attr,
 	attr->device_cap_flags = sdev->attrs.cap_flags;
 	attr->max_cq = sdev->attrs.max_cq;
 	attr->max_pd = sdev->attrs.max_pd;
+	attr->max_srq = sdev->attrs.max_srq;
 
 	return 0;
 }
@@ -527,17 +549,12 @@ struct ib_qp *siw_create_qp(struct ib_pd *ofa_pd,
 		rv = -ENOMEM;
 		goto err_out;
 	}
-	if (attrs->qp_type != IB_QPT_RC) {
-		pr_debug(": Only RC QP's supported\n");
+	if (attrs->qp_type != IB_QPT_RC && attrs->qp_type != IB_QPT_UC
+			&& attrs->qp_type != IB_QPT_UD) {
+		pr_debug(": Only RC, UC and UD QP's supported\n");
 		rv = -EINVAL;
 		goto err_out;
 	}
-	if (attrs->srq) {
-		pr_debug(": SRQ is not supported\n");
-		rv = -EINVAL;
-		goto err_out;
-	}
-
 	scq = siw_cq_id2obj(sdev, ((struct siw_cq *)attrs->send_cq)->hdr.id);
 	rcq = siw_cq_id2obj(sdev, ((struct siw_cq *)attrs->recv_cq)->hdr.id);
 
@@ -935,7 +952,53 @@ struct ib_srq *siw_create_srq(struct ib_pd *ofa_pd,
 			      struct ib_srq_init_attr *init_attrs,
 			      struct ib_udata *udata)
 {
-	return ERR_PTR(-ENOSYS);
+	struct siw_srq			*srq = NULL;
+	struct siw_dev			*sdev = siw_dev_ofa2siw(ofa_pd->device);
+	struct urdma_uresp_create_srq	uresp;
+	int rv;
+
+	if (!ofa_pd->uobject) {
+		pr_debug(": This driver does not support kernel clients\n");
+		return ERR_PTR(-EINVAL);
+	}
+	if (atomic_inc_return(&sdev->num_srq) > SIW_MAX_SRQ) {
+		pr_debug(": Out of SRQ's\n");
+		rv = -ENOMEM;
+		goto err_out;
+	}
+	if (init_attrs->srq_type != IB_SRQT_BASIC) {
+		pr_debug(": Only basic SRQ's supported\n");
+		rv = -EINVAL;
+		goto err_out;
+	}
+	srq = kzalloc(sizeof *srq, GFP_KERNEL);
+	if (!srq) {
+		pr_debug(":  kmalloc\n");
+		rv = -ENOMEM;
+		goto err_out;
+	}
+
+	rv = siw_srq_add(sdev, srq);
+	if (rv)
+		goto err_out;
+
+	uresp.srq_id = OBJ_ID(srq);
+
+	rv = ib_copy_to_udata(udata, &uresp, sizeof uresp);
+	if (rv)
+		goto err_out_idr;
+
+	return &srq->ofa_srq;
+
+err_out_idr:
+	siw_remove_obj(&sdev->idr_lock, &sdev->srq_idr, &srq->hdr);
+err_out:
+	pr_debug(DBG_OBJ ": SRQ creation failed %d", rv);
+
+	kfree(srq);
+	atomic_dec(&sdev->num_srq);
+
+	return ERR_PTR(rv);
 }
 
 /*
@@ -944,23 +1007,25 @@ struct ib_srq *siw_create_srq(struct ib_pd *ofa_pd,
  * Modify SRQ. The caller may resize SRQ and/or set/reset notification
  * limit and (re)arm IB_EVENT_SRQ_LIMIT_REACHED notification.
  *
- * NOTE: it is unclear if OFA allows for changing the MAX_SGE
- * parameter. siw_modify_srq() does not check the attrs->max_sge param.
+ * Handled entirely in userspace; the progress thread reports a reached
+ * limit via the SIW_EVENT_SRQ_LIMIT_REACHED event.
  */
 int siw_modify_srq(struct ib_srq *ofa_srq, struct ib_srq_attr *attrs,
 		   enum ib_srq_attr_mask attr_mask, struct ib_udata *udata)
 {
-	return -ENOSYS;
+	return 0;
 }
 
 /*
  * siw_query_srq()
  *
  * Query SRQ attributes.
+ *
+ * Handled entirely in userspace.
  */
 int siw_query_srq(struct ib_srq *ofa_srq, struct ib_srq_attr *attrs)
 {
-	return -ENOSYS;
+	return 0;
 }
 
 /*
@@ -973,7 +1038,13 @@ int siw_query_srq(struct ib_srq *ofa_srq, struct ib_srq_attr *attrs)
  */
 int siw_destroy_srq(struct ib_srq *ofa_srq)
 {
-	return -ENOSYS;
+	struct siw_srq		*srq = siw_srq_ofa2siw(ofa_srq);
+	struct siw_dev		*sdev = siw_dev_ofa2siw(ofa_srq->device);
+
+	siw_remove_obj(&sdev->idr_lock, &sdev->srq_idr, &srq->hdr);
+	siw_srq_put(srq);
+
+	return 0;
 }
 
 
@@ -1117,7 +1117,9 @@ client_new(struct sockaddr *local_addr, struct sockaddr *server_addr)
 	conn_params.private_data = NULL;
 	conn_params.private_data_len = 0;
 	conn_params.responder_resources = 1;
-	conn_params.initiator_depth = 1;
+	/* Ask for as many outstanding RDMA READs as the device allows; the
+	 * server may accept fewer */
+	conn_params.initiator_depth = ib_devattr.max_qp_init_rd_atom;
 	conn_params.flow_control = 0;
 	conn_params.rnr_retry_count = 7;
 	ret = rdma_connect(state->cm_id, &conn_params);
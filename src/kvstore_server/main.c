@@ -494,7 +494,8 @@ server_new(struct sockaddr *listen_addr)
 
 	conn_params.private_data = NULL;
 	conn_params.private_data_len = 0;
-	conn_params.responder_resources = 1;
+	/* Accept as many outstanding RDMA READs as the device supports */
+	conn_params.responder_resources = ib_devattr.max_qp_rd_atom;
 	conn_params.initiator_depth = 1;
 	conn_params.flow_control = 0;
 	conn_params.rnr_retry_count = 7;
@@ -59,6 +59,7 @@
 #include <rte_errno.h>
 #include <rte_ip.h>
 #include <rte_jhash.h>
+#include <rte_lcore.h>
 #include <rte_malloc.h>
 #include <rte_ring.h>
 
@@ -85,6 +86,9 @@ driver_add_context(struct usiw_context *ctx)
 	for (i = 0; ret == -ENOBUFS && i < 1000; ++i) {
 		ret = rte_ring_enqueue(driver->new_ctxs, ctx->h);
 	}
+	if (ret == 0) {
+		usiw_wake_progress_thread(driver);
+	}
 	return ret;
 } /* driver_add_context */
 
@@ -204,6 +208,10 @@ usiw_driver_init(int portid)
 		return NULL;
 	}
 	rte_eth_dev_info_get(dev->portid, &info);
+	dev->socket_id = rte_eth_dev_socket_id(dev->portid);
+	if (dev->socket_id < 0) {
+		dev->socket_id = rte_lcore_to_socket_id(rte_get_master_lcore());
+	}
 
 	if ((info.tx_offload_capa & tx_checksum_offloads)
 						== tx_checksum_offloads) {
@@ -230,9 +238,45 @@ usiw_driver_init(int portid)
 		return NULL;
 	}
 
+	dev->rx_demux = rte_calloc_socket(NULL, UINT16_MAX + 1,
+			sizeof(*dev->rx_demux), RTE_CACHE_LINE_SIZE,
+			dev->socket_id);
+	if (!dev->rx_demux) {
+		free(dev);
+		errno = ENOMEM;
+		return NULL;
+	}
+	rte_spinlock_init(&dev->tx_lock);
+
+	dev->driver = driver;
 	dev->urdmad_fd = driver->urdmad_fd;
 	dev->max_qp = driver->max_qp[dev->portid];
 
+	dev->doorbell_words = dev->max_qp / DOORBELL_WORD_BITS + 1;
+	dev->doorbell = rte_calloc_socket(NULL, dev->doorbell_words,
+			sizeof(*dev->doorbell), RTE_CACHE_LINE_SIZE,
+			dev->socket_id);
+	dev->timer_bits = rte_calloc_socket(NULL, dev->doorbell_words,
+			sizeof(*dev->timer_bits), RTE_CACHE_LINE_SIZE,
+			dev->socket_id);
+	dev->qp_table = rte_calloc_socket(NULL, dev->max_qp + 1,
+			sizeof(*dev->qp_table), RTE_CACHE_LINE_SIZE,
+			dev->socket_id);
+	dev->high_prio_bits = rte_calloc_socket(NULL, dev->doorbell_words,
+			sizeof(*dev->high_prio_bits), RTE_CACHE_LINE_SIZE,
+			dev->socket_id);
+	if (!dev->doorbell || !dev->timer_bits || !dev->qp_table
+			|| !dev->high_prio_bits) {
+		rte_free(dev->high_prio_bits);
+		rte_free(dev->qp_table);
+		rte_free(dev->timer_bits);
+		rte_free(dev->doorbell);
+		rte_free(dev->rx_demux);
+		free(dev);
+		errno = ENOMEM;
+		return NULL;
+	}
+
 	return &dev->vdev.device;
 } /* usiw_driver_init */
 
@@ -323,9 +367,12 @@ free_arg_list(int argc, char **argv)
  * use, and eal_argv with the user-requested argument, in addition to the
  * required arguments "--proc-type=secondary" and "-c".  (*eal_argv)[*eal_argc -
  * 1] is left NULL and must be filled in by the caller with the coremask to use,
- * which is determined by the socket identified by *sock_name. */
+ * which is determined by the socket identified by *sock_name.  The progress
+ * thread idle mode settings are placed in *idle_poll_count and
+ * *idle_sleep_ms. */
 static bool
-do_config(char **sock_name, int *eal_argc, char ***eal_argv)
+do_config(char **sock_name, int *eal_argc, char ***eal_argv,
+		unsigned int *idle_poll_count, int *idle_sleep_ms)
 {
 	static const size_t hostnamesize = HOST_NAME_MAX;
 	struct usiw_config config;
@@ -390,6 +437,8 @@ do_config(char **sock_name, int *eal_argc, char ***eal_argv)
 		goto free_eal_args;
 	}
 	*eal_argc += 2;
+	*idle_poll_count = urdma__config_file_get_idle_poll_count(&config);
+	*idle_sleep_ms = urdma__config_file_get_idle_sleep_ms(&config);
 	result = true;
 	goto close_config;
 
@@ -489,9 +538,12 @@ our_eal_master_thread(void *sem)
 	char **eal_argv;
 	char **argv_copy;
 	char *sock_name;
+	unsigned int idle_poll_count;
+	int idle_sleep_ms;
 	int eal_argc, ret;
 
-	if (!do_config(&sock_name, &eal_argc, &eal_argv)) {
+	if (!do_config(&sock_name, &eal_argc, &eal_argv,
+				&idle_poll_count, &idle_sleep_ms)) {
 		/* driver will be NULL either because this previously failed or
 		 * because it is a global variable which is initialized from 0'd
 		 * memory, so it is safe to call free() on it regardless */
@@ -503,6 +555,8 @@ our_eal_master_thread(void *sem)
 	if (!driver)
 		goto err;
 	list_head_init(&driver->ctxs);
+	driver->idle_poll_count = idle_poll_count;
+	driver->idle_sleep_ms = idle_sleep_ms;
 
 	driver->urdmad_fd = setup_socket(sock_name);
 	if (driver->urdmad_fd < 0)
@@ -552,12 +606,19 @@ our_eal_master_thread(void *sem)
 		goto close_fd;
 	}
 
+	driver->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (driver->wake_fd < 0) {
+		RTE_LOG(ERR, USER1, "cannot create progress thread eventfd: %s\n",
+				strerror(errno));
+		goto free_ring;
+	}
+
 	/* Here we create a semaphore "go" which is used to start the progress
 	 * thread once a uverbs context is established, and then post on our
 	 * initialization semaphore to let the "parent" thread know that we have
 	 * completed initialization. */
 	if (sem_init(&driver->go, 0, 0))
-		goto free_ring;
+		goto close_wake_fd;
 	ret = sem_post(sem);
 	if (ret) {
 		goto destroy_sem;
@@ -568,6 +629,8 @@ our_eal_master_thread(void *sem)
 
 destroy_sem:
 	sem_destroy(&driver->go);
+close_wake_fd:
+	close(driver->wake_fd);
 free_ring:
 	rte_ring_free(driver->new_ctxs);
 close_fd:
@@ -650,6 +713,11 @@ static void urdma_device_uninit(struct verbs_device *verbs_device)
 {
 	struct usiw_device *dev = container_of(verbs_device,
 		struct usiw_device, vdev);
+	rte_free(dev->high_prio_bits);
+	rte_free(dev->qp_table);
+	rte_free(dev->timer_bits);
+	rte_free(dev->doorbell);
+	rte_free(dev->rx_demux);
 	free(dev);
 }
 
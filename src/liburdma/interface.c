@@ -49,6 +49,7 @@
 #include <poll.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include <ccan/list/list.h>
@@ -72,7 +73,15 @@
 #include "util.h"
 
 #define IP_HDR_PROTO_UDP 17
+/* IPv4 version 4 with a 20-byte header; we never send IP options */
+#define RX_IPV4_VERSION_IHL 0x45
 #define RETRANSMIT_MAX 5
+/* Each queue pair may hold this many TX bursts waiting for room in the NIC
+ * transmit ring */
+#define TX_BACKLOG_BURSTS 4
+/* Attempts made to transmit the backlog of a queue pair that is shutting down
+ * before the rest is dropped */
+#define TX_DRAIN_RETRIES 1024
 
 struct packet_context {
 	struct ee_state *src_ep;
@@ -140,15 +149,15 @@ usiw_dereg_mr_real(__attribute__((unused)) struct usiw_mr_table *tbl,
 
 int
 usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
-		uint32_t max_send_wr, uint32_t max_send_sge)
+		uint32_t max_send_wr, uint32_t max_send_sge, int socket_id)
 {
 	size_t wqe_size;
 	char name[RTE_RING_NAMESIZE];
 	int i, ret;
 
 	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_send", qpn);
-	q->ring = rte_malloc(NULL, rte_ring_get_memsize(max_send_wr + 1),
-			RTE_CACHE_LINE_SIZE);
+	q->ring = rte_malloc_socket(NULL, rte_ring_get_memsize(max_send_wr + 1),
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->ring)
 		return -rte_errno;
 	ret = rte_ring_init(q->ring, name, max_send_wr + 1,
@@ -157,8 +166,9 @@ usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
 		return ret;
 
 	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_send_free", qpn);
-	q->free_ring = rte_malloc(NULL, rte_ring_get_memsize(max_send_wr + 1),
-				  RTE_CACHE_LINE_SIZE);
+	q->free_ring = rte_malloc_socket(NULL,
+			rte_ring_get_memsize(max_send_wr + 1),
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->free_ring)
 		return -rte_errno;
 	ret = rte_ring_init(q->free_ring, name, max_send_wr + 1,
@@ -168,9 +178,10 @@ usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
 
 	wqe_size = sizeof(struct usiw_send_wqe)
 					+ max_send_sge * sizeof(struct iovec);
-	q->storage = calloc(max_send_wr, wqe_size);
+	q->storage = rte_zmalloc_socket(NULL, max_send_wr * wqe_size,
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->storage)
-		return -errno;
+		return -ENOMEM;
 
 	for (i = 0; i < max_send_wr; i++) {
 		rte_ring_enqueue(q->free_ring, q->storage + i * wqe_size);
@@ -188,7 +199,7 @@ usiw_send_wqe_queue_destroy(struct usiw_send_wqe_queue *q)
 {
 	rte_free(q->ring);
 	rte_free(q->free_ring);
-	free(q->storage);
+	rte_free(q->storage);
 } /* usiw_send_wqe_queue_destroy */
 
 static void
@@ -219,12 +230,14 @@ usiw_send_wqe_queue_lookup(struct usiw_send_wqe_queue *q,
 		}
 		switch (lptr->opcode) {
 		case usiw_wr_send:
+		case usiw_wr_send_with_imm:
 			if (wr_key_data == lptr->msn) {
 				*wqe = lptr;
 				return 0;
 			}
 			break;
 		case usiw_wr_write:
+		case usiw_wr_write_with_imm:
 			if (wr_key_data == lptr->rkey) {
 				*wqe = lptr;
 				return 0;
@@ -243,15 +256,15 @@ usiw_send_wqe_queue_lookup(struct usiw_send_wqe_queue *q,
 
 int
 usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
-		uint32_t max_recv_wr, uint32_t max_recv_sge)
+		uint32_t max_recv_wr, uint32_t max_recv_sge, int socket_id)
 {
 	size_t wqe_size;
 	char name[RTE_RING_NAMESIZE];
 	int i, ret;
 
 	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_recv", qpn);
-	q->ring = rte_malloc(NULL, rte_ring_get_memsize(max_recv_wr + 1),
-			RTE_CACHE_LINE_SIZE);
+	q->ring = rte_malloc_socket(NULL, rte_ring_get_memsize(max_recv_wr + 1),
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->ring)
 		return -rte_errno;
 	ret = rte_ring_init(q->ring, name, max_recv_wr + 1,
@@ -260,8 +273,9 @@ usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
 		return ret;
 
 	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_recv_free", qpn);
-	q->free_ring = rte_malloc(NULL, rte_ring_get_memsize(max_recv_wr + 1),
-				  RTE_CACHE_LINE_SIZE);
+	q->free_ring = rte_malloc_socket(NULL,
+			rte_ring_get_memsize(max_recv_wr + 1),
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->free_ring)
 		return -rte_errno;
 	ret = rte_ring_init(q->free_ring, name, max_recv_wr + 1,
@@ -271,9 +285,10 @@ usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
 
 	wqe_size = sizeof(struct usiw_recv_wqe)
 					+ max_recv_sge * sizeof(struct iovec);
-	q->storage = calloc(max_recv_wr + 1, wqe_size);
+	q->storage = rte_zmalloc_socket(NULL, (max_recv_wr + 1) * wqe_size,
+			RTE_CACHE_LINE_SIZE, socket_id);
 	if (!q->storage)
-		return -errno;
+		return -ENOMEM;
 
 	for (i = 0; i < max_recv_wr; ++i) {
 		rte_ring_enqueue(q->free_ring, q->storage + i * wqe_size);
@@ -292,7 +307,7 @@ usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q)
 {
 	rte_free(q->ring);
 	rte_free(q->free_ring);
-	free(q->storage);
+	rte_free(q->storage);
 } /* usiw_recv_wqe_queue_destroy */
 
 static void
@@ -330,53 +345,131 @@ usiw_recv_wqe_queue_lookup(struct usiw_recv_wqe_queue *q,
 } /* usiw_recv_wqe_queue_lookup */
 
 
-/* Transmits all packets currently in the transmit queue.  The queue will be
- * empty when this function returns.
- *
- * FIXME: It may be possible for this to never return if there is any error
- * that prevents packets from being transmitted. */
+/* Offers the given burst of packets to the hardware transmit queue of the
+ * device, which is shared by all queue pairs of this process.  Returns the
+ * number of packets that the NIC accepted, which are always the first ones;
+ * this may be fewer than offered if the NIC transmit ring is full. */
+static unsigned int
+transmit_burst(struct usiw_device *dev, struct rte_mbuf **begin,
+		struct rte_mbuf **end)
+{
+	unsigned int ret;
+
+	if (begin == end) {
+		return 0;
+	}
+
+	rte_spinlock_lock(&dev->tx_lock);
+	ret = rte_eth_tx_burst(dev->portid, dev->tx_queue, begin, end - begin);
+	rte_spinlock_unlock(&dev->tx_lock);
+	if (ret > 0) {
+		RTE_LOG(DEBUG, USER1, "Transmitted %u packets\n", ret);
+	}
+	return ret;
+} /* transmit_burst */
+
+
+/* Transmits as much of the TX backlog of the queue pair as the NIC will take
+ * right now.  Anything left over stays at the front of the backlog to be
+ * retried on the next call, so that a full NIC transmit ring never holds up
+ * the progress thread. */
 static void
 flush_tx_queue(struct usiw_qp *qp)
 {
-	struct rte_mbuf **begin;
-	int ret;
+	unsigned int count, sent;
+
+	count = qp->txq_end - qp->txq;
+	sent = transmit_burst(qp->dev, qp->txq, qp->txq_end);
+	if (sent < count) {
+		qp->stats.tx_full_count++;
+		memmove(qp->txq, qp->txq + sent,
+				(count - sent) * sizeof(*qp->txq));
+	}
+	qp->txq_end = qp->txq + (count - sent);
+} /* flush_tx_queue */
 
-	begin = qp->txq;
-	do {
-		ret = rte_eth_tx_burst(qp->dev->portid, qp->shm_qp->tx_queue,
-			begin, qp->txq_end - begin);
-		if (ret > 0) {
-			RTE_LOG(DEBUG, USER1, "Transmitted %d packets\n", ret);
-		}
-		begin += ret;
-	} while (begin != qp->txq_end);
+
+/* Tries to transmit the TX backlog of a queue pair which is going away, and
+ * frees anything that the NIC still has not taken after TX_DRAIN_RETRIES
+ * attempts. */
+static void
+drain_tx_queue(struct usiw_qp *qp)
+{
+	struct rte_mbuf **p;
+	unsigned int i;
+
+	for (i = 0; i < TX_DRAIN_RETRIES && qp->txq_end != qp->txq; ++i) {
+		flush_tx_queue(qp);
+	}
+	for (p = qp->txq; p != qp->txq_end; ++p) {
+		rte_pktmbuf_free(*p);
+		qp->stats.tx_drop_count++;
+	}
 	qp->txq_end = qp->txq;
-} /* flush_tx_queue */
+} /* drain_tx_queue */
 
-/* Prepends an Ethernet header to the frame and enqueues it on the given port.
- * The ether_type should be in host byte order. */
+
+/* Returns the number of frames that can be added to the TX backlog of the
+ * queue pair before it is full. */
+static inline unsigned int
+tx_room(struct usiw_qp *qp)
+{
+	return qp->txq_size - (qp->txq_end - qp->txq);
+} /* tx_room */
+
+
+/* Adds a complete Ethernet frame to the TX backlog of the queue pair, and
+ * tries to transmit the backlog once it holds a full burst.  If the backlog
+ * is full the frame is dropped; senders of DDP segments check tx_room()
+ * first, so this only happens to control packets and retransmissions, which
+ * are recovered by the TRP timers. */
 static void
-enqueue_ether_frame(struct rte_mbuf *sendmsg, unsigned int ether_type,
-		struct usiw_qp *qp, struct ether_addr *dst_addr)
+enqueue_tx_frame(struct usiw_qp *qp, struct rte_mbuf *sendmsg)
 {
-	struct ether_hdr *eth = (struct ether_hdr *)rte_pktmbuf_prepend(sendmsg,
-								sizeof(*eth));
+	unsigned int depth;
 
-	ether_addr_copy(dst_addr, &eth->d_addr);
-	rte_eth_macaddr_get(qp->dev->portid, &eth->s_addr);
-	eth->ether_type = rte_cpu_to_be_16(ether_type);
-	sendmsg->l2_len = sizeof(*eth);
 #ifdef DEBUG_PACKET_HEADERS
 	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Enqueue packet to transmit queue:\n",
 		qp->shm_qp->dev_id, qp->shm_qp->qp_id);
 	rte_pktmbuf_dump(stderr, sendmsg, 128);
 #endif
 
+	if (unlikely(tx_room(qp) == 0)) {
+		flush_tx_queue(qp);
+		if (tx_room(qp) == 0) {
+			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> TX backlog full; dropping packet\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+			qp->stats.tx_drop_count++;
+			rte_pktmbuf_free(sendmsg);
+			return;
+		}
+	}
+
 	*(qp->txq_end++) = sendmsg;
-	if (qp->txq_end == qp->txq + qp->shm_qp->tx_burst_size) {
+	depth = qp->txq_end - qp->txq;
+	if (depth > qp->stats.tx_backlog_max) {
+		qp->stats.tx_backlog_max = depth;
+	}
+	if (depth >= qp->shm_qp->tx_burst_size) {
 		RTE_LOG(DEBUG, USER1, "TX queue filled; early flush forced\n");
 		flush_tx_queue(qp);
 	}
+} /* enqueue_tx_frame */
+
+/* Prepends an Ethernet header to the frame and enqueues it on the given port.
+ * The ether_type should be in host byte order. */
+static void
+enqueue_ether_frame(struct rte_mbuf *sendmsg, unsigned int ether_type,
+		struct usiw_qp *qp, struct ether_addr *dst_addr)
+{
+	struct ether_hdr *eth = (struct ether_hdr *)rte_pktmbuf_prepend(sendmsg,
+								sizeof(*eth));
+
+	ether_addr_copy(dst_addr, &eth->d_addr);
+	rte_eth_macaddr_get(qp->dev->portid, &eth->s_addr);
+	eth->ether_type = rte_cpu_to_be_16(ether_type);
+	sendmsg->l2_len = sizeof(*eth);
+	enqueue_tx_frame(qp, sendmsg);
 } /* enqueue_ether_frame */
 
 /* Appends a skeleton IPv4 header to the packet.  src_addr and dst_addr are in
@@ -432,6 +525,68 @@ prepend_udp_header(struct rte_mbuf *sendmsg, unsigned int src_port,
 	return udp;
 } /* prepend_udp_header */
 
+/* Folds the carry bits of a one's complement sum back into the low 16
+ * bits. */
+static inline uint16_t
+fold_raw_cksum(uint32_t sum)
+{
+	while (sum > UINT16_MAX) {
+		sum = (sum >> 16) + (sum & 0xffff);
+	}
+	return sum;
+} /* fold_raw_cksum */
+
+/* Builds the Ethernet, IPv4 and UDP headers used for every datagram this
+ * queue pair sends to its connected peer, along with the partial checksums
+ * of their constant fields, so that send_udp_dgram() only has to copy the
+ * headers and patch in the lengths and checksums. */
+static void
+qp_tx_template_init(struct usiw_qp *qp)
+{
+	struct usiw_tx_template *t = &qp->tx_hdr;
+	struct {
+		uint32_t src_addr;
+		uint32_t dst_addr;
+		uint8_t zero;
+		uint8_t proto;
+		uint16_t len;
+	} __attribute__((__packed__)) phdr;
+
+	memset(t, 0, sizeof(*t));
+	ether_addr_copy(&qp->shm_qp->remote_ether_addr, &t->eth.d_addr);
+	rte_eth_macaddr_get(qp->dev->portid, &t->eth.s_addr);
+	t->eth.ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	t->ip.version_ihl = 0x45;
+	t->ip.time_to_live = 64;
+	t->ip.next_proto_id = IP_HDR_PROTO_UDP;
+	t->ip.src_addr = qp->dev->ipv4_addr;
+	t->ip.dst_addr = qp->shm_qp->remote_ipv4_addr;
+
+	t->udp.src_port = qp->shm_qp->local_udp_port;
+	t->udp.dst_port = qp->shm_qp->remote_udp_port;
+
+	phdr.src_addr = t->ip.src_addr;
+	phdr.dst_addr = t->ip.dst_addr;
+	phdr.zero = 0;
+	phdr.proto = IP_HDR_PROTO_UDP;
+	phdr.len = 0;
+
+	if (qp->dev->flags & port_checksum_offload) {
+		/* The NIC sums the IPv4 header and the UDP header and payload
+		 * itself, but expects the pseudo-header checksum in
+		 * dgram_cksum */
+		qp->tx_ip_raw_cksum = 0;
+		qp->tx_udp_raw_cksum = rte_raw_cksum(&phdr, sizeof(phdr));
+	} else {
+		/* Both lengths are still zero here */
+		qp->tx_ip_raw_cksum = rte_raw_cksum(&t->ip, sizeof(t->ip));
+		qp->tx_udp_raw_cksum = rte_raw_cksum(&phdr, sizeof(phdr))
+			+ rte_raw_cksum(&t->udp, sizeof(t->udp));
+	}
+} /* qp_tx_template_init */
+
+
 /** Adds a UDP datagram to our packet TX queue to be transmitted when the queue
  * is next flushed.
  *
@@ -440,45 +595,169 @@ prepend_udp_header(struct rte_mbuf *sendmsg, unsigned int src_port,
  * @param sendmsg
  *   The mbuf containing the datagram to send.
  * @param dest
- *   The address handle of the destination for this datagram.
+ *   The address handle of the destination for this datagram, or NULL to send
+ *   to the connected peer of the queue pair.
  * @param payload_checksum
  *   The non-complemented checksum of the packet payload.  Ignored if
  *   checksum_offload is enabled.
  */
 static void
 send_udp_dgram(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
-		uint32_t raw_cksum)
+		const struct urdma_ah *dest, uint32_t raw_cksum)
 {
+	struct usiw_tx_template *hdr;
 	struct udp_hdr *udp;
 	struct ipv4_hdr *ip;
+	uint16_t udp_len, ip_len, cksum;
 
 	if (qp->dev->flags & port_checksum_offload) {
 		sendmsg->ol_flags
 			|= PKT_TX_UDP_CKSUM|PKT_TX_IPV4|PKT_TX_IP_CKSUM;
 	}
 
-	udp = prepend_udp_header(sendmsg, qp->shm_qp->local_udp_port,
-			qp->shm_qp->remote_udp_port);
-	ip = prepend_ipv4_header(sendmsg, IP_HDR_PROTO_UDP,
-			qp->dev->ipv4_addr,
-			qp->shm_qp->remote_ipv4_addr);
-
-	udp->dgram_cksum = rte_ipv4_phdr_cksum(ip, sendmsg->ol_flags);
-	if (!(sendmsg->ol_flags & PKT_TX_UDP_CKSUM)) {
-		raw_cksum += udp->dgram_cksum + udp->src_port
-					+ udp->dst_port + udp->dgram_len;
-		/* Add any carry bits into the checksum. */
-		while (raw_cksum > UINT16_MAX) {
-			raw_cksum = (raw_cksum >> 16) + (raw_cksum & 0xffff);
+	if (dest) {
+		udp = prepend_udp_header(sendmsg, qp->shm_qp->local_udp_port,
+				dest->udp_port);
+		ip = prepend_ipv4_header(sendmsg, IP_HDR_PROTO_UDP,
+				qp->dev->ipv4_addr, dest->ipv4_addr);
+
+		udp->dgram_cksum = rte_ipv4_phdr_cksum(ip, sendmsg->ol_flags);
+		if (!(sendmsg->ol_flags & PKT_TX_UDP_CKSUM)) {
+			raw_cksum += udp->dgram_cksum + udp->src_port
+						+ udp->dst_port + udp->dgram_len;
+			cksum = fold_raw_cksum(raw_cksum);
+			udp->dgram_cksum = (cksum == UINT16_MAX) ? UINT16_MAX
+						: ~cksum;
 		}
-		udp->dgram_cksum = (raw_cksum == UINT16_MAX) ? UINT16_MAX
-					: ~raw_cksum;
+
+		enqueue_ether_frame(sendmsg, ETHER_TYPE_IPv4, qp,
+				(struct ether_addr *)&dest->ether_addr);
+		return;
+	}
+
+	/* Connected peer: copy in the headers built by start_qp() and patch
+	 * the fields which depend on the datagram length */
+	udp_len = rte_cpu_to_be_16(sizeof(*udp) + rte_pktmbuf_pkt_len(sendmsg));
+	ip_len = rte_cpu_to_be_16(sizeof(*ip) + sizeof(*udp)
+					+ rte_pktmbuf_pkt_len(sendmsg));
+	hdr = (struct usiw_tx_template *)rte_pktmbuf_prepend(sendmsg,
+							sizeof(*hdr));
+	memcpy(hdr, &qp->tx_hdr, sizeof(*hdr));
+	sendmsg->l2_len = sizeof(hdr->eth);
+	sendmsg->l3_len = sizeof(hdr->ip);
+	sendmsg->l4_len = sizeof(hdr->udp);
+
+	hdr->ip.total_length = ip_len;
+	hdr->udp.dgram_len = udp_len;
+	if (sendmsg->ol_flags & PKT_TX_UDP_CKSUM) {
+		/* The pseudo-header length is the UDP length */
+		hdr->udp.dgram_cksum = fold_raw_cksum(qp->tx_udp_raw_cksum
+							+ udp_len);
+	} else {
+		/* udp_len appears in both the pseudo-header and the UDP
+		 * header */
+		cksum = fold_raw_cksum(raw_cksum + qp->tx_udp_raw_cksum
+							+ udp_len + udp_len);
+		hdr->udp.dgram_cksum = (cksum == UINT16_MAX) ? UINT16_MAX
+						: ~cksum;
+		cksum = fold_raw_cksum(qp->tx_ip_raw_cksum + ip_len);
+		hdr->ip.hdr_checksum = (cksum == UINT16_MAX) ? UINT16_MAX
+						: ~cksum;
 	}
 
-	enqueue_ether_frame(sendmsg, ETHER_TYPE_IPv4, qp,
-			&qp->shm_qp->remote_ether_addr);
+	enqueue_tx_frame(qp, sendmsg);
 } /* send_udp_dgram */
 
+/** Allocates count mbufs from pool with a single mempool operation.  If the
+ * pool cannot supply the whole burst, falls back to a single mbuf.  Returns
+ * the number of mbufs allocated, which is zero if the pool is empty; the
+ * caller should then leave its work where it is and retry on a later pass of
+ * the progress thread. */
+static unsigned int
+alloc_tx_mbufs(struct usiw_qp *qp, struct rte_mempool *pool,
+		struct rte_mbuf **mbufs, unsigned int count)
+{
+	if (count == 0) {
+		return 0;
+	}
+	if (rte_pktmbuf_alloc_bulk(pool, mbufs, count) == 0) {
+		return count;
+	}
+	if (count > 1 && (mbufs[0] = rte_pktmbuf_alloc(pool)) != NULL) {
+		return 1;
+	}
+	qp->stats.tx_alloc_fail_count++;
+	return 0;
+} /* alloc_tx_mbufs */
+
+/** Returns the number of DDP segments that may be sent to ep before its TRP
+ * send window closes. */
+static inline uint32_t
+send_window(struct ee_state *ep)
+{
+	return serial_less_32(ep->send_next_psn, ep->send_max_psn)
+		? ep->send_max_psn - ep->send_next_psn : 0;
+} /* send_window */
+
+/** Allocates mbufs for the next DDP segments of a message with bytes_left
+ * bytes left to send in segments of at most mtu bytes.  No more mbufs are
+ * allocated than there are segments left, than the send window of ep allows,
+ * than tx_burst_size, than there is room for in the TX backlog, or than the
+ * queue pair has credit for in this pass, so a
+ * segmenter that stops at the end of the message or of the send window always
+ * uses all of them. */
+static unsigned int
+alloc_segment_mbufs(struct usiw_qp *qp, struct ee_state *ep,
+		size_t bytes_left, uint16_t mtu, struct rte_mbuf **mbufs)
+{
+	size_t count;
+
+	count = (bytes_left + mtu - 1) / mtu;
+	count = RTE_MIN(count, send_window(ep));
+	count = RTE_MIN(count, qp->shm_qp->tx_burst_size);
+	count = RTE_MIN(count, tx_room(qp));
+	count = RTE_MIN(count, qp->tx_credit);
+	count = alloc_tx_mbufs(qp, qp->dev->tx_ddp_mempool, mbufs, count);
+	qp->tx_credit -= count;
+	return count;
+} /* alloc_segment_mbufs */
+
+/** Frees a burst of mbufs, all at once if DPDK allows it. */
+static inline void
+free_mbuf_burst(struct rte_mbuf **mbufs, unsigned int count)
+{
+#if HAVE_DECL_RTE_PKTMBUF_FREE_BULK
+	rte_pktmbuf_free_bulk(mbufs, count);
+#else
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		rte_pktmbuf_free(mbufs[i]);
+	}
+#endif
+} /* free_mbuf_burst */
+
+/* Fills in the TRP header of a DDP segment sent to ep, which also
+ * acknowledges everything received from ep so far. */
+static void
+fill_trp_data_hdr(struct trp_hdr *trp, struct ee_state *ep, uint32_t psn)
+{
+	trp->psn = rte_cpu_to_be_32(psn);
+	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
+	trp->opcode = rte_cpu_to_be_16(0);
+	if (!(ep->trp_flags & trp_recv_missing)) {
+		ep->trp_flags &= ~trp_ack_update;
+	}
+} /* fill_trp_data_hdr */
+
+/* Length of the headers prepended in place to a DDP segment by its first
+ * transmission; see send_ddp_segment(). */
+#define DDP_SEGMENT_TX_HDR_LEN (UDP_IPV4_HDR_LEN + sizeof(struct trp_hdr))
+
+/** Retransmits a DDP segment held in tx_pending.  The segment mbuf still
+ * carries the headers of its first transmission, and may still be waiting in
+ * a TX queue, so it is not touched: a clone is trimmed back to the DDP segment
+ * and chained after a fresh header mbuf. */
 static int
 resend_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 		struct ee_state *ep)
@@ -489,33 +768,42 @@ resend_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 	uint32_t payload_raw_cksum = 0;
 
 	info = (struct pending_datagram_info *)(sendmsg + 1);
-	info->next_retransmit = rte_get_timer_cycles()
-		+ rte_get_timer_hz() / 100;
-	if (info->transmit_count++ > RETRANSMIT_MAX) {
+	if (info->transmit_count > RETRANSMIT_MAX) {
 		return -EIO;
 	}
+	if (tx_room(qp) == 0) {
+		return -ENOBUFS;
+	}
 
 	hdr = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
 	if (!hdr) {
+		qp->stats.tx_alloc_fail_count++;
 		return -ENOMEM;
 	}
 
 	sendmsg = rte_pktmbuf_clone(sendmsg, sendmsg->pool);
+	if (!sendmsg) {
+		qp->stats.tx_alloc_fail_count++;
+		rte_pktmbuf_free(hdr);
+		return -ENOMEM;
+	}
+	rte_pktmbuf_adj(sendmsg, DDP_SEGMENT_TX_HDR_LEN);
+
+	/* Only count this transmission once nothing can stop it, so that
+	 * running out of mbufs just delays the retransmission */
+	info->transmit_count++;
+	info->next_retransmit = rte_get_timer_cycles()
+		+ rte_get_timer_hz() / 100;
 
 	trp = (struct trp_hdr *)rte_pktmbuf_append(hdr, sizeof(*trp));
-	trp->psn = rte_cpu_to_be_32(info->psn);
-	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
-	trp->opcode = rte_cpu_to_be_16(0);
-	if (!(ep->trp_flags & trp_recv_missing)) {
-		ep->trp_flags &= ~trp_ack_update;
-	}
+	fill_trp_data_hdr(trp, ep, info->psn);
 
 	rte_pktmbuf_chain(hdr, sendmsg);
-	if (!qp->dev->flags & port_checksum_offload) {
+	if (!(qp->dev->flags & port_checksum_offload)) {
 		payload_raw_cksum = info->ddp_raw_cksum
 			+ rte_raw_cksum(trp, sizeof(*trp));
 	}
-	send_udp_dgram(qp, hdr, payload_raw_cksum);
+	send_udp_dgram(qp, hdr, NULL, payload_raw_cksum);
 
 	return 0;
 } /* resend_ddp_segment */
@@ -528,6 +816,27 @@ tx_pending_entry(struct ee_state *ep, uint32_t psn)
 
 } /* tx_pending_entry */
 
+/** Transmits a DDP segment of an unreliable connected queue pair.  Nothing is
+ * kept for retransmission, so the TRP header is prepended to the segment
+ * itself rather than to a clone, and the mbuf is handed straight to the TX
+ * queue. */
+static void
+send_uc_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg, uint32_t psn)
+{
+	struct trp_hdr *trp;
+
+	trp = (struct trp_hdr *)rte_pktmbuf_prepend(sendmsg, sizeof(*trp));
+	trp->psn = rte_cpu_to_be_32(psn);
+	trp->ack_psn = rte_cpu_to_be_32(0);
+	trp->opcode = rte_cpu_to_be_16(0);
+
+	send_udp_dgram(qp, sendmsg, NULL,
+			(qp->dev->flags & port_checksum_offload) ? 0
+			: rte_raw_cksum(rte_pktmbuf_mtod(sendmsg, void *),
+					rte_pktmbuf_data_len(sendmsg)));
+} /* send_uc_segment */
+
+
 static uint32_t
 send_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 		struct read_response_state *readresp,
@@ -535,13 +844,22 @@ send_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 {
 	struct pending_datagram_info *pending;
 	uint32_t psn = qp->remote_ep.send_next_psn++;
+	struct trp_hdr *trp;
+
+	if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+		send_uc_segment(qp, sendmsg, psn);
+		return psn;
+	}
 
 	pending = (struct pending_datagram_info *)(sendmsg + 1);
 	pending->wqe = wqe;
 	pending->readresp = readresp;
-	pending->transmit_count = 0;
+	pending->transmit_count = 1;
+	pending->next_retransmit = rte_get_timer_cycles()
+		+ rte_get_timer_hz() / 100;
 	pending->ddp_length = payload_length;
-	if (!qp->dev->flags & port_checksum_offload) {
+	pending->ddp_raw_cksum = 0;
+	if (!(qp->dev->flags & port_checksum_offload)) {
 		pending->ddp_raw_cksum = rte_raw_cksum(
 				rte_pktmbuf_mtod(sendmsg, void *),
 				rte_pktmbuf_data_len(sendmsg));
@@ -551,7 +869,17 @@ send_ddp_segment(struct usiw_qp *qp, struct rte_mbuf *sendmsg,
 	assert(*tx_pending_entry(&qp->remote_ep, psn) == NULL);
 	*tx_pending_entry(&qp->remote_ep, psn) = sendmsg;
 
-	resend_ddp_segment(qp, sendmsg, &qp->remote_ep);
+	/* Most segments are never retransmitted, so the first transmission
+	 * prepends its headers to the segment mbuf itself rather than to a
+	 * clone.  The extra reference keeps the mbuf in tx_pending once the
+	 * driver frees it after transmission. */
+	trp = (struct trp_hdr *)rte_pktmbuf_prepend(sendmsg, sizeof(*trp));
+	fill_trp_data_hdr(trp, &qp->remote_ep, psn);
+	rte_mbuf_refcnt_update(sendmsg, 1);
+	send_udp_dgram(qp, sendmsg, NULL, (qp->dev->flags
+				& port_checksum_offload) ? 0
+			: pending->ddp_raw_cksum
+				+ rte_raw_cksum(trp, sizeof(*trp)));
 	return psn;
 } /* send_ddp_segment */
 
@@ -565,6 +893,11 @@ send_trp_sack(struct usiw_qp *qp)
 
 	assert(ep->trp_flags & trp_recv_missing);
 	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
+	if (!sendmsg) {
+		/* trp_ack_update stays set so we try again next pass */
+		qp->stats.tx_alloc_fail_count++;
+		return;
+	}
 	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(ep->recv_sack_psn.min);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_sack_psn.max);
@@ -572,7 +905,7 @@ send_trp_sack(struct usiw_qp *qp)
 
 	ep->trp_flags &= ~trp_ack_update;
 
-	send_udp_dgram(qp, sendmsg,
+	send_udp_dgram(qp, sendmsg, NULL,
 			(qp->dev->flags & port_checksum_offload)
 					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
 } /* send_trp_sack */
@@ -586,6 +919,14 @@ send_trp_fin(struct usiw_qp *qp)
 	struct trp_hdr *trp;
 
 	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
+	if (!sendmsg) {
+		/* The peer will notice that we are gone when its
+		 * retransmissions go unanswered */
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> No mbuf available to send FIN\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		qp->stats.tx_alloc_fail_count++;
+		return;
+	}
 	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(ep->send_next_psn);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
@@ -595,13 +936,13 @@ send_trp_fin(struct usiw_qp *qp)
 		ep->trp_flags &= ~trp_ack_update;
 	}
 
-	send_udp_dgram(qp, sendmsg,
+	send_udp_dgram(qp, sendmsg, NULL,
 			(qp->dev->flags & port_checksum_offload)
 					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
 
-	/* Force flush of TX queue since we are shutting down, but we still
+	/* Push out the TX backlog since we are shutting down, but we still
 	 * need the receiver to get the FIN packet */
-	flush_tx_queue(qp);
+	drain_tx_queue(qp);
 } /* send_trp_fin */
 
 
@@ -614,13 +955,18 @@ send_trp_ack(struct usiw_qp *qp)
 
 	assert(!(ep->trp_flags & trp_recv_missing));
 	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_hdr_mempool);
+	if (!sendmsg) {
+		/* trp_ack_update stays set so we try again next pass */
+		qp->stats.tx_alloc_fail_count++;
+		return;
+	}
 	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp));
 	trp->psn = rte_cpu_to_be_32(ep->send_next_psn);
 	trp->ack_psn = rte_cpu_to_be_32(ep->recv_ack_psn);
 	trp->opcode = rte_cpu_to_be_16(0);
 	ep->trp_flags &= ~trp_ack_update;
 
-	send_udp_dgram(qp, sendmsg,
+	send_udp_dgram(qp, sendmsg, NULL,
 			(qp->dev->flags & port_checksum_offload)
 					? 0 : rte_raw_cksum(trp, sizeof(*trp)));
 } /* send_trp_ack */
@@ -641,12 +987,17 @@ qp_free_send_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 
 /** Returns the given receive WQE back to the free pool.  It is removed from
  * the active set if still_in_hash is true.  The rq lock MUST be locked when
- * calling this function. */
+ * calling this function.  WQEs taken from a shared receive queue go back to
+ * the free pool of the SRQ. */
 static void
 qp_free_recv_wqe(struct usiw_qp *qp, struct usiw_recv_wqe *wqe)
 {
 	usiw_recv_wqe_queue_del_active(&qp->rq0, wqe);
-	rte_ring_enqueue(qp->rq0.free_ring, wqe);
+	if (qp->srq) {
+		rte_ring_enqueue(qp->srq->rq.free_ring, wqe);
+	} else {
+		rte_ring_enqueue(qp->rq0.free_ring, wqe);
+	}
 } /* qp_free_recv_wqe */
 
 
@@ -677,16 +1028,18 @@ qp_get_next_recv_wqe(struct usiw_qp *qp, struct usiw_recv_wqe **wqe)
 } /* qp_get_next_recv_wqe */
 
 
-/** Retrieves a free CQE from the completion queue.  This acquires the lock on
- * the CQ, which must be released by calling finish_post_cqe(). */
+/** Retrieves a free CQE from the completion queue.  This keeps the CQ from
+ * being resized until the CQE is posted by calling finish_post_cqe(). */
 static int
 get_next_cqe(struct usiw_cq *cq, struct usiw_wc **cqe)
 {
 	void *p;
 	int ret;
 
+	usiw_cq_enter(cq, &cq->post_active);
 	ret = rte_ring_dequeue(cq->free_ring, &p);
 	if (ret < 0) {
+		usiw_cq_exit(&cq->post_active);
 		*cqe = NULL;
 		return ret;
 	}
@@ -694,21 +1047,77 @@ get_next_cqe(struct usiw_cq *cq, struct usiw_wc **cqe)
 	return 0;
 } /* get_next_cqe */
 
-/** Places a filled-in CQE into the completion queue.  This releases the lock on
- * the CQ, which must have been acquired previously via get_next_cqe(). */
+/** Signals a completion channel created by urdma_create_comp_channel().  We
+ * write the 8-byte event descriptor that the kernel would have written, which
+ * is the user handle of the CQ; libibverbs sets this to the address of the
+ * ibv_cq, so ibv_get_cq_event() works unmodified.  The CQ is already disarmed
+ * at this point, so if the pipe is full the event is kept pending on the CQ
+ * and written again by retry_channel_event(). */
+static void
+post_channel_event(struct usiw_cq *cq)
+{
+	uint64_t cq_handle = (uintptr_t)&cq->ib_cq;
+	ssize_t ret;
+
+	atomic_fetch_add(&cq->channel_events, 1);
+	ret = write(cq->channel_fd, &cq_handle, sizeof(cq_handle));
+	if (ret != sizeof(cq_handle)) {
+		/* A pipe write this small is atomic, so it either fails
+		 * entirely or succeeds entirely */
+		atomic_fetch_sub(&cq->channel_events, 1);
+		if (errno == EAGAIN) {
+			atomic_store(&cq->channel_retry, true);
+		} else {
+			RTE_LOG(ERR, USER1, "write to completion channel: %s\n",
+					strerror(errno));
+		}
+	}
+} /* post_channel_event */
+
+/** Writes the completion channel event that post_channel_event() could not
+ * write earlier, if any.  Returns true if it is still pending. */
+static bool
+retry_channel_event(struct usiw_cq *cq)
+{
+	if (atomic_exchange(&cq->channel_retry, false)) {
+		post_channel_event(cq);
+		return atomic_load(&cq->channel_retry);
+	}
+	return false;
+} /* retry_channel_event */
+
+/** Places a filled-in CQE, obtained from get_next_cqe(), into the completion
+ * queue.  The
+ * completion channel is signaled if the CQ is armed for all completions, or
+ * if it is armed for solicited completions and solicited is set. */
 static void
-finish_post_cqe(struct usiw_cq *cq, struct usiw_wc *cqe)
+finish_post_cqe(struct usiw_cq *cq, struct usiw_wc *cqe, bool solicited)
 {
 	struct urdma_cq_event event;
 	struct usiw_context *ctx;
+	unsigned int notify;
 	ssize_t ret;
 
 	ret = rte_ring_enqueue(cq->cqe_ring, cqe);
 	assert(ret == 0);
+	usiw_cq_exit(&cq->post_active);
 	ctx = usiw_get_context(cq->ib_cq.context);
 	assert(ctx != NULL);
 
-	if (ctx && atomic_exchange(&cq->notify_flag, false)) {
+	notify = atomic_load(&cq->notify);
+	do {
+		if (notify == usiw_cq_notify_none
+				|| (notify == usiw_cq_notify_solicited
+					&& !solicited)) {
+			return;
+		}
+	} while (!atomic_compare_exchange_weak(&cq->notify, &notify,
+						usiw_cq_notify_none));
+	if (ctx) {
+		if (cq->channel_fd >= 0) {
+			post_channel_event(cq);
+			return;
+		}
 		event.event_type = SIW_EVENT_COMP_POSTED;
 		event.cq_id = cq->cq_id;
 		ret = write(ctx->event_fd, &event, sizeof(event));
@@ -733,6 +1142,7 @@ post_recv_cqe(struct usiw_qp *qp, struct usiw_recv_wqe *wqe,
 {
 	struct usiw_wc *cqe;
 	struct usiw_cq *cq;
+	bool solicited;
 	int ret;
 
 	cq = qp->recv_cq;
@@ -744,12 +1154,22 @@ post_recv_cqe(struct usiw_qp *qp, struct usiw_recv_wqe *wqe,
 	}
 	cqe->wr_context = wqe->wr_context;
 	cqe->status = status;
-	cqe->opcode = IBV_WC_RECV;
+	cqe->opcode = (wqe->flags & usiw_recv_rdma_with_imm)
+		? IBV_WC_RECV_RDMA_WITH_IMM : IBV_WC_RECV;
 	cqe->byte_len = wqe->input_size;
 	cqe->qp_num = qp->ib_qp.qp_num;
+	cqe->imm_data = wqe->imm_data;
+	cqe->wc_flags = (wqe->flags & usiw_recv_with_imm)
+		? IBV_WC_WITH_IMM : 0;
+	if (wqe->flags & usiw_recv_with_grh) {
+		cqe->wc_flags |= IBV_WC_GRH;
+	}
+
+	solicited = (wqe->flags & usiw_recv_solicited)
+		|| status != IBV_WC_SUCCESS;
 
 	qp_free_recv_wqe(qp, wqe);
-	finish_post_cqe(cq, cqe);
+	finish_post_cqe(cq, cqe, solicited);
 	return 0;
 } /* post_recv_cqe */
 
@@ -759,8 +1179,10 @@ get_ibv_send_wc_opcode(enum usiw_send_opcode ours)
 {
 	switch (ours) {
 	case usiw_wr_send:
+	case usiw_wr_send_with_imm:
 		return IBV_WC_SEND;
 	case usiw_wr_write:
+	case usiw_wr_write_with_imm:
 		return IBV_WC_RDMA_WRITE;
 	case usiw_wr_read:
 		return IBV_WC_RDMA_READ;
@@ -792,11 +1214,22 @@ post_send_cqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 	}
 	cqe->wr_context = wqe->wr_context;
 	cqe->status = status;
-	cqe->opcode = get_ibv_send_wc_opcode(wqe->opcode);
+	switch (wqe->opcode == usiw_wr_read ? wqe->atomic_op
+					    : rdmap_atomic_none) {
+	case rdmap_atomic_fetch_add:
+		cqe->opcode = IBV_WC_FETCH_ADD;
+		break;
+	case rdmap_atomic_cmp_swap:
+		cqe->opcode = IBV_WC_COMP_SWAP;
+		break;
+	default:
+		cqe->opcode = get_ibv_send_wc_opcode(wqe->opcode);
+	}
 	cqe->qp_num = qp->ib_qp.qp_num;
+	cqe->wc_flags = 0;
 
 	qp_free_send_wqe(qp, wqe, true);
-	finish_post_cqe(cq, cqe);
+	finish_post_cqe(cq, cqe, status != IBV_WC_SUCCESS);
 	return 0;
 } /* post_send_cqe */
 
@@ -807,7 +1240,10 @@ rq_flush(struct usiw_qp *qp)
 	struct usiw_recv_wqe *wqe, *next;
 
 	rte_spinlock_lock(&qp->rq0.lock);
-	while (rte_ring_dequeue(qp->rq0.ring, (void **)&wqe) == 0) {
+	/* WQEs still on a shared receive queue belong to the other queue
+	 * pairs attached to it; only flush those that this QP has already
+	 * taken. */
+	while (!qp->srq && rte_ring_dequeue(qp->rq0.ring, (void **)&wqe) == 0) {
 		wqe->msn = qp->rq0.next_msn++;
 		usiw_recv_wqe_queue_add_active(&qp->rq0, wqe);
 	}
@@ -862,37 +1298,66 @@ memcpy_from_iov(char * restrict dest, size_t dest_size,
 static void
 do_rdmap_send(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
+	struct rte_mbuf *mbufs[qp->shm_qp->tx_burst_size];
 	struct rdmap_untagged_packet *new_rdmap;
+	struct rdmap_immediate_packet *imm;
 	struct rte_mbuf *sendmsg;
-	unsigned int packet_length;
-	size_t payload_length;
+	unsigned int packet_length, mbuf_count, mbuf_next;
+	size_t hdr_size, payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
+	uint8_t opcode;
+
+	if (wqe->opcode == usiw_wr_send_with_imm) {
+		opcode = (wqe->flags & usiw_send_solicited)
+			? rdmap_opcode_send_imm_se : rdmap_opcode_send_imm;
+		hdr_size = sizeof(struct rdmap_immediate_packet);
+	} else {
+		opcode = (wqe->flags & usiw_send_solicited)
+			? rdmap_opcode_send_se : rdmap_opcode_send;
+		hdr_size = sizeof(struct rdmap_untagged_packet);
+	}
 
+	mbuf_count = mbuf_next = 0;
 	while (wqe->bytes_sent < wqe->total_length
 			&& serial_less_32(wqe->remote_ep->send_next_psn,
 					wqe->remote_ep->send_max_psn)) {
-		sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+		if (mbuf_next == mbuf_count) {
+			mbuf_count = alloc_segment_mbufs(qp, wqe->remote_ep,
+					wqe->total_length - wqe->bytes_sent,
+					mtu, mbufs);
+			mbuf_next = 0;
+			if (!mbuf_count) {
+				break;
+			}
+		}
+		sendmsg = mbufs[mbuf_next++];
 
 		payload_length = RTE_MIN(mtu, wqe->total_length
 				- wqe->bytes_sent);
-		packet_length = RDMAP_UNTAGGED_ALLOC_SIZE(payload_length);
+		packet_length = hdr_size + payload_length;
 		new_rdmap = (struct rdmap_untagged_packet *)rte_pktmbuf_append(
 					sendmsg, packet_length);
 		new_rdmap->head.ddp_flags = (wqe->total_length
 				- wqe->bytes_sent <= mtu)
 			? DDP_V1_UNTAGGED_LAST_DF
 			: DDP_V1_UNTAGGED_DF;
-		new_rdmap->head.rdmap_info = rdmap_opcode_send | RDMAP_V1;
+		new_rdmap->head.rdmap_info = opcode | RDMAP_V1;
 		new_rdmap->head.sink_stag = rte_cpu_to_be_32(0);
 		new_rdmap->qn = rte_cpu_to_be_32(0);
 		new_rdmap->msn = rte_cpu_to_be_32(wqe->msn);
 		new_rdmap->mo = rte_cpu_to_be_32(wqe->bytes_sent);
+		if (hdr_size == sizeof(struct rdmap_immediate_packet)) {
+			imm = (struct rdmap_immediate_packet *)new_rdmap;
+			imm->imm_data = wqe->imm_data;
+			imm->rdma_length = rte_cpu_to_be_32(0);
+		}
 		if (wqe->flags & usiw_send_inline) {
-			memcpy(PAYLOAD_OF(new_rdmap),
+			memcpy((char *)new_rdmap + hdr_size,
 					(char *)wqe->iov + wqe->bytes_sent,
 					payload_length);
 		} else {
-			memcpy_from_iov(PAYLOAD_OF(new_rdmap), payload_length,
+			memcpy_from_iov((char *)new_rdmap + hdr_size,
+					payload_length,
 					wqe->iov, wqe->iov_count,
 					wqe->bytes_sent);
 		}
@@ -908,24 +1373,129 @@ do_rdmap_send(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 	}
 
 	if (wqe->bytes_sent == wqe->total_length) {
-		wqe->state = SEND_WQE_WAIT;
+		wqe->state = (qp->ib_qp.qp_type == IBV_QPT_UC)
+			? SEND_WQE_COMPLETE : SEND_WQE_WAIT;
 	}
 } /* do_rdmap_send */
 
 
+/** Sends the datagram for a SEND WQE posted to an unreliable datagram queue
+ * pair.  The whole message must fit in one segment, which was checked when the
+ * WQE was posted.  Nothing is retransmitted, so the mbuf is handed straight to
+ * the TX queue and the WQE is complete as soon as it has been queued.  If no
+ * mbuf or TX backlog space is available the WQE is left in the TRANSFER state
+ * to be retried. */
+static void
+do_ud_send(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
+{
+	struct rdmap_untagged_packet *new_rdmap;
+	struct rte_mbuf *sendmsg;
+	struct trp_hdr *trp;
+	uint32_t raw_cksum;
+
+	if (tx_room(qp) == 0
+			|| !alloc_tx_mbufs(qp, qp->dev->tx_ddp_mempool,
+					&sendmsg, 1)) {
+		return;
+	}
+
+	trp = (struct trp_hdr *)rte_pktmbuf_append(sendmsg, sizeof(*trp)
+			+ sizeof(*new_rdmap) + wqe->total_length);
+	trp->psn = rte_cpu_to_be_32(0);
+	trp->ack_psn = rte_cpu_to_be_32(0);
+	trp->opcode = rte_cpu_to_be_16(trp_ud);
+
+	new_rdmap = (struct rdmap_untagged_packet *)(trp + 1);
+	new_rdmap->head.ddp_flags = DDP_V1_UNTAGGED_LAST_DF;
+	new_rdmap->head.rdmap_info = ((wqe->flags & usiw_send_solicited)
+			? rdmap_opcode_send_se : rdmap_opcode_send) | RDMAP_V1;
+	new_rdmap->head.sink_stag = rte_cpu_to_be_32(0);
+	new_rdmap->qn = rte_cpu_to_be_32(0);
+	new_rdmap->msn = rte_cpu_to_be_32(0);
+	new_rdmap->mo = rte_cpu_to_be_32(0);
+	if (wqe->flags & usiw_send_inline) {
+		memcpy(PAYLOAD_OF(new_rdmap), (char *)wqe->iov,
+				wqe->total_length);
+	} else {
+		memcpy_from_iov(PAYLOAD_OF(new_rdmap), wqe->total_length,
+				wqe->iov, wqe->iov_count, 0);
+	}
+
+	raw_cksum = (qp->dev->flags & port_checksum_offload) ? 0
+		: rte_raw_cksum(rte_pktmbuf_mtod(sendmsg, void *),
+				rte_pktmbuf_data_len(sendmsg));
+	send_udp_dgram(qp, sendmsg, &wqe->ah, raw_cksum);
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> UD SEND transmit %zu bytes to %" PRIx32 ":%" PRIu16 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			wqe->total_length,
+			rte_be_to_cpu_32(wqe->ah.ipv4_addr),
+			rte_be_to_cpu_16(wqe->ah.udp_port));
+
+	wqe->bytes_sent = wqe->total_length;
+	wqe->state = SEND_WQE_COMPLETE;
+} /* do_ud_send */
+
+
+/** Sends the Immediate Data message that follows the data of an RDMA WRITE
+ * with Immediate Data.  The message consumes a receive WQE at the data sink,
+ * so it uses the MSN assigned to the WQE from the SEND queue.  Returns false
+ * if no mbuf was available, in which case the caller should try again
+ * later. */
+static bool
+do_rdmap_immediate_data(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
+{
+	struct rdmap_immediate_packet *new_rdmap;
+	struct rte_mbuf *sendmsg;
+
+	if (!alloc_tx_mbufs(qp, qp->dev->tx_ddp_mempool, &sendmsg, 1)) {
+		return false;
+	}
+	new_rdmap = (struct rdmap_immediate_packet *)rte_pktmbuf_append(
+				sendmsg, sizeof(*new_rdmap));
+	new_rdmap->untagged.head.ddp_flags = DDP_V1_UNTAGGED_LAST_DF;
+	new_rdmap->untagged.head.rdmap_info
+		= ((wqe->flags & usiw_send_solicited)
+			? rdmap_opcode_immediate_data_se
+			: rdmap_opcode_immediate_data) | RDMAP_V1;
+	new_rdmap->untagged.head.sink_stag = rte_cpu_to_be_32(0);
+	new_rdmap->untagged.qn = rte_cpu_to_be_32(0);
+	new_rdmap->untagged.msn = rte_cpu_to_be_32(wqe->msn);
+	new_rdmap->untagged.mo = rte_cpu_to_be_32(0);
+	new_rdmap->imm_data = wqe->imm_data;
+	new_rdmap->rdma_length = rte_cpu_to_be_32(wqe->total_length);
+
+	send_ddp_segment(qp, sendmsg, NULL, wqe, 0);
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Immediate Data transmit msn=%" PRIu32 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id, wqe->msn);
+	return true;
+} /* do_rdmap_immediate_data */
+
+
 static void
 do_rdmap_write(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
+	struct rte_mbuf *mbufs[qp->shm_qp->tx_burst_size];
 	struct rdmap_tagged_packet *new_rdmap;
 	struct rte_mbuf *sendmsg;
+	unsigned int mbuf_count, mbuf_next;
 	size_t payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
 	void *payload;
 
+	mbuf_count = mbuf_next = 0;
 	while (wqe->bytes_sent < wqe->total_length
 			&& serial_less_32(wqe->remote_ep->send_next_psn,
 					wqe->remote_ep->send_max_psn)) {
-		sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+		if (mbuf_next == mbuf_count) {
+			mbuf_count = alloc_segment_mbufs(qp, wqe->remote_ep,
+					wqe->total_length - wqe->bytes_sent,
+					mtu, mbufs);
+			mbuf_next = 0;
+			if (!mbuf_count) {
+				break;
+			}
+		}
+		sendmsg = mbufs[mbuf_next++];
 
 		payload_length = RTE_MIN(mtu, wqe->total_length
 				- wqe->bytes_sent);
@@ -958,16 +1528,60 @@ do_rdmap_write(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 		wqe->bytes_sent += payload_length;
 	}
 
-	if (wqe->bytes_sent == wqe->total_length) {
-		wqe->state = SEND_WQE_WAIT;
+	if (wqe->bytes_sent == wqe->total_length
+			&& wqe->state == SEND_WQE_TRANSFER) {
+		if (wqe->opcode == usiw_wr_write_with_imm) {
+			if (!serial_less_32(wqe->remote_ep->send_next_psn,
+					wqe->remote_ep->send_max_psn)) {
+				return;
+			}
+			if (!do_rdmap_immediate_data(qp, wqe)) {
+				return;
+			}
+		}
+		wqe->state = (qp->ib_qp.qp_type == IBV_QPT_UC)
+			? SEND_WQE_COMPLETE : SEND_WQE_WAIT;
 	}
 } /* do_rdmap_write */
 
 
+/** Sends an Atomic Request in sendmsg.  The caller is responsible for checking
+ * and consuming the outbound read credits, which atomic operations share with
+ * RDMA READ Requests. */
+static void
+do_rdmap_atomic_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
+		struct rte_mbuf *sendmsg)
+{
+	struct rdmap_atomicreq_packet *new_rdmap;
+
+	new_rdmap = (struct rdmap_atomicreq_packet *)rte_pktmbuf_append(
+				sendmsg, sizeof(*new_rdmap));
+	new_rdmap->untagged.head.ddp_flags = DDP_V1_UNTAGGED_LAST_DF;
+	new_rdmap->untagged.head.rdmap_info
+		= rdmap_opcode_atomic_request | RDMAP_V1;
+	new_rdmap->untagged.head.sink_stag = rte_cpu_to_be_32(wqe->local_stag);
+	new_rdmap->untagged.qn = rte_cpu_to_be_32(1);
+	new_rdmap->untagged.msn = rte_cpu_to_be_32(wqe->msn);
+	new_rdmap->untagged.mo = rte_cpu_to_be_32(0);
+	new_rdmap->sink_offset = rte_cpu_to_be_64(
+			RDMAP_READ_SCATTER_OFFSET(wqe->msn, 0));
+	new_rdmap->atomic_op = rte_cpu_to_be_32(wqe->atomic_op);
+	new_rdmap->source_stag = rte_cpu_to_be_32(wqe->rkey);
+	new_rdmap->source_offset = rte_cpu_to_be_64(wqe->remote_addr);
+	new_rdmap->swap_add_data = rte_cpu_to_be_64(wqe->atomic_swap_add);
+	new_rdmap->compare_data = rte_cpu_to_be_64(wqe->atomic_compare);
+
+	send_ddp_segment(qp, sendmsg, NULL, wqe, 0);
+
+	wqe->state = SEND_WQE_WAIT;
+} /* do_rdmap_atomic_request */
+
+
 static void
 do_rdmap_read_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 {
 	struct rdmap_readreq_packet *new_rdmap;
+	struct read_request_state *readreq;
 	struct rte_mbuf *sendmsg;
 	unsigned int packet_length;
 
@@ -987,9 +1601,22 @@ do_rdmap_read_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 		 * to send. */
 		return;
 	}
+	if (!alloc_tx_mbufs(qp, qp->dev->tx_ddp_mempool, &sendmsg, 1)) {
+		return;
+	}
 	qp->ord_active++;
 
-	sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+	/* Requests are sent in MSN order and at most ord_max are outstanding,
+	 * so this entry was freed by the request ord_max MSNs earlier */
+	readreq = &qp->readreq_store[wqe->msn & qp->readreq_mask];
+	assert(!readreq->wqe);
+	readreq->wqe = wqe;
+	readreq->last_received = false;
+
+	if (wqe->atomic_op) {
+		do_rdmap_atomic_request(qp, wqe, sendmsg);
+		return;
+	}
 
 	packet_length = sizeof(*new_rdmap);
 	new_rdmap = (struct rdmap_readreq_packet *)rte_pktmbuf_append(
@@ -1001,9 +1628,9 @@ do_rdmap_read_request(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 	new_rdmap->untagged.qn = rte_cpu_to_be_32(1);
 	new_rdmap->untagged.msn = rte_cpu_to_be_32(wqe->msn);
 	new_rdmap->untagged.mo = rte_cpu_to_be_32(0);
-	new_rdmap->sink_offset
-		= rte_cpu_to_be_64((uintptr_t)wqe->iov[0].iov_base);
-	new_rdmap->read_msg_size = rte_cpu_to_be_32(wqe->iov[0].iov_len);
+	new_rdmap->sink_offset = rte_cpu_to_be_64(
+			RDMAP_READ_SCATTER_OFFSET(wqe->msn, 0));
+	new_rdmap->read_msg_size = rte_cpu_to_be_32(wqe->total_length);
 	new_rdmap->source_stag = rte_cpu_to_be_32(wqe->rkey);
 	new_rdmap->source_offset = rte_cpu_to_be_64(wqe->remote_addr);
 
@@ -1039,6 +1666,13 @@ do_rdmap_terminate(struct usiw_qp *qp, struct packet_context *orig,
 	struct rdmap_terminate_packet *new_rdmap;
 	struct rdmap_terminate_payload *payload;
 
+	if (!sendmsg) {
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> No mbuf available to send TERMINATE %#" PRIx16 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id, errcode);
+		qp->stats.tx_alloc_fail_count++;
+		return;
+	}
+
 	new_rdmap = (struct rdmap_terminate_packet *)rte_pktmbuf_append(sendmsg,
 					sizeof(*new_rdmap));
 	new_rdmap->untagged.head.ddp_flags = DDP_V1_UNTAGGED_LAST_DF;
@@ -1134,31 +1768,161 @@ dequeue_recv_wqes(struct usiw_qp *qp)
 } /* dequeue_recv_wqes */
 
 
+/** Notifies the verbs consumer if the number of receive WQEs posted to the
+ * shared receive queue has dropped below its armed limit.  The limit is
+ * disarmed once the event is raised; the consumer must re-arm it with
+ * ibv_modify_srq(3). */
 static void
-process_send(struct usiw_qp *qp, struct packet_context *orig)
+srq_check_limit(struct usiw_srq *srq)
 {
-	struct usiw_recv_wqe *wqe;
-	struct rdmap_untagged_packet *rdmap
-		= (struct rdmap_untagged_packet *)orig->rdmap;
-	uint32_t msn, expected_msn;
-	size_t offset;
-	size_t payload_length;
-	int ret;
+	struct urdma_srq_event event;
+	unsigned int limit;
+	ssize_t ret;
 
-	if (!list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active))
-		dequeue_recv_wqes(qp);
+	limit = atomic_load(&srq->srq_limit);
+	if (!limit || rte_ring_count(srq->rq.ring) >= limit
+			|| !atomic_compare_exchange_strong(&srq->srq_limit,
+							   &limit, 0)) {
+		return;
+	}
 
-	msn = rte_be_to_cpu_32(rdmap->msn);
-	ret = usiw_recv_wqe_queue_lookup(&qp->rq0, msn, &wqe);
-	assert(ret != -EINVAL);
+	event.event_type = SIW_EVENT_SRQ_LIMIT_REACHED;
+	event.srq_id = srq->srq_id;
+	ret = write(srq->ctx->event_fd, &event, sizeof(event));
 	if (ret < 0) {
-		if (list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active)) {
-			/* This is a duplicate of a previously received
-			 * message --- should never happen since TRP will not
-			 * give us a duplicate packet. */
-			expected_msn = list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active)->msn;
-			RTE_LOG(INFO, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Received msn=%" PRIu32 " but expected msn=%" PRIu32 "\n",
-					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+		RTE_LOG(ERR, USER1, "write to event fd: %s\n",
+				strerror(errno));
+	} else if ((size_t)ret < sizeof(event)) {
+		RTE_LOG(ERR, USER1, "partial write to event fd: %zd/%zu bytes\n",
+				ret, sizeof(event));
+	}
+} /* srq_check_limit */
+
+
+/** Pull recv WQEs off of the shared receive queue for the given qp, until the
+ * WQE matching msn is active.  Unlike dequeue_recv_wqes(), WQEs are only taken
+ * as SEND messages arrive, so that the pool is shared fairly between all queue
+ * pairs attached to the SRQ. */
+static void
+srq_dequeue_recv_wqes(struct usiw_qp *qp, uint32_t msn)
+{
+	struct usiw_srq *srq = qp->srq;
+	struct usiw_recv_wqe *wqe;
+
+	/* Do not let a bogus MSN drain the shared pool */
+	if (msn - qp->rq0.next_msn >= (uint32_t)srq->rq.max_wr) {
+		return;
+	}
+
+	while (!serial_less_32(msn, qp->rq0.next_msn)
+			&& rte_ring_dequeue(srq->rq.ring, (void **)&wqe) == 0) {
+		wqe->remote_ep = &qp->remote_ep;
+		wqe->msn = qp->rq0.next_msn++;
+		usiw_recv_wqe_queue_add_active(&qp->rq0, wqe);
+	}
+	srq_check_limit(srq);
+} /* srq_dequeue_recv_wqes */
+
+
+/** Marks a receive WQE of an unreliable connected queue pair whose message
+ * lost a segment.  It completes with IBV_WC_GENERAL_ERR and the number of
+ * bytes that did arrive, and the queue pair remains usable. */
+static void
+uc_mark_recv_lost(struct usiw_qp *qp, struct usiw_recv_wqe *wqe)
+{
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> message msn=%" PRIu32 " lost after %zu bytes\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			wqe->msn, wqe->recv_size);
+	wqe->flags |= usiw_recv_lost;
+	wqe->input_size = wqe->recv_size;
+	wqe->complete = true;
+	qp->stats.recv_msg_lost_count++;
+} /* uc_mark_recv_lost */
+
+
+/** On an unreliable connected queue pair, a segment of the message with the
+ * given MSN means that every earlier message has either been received in full
+ * or lost a segment that will never be retransmitted.  Completes the receive
+ * WQEs of the lost messages so that they do not hold up later messages. */
+static void
+uc_drop_lost_messages(struct usiw_qp *qp, uint32_t msn)
+{
+	struct usiw_recv_wqe *wqe;
+
+	while ((wqe = list_top(&qp->rq0.active_head,
+					struct usiw_recv_wqe, active))
+			&& serial_less_32(wqe->msn, msn)) {
+		if (!wqe->complete) {
+			uc_mark_recv_lost(qp, wqe);
+		}
+		rte_spinlock_lock(&qp->rq0.lock);
+		post_recv_cqe(qp, wqe, (wqe->flags & usiw_recv_lost)
+				? IBV_WC_GENERAL_ERR : IBV_WC_SUCCESS);
+		rte_spinlock_unlock(&qp->rq0.lock);
+	}
+} /* uc_drop_lost_messages */
+
+
+static void
+process_send(struct usiw_qp *qp, struct packet_context *orig)
+{
+	struct usiw_recv_wqe *wqe;
+	struct rdmap_untagged_packet *rdmap
+		= (struct rdmap_untagged_packet *)orig->rdmap;
+	struct rdmap_immediate_packet *imm;
+	uint32_t msn, expected_msn;
+	size_t offset;
+	size_t hdr_size, payload_length;
+	uint8_t opcode;
+	int ret;
+
+	opcode = RDMAP_GET_OPCODE(rdmap->head.rdmap_info);
+	switch (opcode) {
+	case rdmap_opcode_send_imm:
+	case rdmap_opcode_send_imm_se:
+	case rdmap_opcode_immediate_data:
+	case rdmap_opcode_immediate_data_se:
+		imm = (struct rdmap_immediate_packet *)rdmap;
+		hdr_size = sizeof(*imm);
+		break;
+	default:
+		imm = NULL;
+		hdr_size = sizeof(*rdmap);
+	}
+
+	msn = rte_be_to_cpu_32(rdmap->msn);
+	if (qp->srq) {
+		srq_dequeue_recv_wqes(qp, msn);
+	} else if (!list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active)) {
+		dequeue_recv_wqes(qp);
+	}
+
+	if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+		uc_drop_lost_messages(qp, msn);
+	}
+
+	ret = usiw_recv_wqe_queue_lookup(&qp->rq0, msn, &wqe);
+	assert(ret != -EINVAL);
+	if (ret < 0) {
+		if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+			/* Late segment of a message that we already gave up
+			 * on, or a message with no receive WQE; either way
+			 * the connection survives */
+			if (!serial_less_32(msn, qp->rq0.next_msn)) {
+				qp->stats.recv_msg_lost_count++;
+			}
+			return;
+		}
+		if (qp->srq ? serial_less_32(msn, qp->rq0.next_msn)
+				: !!list_top(&qp->rq0.active_head,
+					struct usiw_recv_wqe, active)) {
+			/* This is a duplicate of a previously received
+			 * message --- should never happen since TRP will not
+			 * give us a duplicate packet. */
+			wqe = list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active);
+			expected_msn = wqe ? wqe->msn : qp->rq0.next_msn;
+			RTE_LOG(INFO, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Received msn=%" PRIu32 " but expected msn=%" PRIu32 "\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 					msn, expected_msn);
 			do_rdmap_terminate(qp, orig,
 					ddp_error_untagged_invalid_msn);
@@ -1166,15 +1930,43 @@ process_send(struct usiw_qp *qp, struct packet_context *orig)
 			RTE_LOG(INFO, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Received SEND msn=%" PRIu32 " to empty receive queue\n",
 					qp->dev->portid,
 					qp->shm_qp->rx_queue, msn);
-			assert(rte_ring_empty(qp->rq0.ring));
+			assert(qp->srq || rte_ring_empty(qp->rq0.ring));
 			do_rdmap_terminate(qp, orig,
 					ddp_error_untagged_no_buffer);
 		}
 		return;
 	}
 
+	if (imm) {
+		wqe->flags |= usiw_recv_with_imm;
+		wqe->imm_data = imm->imm_data;
+	}
+	switch (opcode) {
+	case rdmap_opcode_send_se:
+	case rdmap_opcode_send_se_inv:
+	case rdmap_opcode_send_imm_se:
+	case rdmap_opcode_immediate_data_se:
+		wqe->flags |= usiw_recv_solicited;
+		break;
+	}
+
+	if (opcode != rdmap_opcode_send_imm
+			&& opcode != rdmap_opcode_send_imm_se && imm) {
+		/* Immediate Data message following an RDMA WRITE: there is no
+		 * payload to place, so the receive WQE is complete as soon as
+		 * the preceding tagged segments have all been placed. */
+		if (wqe->complete) {
+			return;
+		}
+		wqe->flags |= usiw_recv_rdma_with_imm;
+		wqe->input_size = wqe->recv_size
+			= rte_be_to_cpu_32(imm->rdma_length);
+		wqe->complete = true;
+		goto post_completions;
+	}
+
 	offset = rte_be_to_cpu_32(rdmap->mo);
-	payload_length = orig->ddp_seg_length - sizeof(struct rdmap_untagged_packet);
+	payload_length = orig->ddp_seg_length - hdr_size;
 	if (offset + payload_length > wqe->total_request_size) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> DROP: offset=%zu + payload_length=%zu > wr_len=%zu\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
@@ -1193,14 +1985,18 @@ process_send(struct usiw_qp *qp, struct packet_context *orig)
 		wqe->input_size = offset + payload_length;
 	}
 
-	memcpy_to_iov(wqe->iov, wqe->iov_count, PAYLOAD_OF(rdmap),
+	memcpy_to_iov(wqe->iov, wqe->iov_count, (char *)rdmap + hdr_size,
 			payload_length, offset);
 	wqe->recv_size += payload_length;
 	assert(wqe->input_size == 0 || wqe->recv_size <= wqe->input_size);
 	if (wqe->recv_size == wqe->input_size) {
 		wqe->complete = true;
+	} else if (qp->ib_qp.qp_type == IBV_QPT_UC && wqe->input_size != 0) {
+		/* The last segment arrived but an earlier one did not */
+		uc_mark_recv_lost(qp, wqe);
 	}
 
+post_completions:
 	/* Post completion, but only if there are no holes in the LLP packet
 	 * sequence. This ensures that even in the case of missing packets,
 	 * we maintain the ordering between received Tagged and Untagged
@@ -1210,7 +2006,8 @@ process_send(struct usiw_qp *qp, struct packet_context *orig)
 		wqe = list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active);
 		while (wqe && wqe->complete) {
 			rte_spinlock_lock(&qp->rq0.lock);
-			post_recv_cqe(qp, wqe, IBV_WC_SUCCESS);
+			post_recv_cqe(qp, wqe, (wqe->flags & usiw_recv_lost)
+					? IBV_WC_GENERAL_ERR : IBV_WC_SUCCESS);
 			rte_spinlock_unlock(&qp->rq0.lock);
 			wqe = list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active);
 		}
@@ -1218,29 +2015,77 @@ process_send(struct usiw_qp *qp, struct packet_context *orig)
 }	/* process_send */
 
 
+/** Executes the atomic operation requested in readresp against the target
+ * memory and replaces the response source with the original value.  This is
+ * done only once all preceding RDMA READ Responses have been generated, so
+ * that the atomic operation is ordered with respect to them. */
+static void
+execute_atomic(struct read_response_state *readresp)
+{
+	uint64_t *target = (uint64_t *)readresp->vaddr;
+	uint64_t orig;
+
+	switch (readresp->atomic_op) {
+	case rdmap_atomic_fetch_add:
+		orig = __atomic_fetch_add(target, readresp->atomic_swap_add,
+				__ATOMIC_SEQ_CST);
+		break;
+	case rdmap_atomic_cmp_swap:
+		orig = readresp->atomic_compare;
+		__atomic_compare_exchange_n(target, &orig,
+				readresp->atomic_swap_add, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		break;
+	default:
+		assert(0);
+		return;
+	}
+
+	readresp->atomic_orig = rte_cpu_to_be_64(orig);
+	readresp->vaddr = (char *)&readresp->atomic_orig;
+	readresp->atomic_op = rdmap_atomic_none;
+} /* execute_atomic */
+
+
 static int
 respond_rdma_read(struct usiw_qp *qp)
 {
+	struct rte_mbuf *mbufs[qp->shm_qp->tx_burst_size];
 	struct rdmap_tagged_packet *new_rdmap;
 	struct read_response_state *readresp;
 	struct rte_mbuf *sendmsg;
 	size_t dgram_length;
 	size_t payload_length;
 	uint16_t mtu = qp->shm_qp->mtu;
-	unsigned long msn, end;
+	unsigned int mbuf_count, mbuf_next;
+	uint32_t msn, end;
 	int count;
 
 	count = 0;
 	for (msn = qp->readresp_head_msn, end = msn + qp->shm_qp->ird_max;
 							msn != end; ++msn) {
-		readresp = &qp->readresp_store[msn % qp->shm_qp->ird_max];
+		readresp = &qp->readresp_store[msn & qp->readresp_mask];
 		if (!readresp->active) {
 			break;
 		}
+		if (readresp->atomic_op) {
+			execute_atomic(readresp);
+		}
+		mbuf_count = mbuf_next = 0;
 		while (readresp->msg_size > 0
 				&& serial_less_32(readresp->sink_ep->send_next_psn,
 					readresp->sink_ep->send_max_psn)) {
-			sendmsg = rte_pktmbuf_alloc(qp->dev->tx_ddp_mempool);
+			if (mbuf_next == mbuf_count) {
+				mbuf_count = alloc_segment_mbufs(qp,
+						readresp->sink_ep,
+						readresp->msg_size, mtu,
+						mbufs);
+				mbuf_next = 0;
+				if (!mbuf_count) {
+					break;
+				}
+			}
+			sendmsg = mbufs[mbuf_next++];
 
 			payload_length = RTE_MIN(mtu, readresp->msg_size);
 			dgram_length = RDMAP_TAGGED_ALLOC_SIZE(payload_length);
@@ -1264,11 +2109,14 @@ respond_rdma_read(struct usiw_qp *qp)
 			count++;
 		}
 
-		if (readresp->msg_size == 0) {
-			/* Signal that this is done */
-			readresp->active = false;
-			qp->readresp_head_msn++;
+		if (readresp->msg_size > 0) {
+			/* Out of send window or mbufs; later responses must
+			 * not overtake this one */
+			break;
 		}
+		/* Signal that this is done */
+		readresp->active = false;
+		qp->readresp_head_msn++;
 	}
 	return count;
 } /* respond_rdma_read */
@@ -1279,15 +2127,19 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 {
 	struct rdmap_readreq_packet *rdmap
 		= (struct rdmap_readreq_packet *)orig->rdmap;
+	struct rdmap_atomicreq_packet *atomic = NULL;
 	struct read_response_state *readresp;
 	uint32_t rkey;
 	uint32_t msn;
 	struct usiw_mr **candidate;
 	struct usiw_mr *mr;
+	uintptr_t vaddr;
+	uint32_t rdma_length;
 
 	msn = rte_be_to_cpu_32(rdmap->untagged.msn);
-	if (msn < orig->src_ep->expected_read_msn
-			|| msn >= qp->readresp_head_msn + qp->shm_qp->ird_max) {
+	if (serial_less_32(msn, orig->src_ep->expected_read_msn)
+			|| !serial_less_32(msn, qp->readresp_head_msn
+						+ qp->shm_qp->ird_max)) {
 		RTE_LOG(INFO, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA READ failure: expected MSN in range [%" PRIu32 ", %" PRIu32 "] received %" PRIu32 "\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 				orig->src_ep->expected_read_msn,
@@ -1299,7 +2151,26 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	if (msn == orig->src_ep->expected_read_msn)
 		orig->src_ep->expected_read_msn++;
 
-	rkey = rte_be_to_cpu_32(rdmap->source_stag);
+	if (RDMAP_GET_OPCODE(rdmap->untagged.head.rdmap_info)
+			== rdmap_opcode_atomic_request) {
+		atomic = (struct rdmap_atomicreq_packet *)orig->rdmap;
+		switch (rte_be_to_cpu_32(atomic->atomic_op)) {
+		case rdmap_atomic_fetch_add:
+		case rdmap_atomic_cmp_swap:
+			break;
+		default:
+			do_rdmap_terminate(qp, orig,
+					rdmap_error_opcode_unexpected);
+			return;
+		}
+		rkey = rte_be_to_cpu_32(atomic->source_stag);
+		vaddr = (uintptr_t)rte_be_to_cpu_64(atomic->source_offset);
+		rdma_length = sizeof(uint64_t);
+	} else {
+		rkey = rte_be_to_cpu_32(rdmap->source_stag);
+		vaddr = (uintptr_t)rte_be_to_cpu_64(rdmap->source_offset);
+		rdma_length = rte_be_to_cpu_32(rdmap->read_msg_size);
+	}
 	candidate = usiw_mr_lookup(qp->pd, rkey);
 	if (!candidate) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA READ failure: invalid rkey %" PRIx32 "\n",
@@ -1310,8 +2181,14 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	}
 
 	mr = *candidate;
-	uintptr_t vaddr = (uintptr_t)rte_be_to_cpu_64(rdmap->source_offset);
-	uint32_t rdma_length = rte_be_to_cpu_32(rdmap->read_msg_size);
+	if (atomic && (!(mr->access & IBV_ACCESS_REMOTE_ATOMIC)
+			|| (vaddr & (sizeof(uint64_t) - 1)))) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Atomic failure: rkey %" PRIx32 " addr %" PRIxPTR " not atomic-capable or not aligned\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				rkey, vaddr);
+		do_rdmap_terminate(qp, orig, rdmap_error_access_violation);
+		return;
+	}
 	if (vaddr < (uintptr_t)mr->mr.addr || vaddr + rdma_length
 			> (uintptr_t)mr->mr.addr + mr->mr.length) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA READ failure: source [%" PRIxPTR ", %" PRIxPTR
@@ -1325,7 +2202,7 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 		return;
 	}
 
-	readresp = &qp->readresp_store[msn % qp->shm_qp->ird_max];
+	readresp = &qp->readresp_store[msn & qp->readresp_mask];
 	if (readresp->active) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> RDMA READ failure: duplicate MSN %" PRIu32 "\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id, msn);
@@ -1339,6 +2216,15 @@ process_rdma_read_request(struct usiw_qp *qp, struct packet_context *orig)
 	readresp->sink_stag = rdmap->untagged.head.sink_stag;
 	readresp->sink_offset = rte_be_to_cpu_64(rdmap->sink_offset);
 	readresp->sink_ep = orig->src_ep;
+	if (atomic) {
+		readresp->atomic_op = rte_be_to_cpu_32(atomic->atomic_op);
+		readresp->atomic_swap_add
+			= rte_be_to_cpu_64(atomic->swap_add_data);
+		readresp->atomic_compare
+			= rte_be_to_cpu_64(atomic->compare_data);
+	} else {
+		readresp->atomic_op = rdmap_atomic_none;
+	}
 }	/* process_rdma_read_request */
 
 
@@ -1365,58 +2251,22 @@ try_complete_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 } /* try_complete_wqe */
 
 
-static struct usiw_send_wqe *
-find_first_rdma_read(struct usiw_qp *qp)
-{
-	struct usiw_send_wqe *lptr, *next;
-	list_for_each_safe(&qp->sq.active_head, lptr, next, active) {
-		if (lptr->opcode == usiw_wr_read) {
-			return lptr;
-		}
-	}
-	return NULL;
-}	/* find_first_rdma_read */
-
-
-static void
-process_rdma_read_response(struct usiw_qp *qp, struct packet_context *orig)
-{
-	struct rdmap_tagged_packet *rdmap;
-	struct usiw_send_wqe *read_wqe;
-	int ret;
-
-	/* This ensures that at least one RDMA READ Request is active for this
-	 * STag. We don't need to know exactly which one; this just ensures
-	 * that we don't accept a random RDMA READ Response. */
-	rdmap = (struct rdmap_tagged_packet *)orig->rdmap;
-	ret = usiw_send_wqe_queue_lookup(&qp->sq,
-			usiw_wr_read, rte_be_to_cpu_32(rdmap->head.sink_stag),
-			&read_wqe);
-	if (ret < 0 || !read_wqe || read_wqe->opcode != usiw_wr_read) {
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Unexpected RDMA READ response!\n",
-			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
-		do_rdmap_terminate(qp, orig, rdmap_error_opcode_unexpected);
-		return;
-	}
-
-	/* If this was the last segment of an RDMA READ Response message, insert
-	 * its PSN into the heap. Next time we receive a burst of packets, we
-	 * will retrieve this PSN from the heap if we have received all prior
-	 * packets and complete the corresponding WQE in the correct order. */
-	if (DDP_GET_L(rdmap->head.ddp_flags)) {
-		binheap_insert(qp->remote_ep.recv_rresp_last_psn, orig->psn);
-	}
-}	/* process_rdma_read_response */
-
-
 static void
 qp_shutdown(struct usiw_qp *qp)
 {
 	struct ibv_qp_attr qp_attr;
 	struct ibv_modify_qp cmd;
+	bool direct_tx;
+
+	direct_tx = qp->qp_flags & usiw_qp_direct_tx;
+	if (direct_tx) {
+		rte_spinlock_lock(&qp->tx_lock);
+	}
 
 	pthread_mutex_lock(&qp->shm_qp->conn_event_lock);
-	send_trp_fin(qp);
+	if (qp->ib_qp.qp_type != IBV_QPT_UD) {
+		send_trp_fin(qp);
+	}
 
 	atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
 	memset(&qp_attr, 0, sizeof(qp_attr));
@@ -1427,6 +2277,10 @@ qp_shutdown(struct usiw_qp *qp)
 
 	sq_flush(qp);
 	rq_flush(qp);
+
+	if (direct_tx) {
+		rte_spinlock_unlock(&qp->tx_lock);
+	}
 } /* qp_shutdown */
 
 
@@ -1528,6 +2382,13 @@ do_process_ack(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 	wqe->bytes_acked += pending->ddp_length;
 	assert(wqe->bytes_sent >= wqe->bytes_acked);
 
+	/* An RDMA WRITE with Immediate Data is not complete until the
+	 * trailing Immediate Data message, the only segment of the WQE
+	 * without a payload, has been acknowledged. */
+	if (wqe->opcode == usiw_wr_write_with_imm && pending->ddp_length) {
+		return;
+	}
+
 	if (wqe->opcode != usiw_wr_read
 			&& wqe->bytes_acked == wqe->total_length) {
 		assert(wqe->state == SEND_WQE_WAIT);
@@ -1609,6 +2470,11 @@ sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 		pending = (struct pending_datagram_info *)(sendmsg + 1);
 		if (now > pending->next_retransmit
 				&& (ret = resend_ddp_segment(qp, sendmsg, ep)) < 0) {
+			if (ret == -ENOMEM || ret == -ENOBUFS) {
+				/* Try again once the mempool refills or the
+				 * TX backlog drains */
+				break;
+			}
 			cstatus = IBV_WC_FATAL_ERR;
 			switch (ret) {
 			case -EIO:
@@ -1618,11 +2484,6 @@ sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 					RETRANSMIT_MAX,
 					pending->psn);
 				break;
-			case -ENOMEM:
-				RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> OOM on retransmit psn=%" PRIu32 "\n",
-					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-					pending->psn);
-				break;
 			default:
 				RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> unknown error on retransmit psn=%" PRIu32 ": %s\n",
 					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
@@ -1658,6 +2519,62 @@ sweep_unacked_packets(struct usiw_qp *qp, uint64_t now)
 } /* sweep_unacked_packets */
 
 
+/** Places an RDMA READ Response segment into the scatter list of the RDMA
+ * READ or Atomic Request named by its sink offset (see
+ * RDMAP_READ_SCATTER_FLAG).  The last segment of the response only records
+ * its PSN; complete_read_requests() completes the request once every
+ * segment before it has arrived. */
+static void
+ddp_place_read_response(struct usiw_qp *qp, struct packet_context *orig)
+{
+	struct read_request_state *readreq;
+	struct rdmap_tagged_packet *rdmap;
+	struct usiw_send_wqe *wqe;
+	uint64_t sink_offset;
+	uint32_t rdma_length;
+	uint32_t offset;
+	uint32_t msn;
+
+	rdmap = (struct rdmap_tagged_packet *)orig->rdmap;
+	sink_offset = rte_be_to_cpu_64(rdmap->offset);
+	msn = RDMAP_READ_SCATTER_GET_MSN(sink_offset);
+	offset = RDMAP_READ_SCATTER_GET_OFFSET(sink_offset);
+	rdma_length = orig->ddp_seg_length - sizeof(*rdmap);
+
+	readreq = &qp->readreq_store[msn & qp->readreq_mask];
+	wqe = readreq->wqe;
+	if (!(sink_offset & RDMAP_READ_SCATTER_FLAG) || !wqe
+			|| (wqe->msn & UINT32_C(0x7fffffff)) != msn
+			|| readreq->last_received) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received RDMA READ Response for unknown request msn=%" PRIu32 "\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id, msn);
+		do_rdmap_terminate(qp, orig, rdmap_error_opcode_unexpected);
+		return;
+	}
+
+	if ((uint64_t)offset + rdma_length > wqe->total_length) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received RDMA READ Response with range [%" PRIu32 ", %" PRIu64 "] outside of scatter list of length %zu\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				offset, (uint64_t)offset + rdma_length,
+				wqe->total_length);
+		do_rdmap_terminate(qp, orig,
+				ddp_error_tagged_base_or_bounds_violation);
+		return;
+	}
+
+	memcpy_to_iov(wqe->iov, wqe->iov_count, PAYLOAD_OF(rdmap),
+			rdma_length, offset);
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Wrote %" PRIu32 " bytes to scatter list of RDMA READ msn=%" PRIu32 " at offset %" PRIu32 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			rdma_length, wqe->msn, offset);
+
+	if (DDP_GET_L(rdmap->head.ddp_flags)) {
+		readreq->last_psn = orig->psn;
+		readreq->last_received = true;
+	}
+} /* ddp_place_read_response */
+
+
 static void
 ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 {
@@ -1670,6 +2587,12 @@ ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 	unsigned int opcode;
 
 	rdmap = (struct rdmap_tagged_packet *)orig->rdmap;
+	opcode = RDMAP_GET_OPCODE(orig->rdmap->rdmap_info);
+	if (opcode == rdmap_opcode_rdma_read_response) {
+		ddp_place_read_response(qp, orig);
+		return;
+	}
+
 	rkey = rte_be_to_cpu_32(rdmap->head.sink_stag);
 	candidate = usiw_mr_lookup(qp->pd, rkey);
 	if (!candidate) {
@@ -1700,13 +2623,9 @@ ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 			rdma_length, rkey, vaddr);
 
-	opcode = RDMAP_GET_OPCODE(orig->rdmap->rdmap_info);
 	switch (opcode) {
 	case rdmap_opcode_rdma_write:
 		break;
-	case rdmap_opcode_rdma_read_response:
-		process_rdma_read_response(qp, orig);
-		break;
 	default:
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> received DDP tagged message with invalid opcode %" PRIx8 "\n",
 				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
@@ -1716,49 +2635,169 @@ ddp_place_tagged_data(struct usiw_qp *qp, struct packet_context *orig)
 } /* ddp_place_tagged_data */
 
 
+/** Delivers a datagram received on an unreliable datagram queue pair to the
+ * oldest posted receive WQE, preceded by the sender's address in the
+ * URDMA_UD_GRH_SIZE bytes reserved for it.  As with InfiniBand, a datagram is
+ * silently dropped if no receive WQE is posted, and completes the receive WQE
+ * in error if it does not fit. */
 static void
-process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
+process_ud_datagram(struct usiw_qp *qp, struct ether_hdr *eth_hdr,
+		struct ipv4_hdr *ipv4_hdr, struct udp_hdr *udp_hdr,
+		struct rte_mbuf *mbuf)
+{
+	char grh[URDMA_UD_GRH_SIZE];
+	struct urdma_ah *src = (struct urdma_ah *)grh;
+	struct rdmap_untagged_packet *rdmap;
+	struct usiw_recv_wqe *wqe;
+	struct trp_hdr *trp_hdr;
+	size_t payload_length;
+
+	if (rte_be_to_cpu_16(udp_hdr->dgram_len) < sizeof(*udp_hdr)
+			+ sizeof(*trp_hdr) + sizeof(*rdmap)) {
+		return;
+	}
+	payload_length = rte_be_to_cpu_16(udp_hdr->dgram_len)
+		- sizeof(*udp_hdr) - sizeof(*trp_hdr) - sizeof(*rdmap);
+	if (rte_pktmbuf_data_len(mbuf) < sizeof(*trp_hdr) + sizeof(*rdmap)
+							+ payload_length) {
+		return;
+	}
+
+	trp_hdr = rte_pktmbuf_mtod(mbuf, struct trp_hdr *);
+	rdmap = (struct rdmap_untagged_packet *)(trp_hdr + 1);
+	if ((rte_be_to_cpu_16(trp_hdr->opcode) & trp_opcode_mask) != trp_ud
+			|| DDP_GET_DV(rdmap->head.ddp_flags) != 0x1
+			|| RDMAP_GET_RV(rdmap->head.rdmap_info) != 0x1
+			|| rdmap->head.ddp_flags != DDP_V1_UNTAGGED_LAST_DF
+			|| (RDMAP_GET_OPCODE(rdmap->head.rdmap_info)
+						!= rdmap_opcode_send
+				&& RDMAP_GET_OPCODE(rdmap->head.rdmap_info)
+						!= rdmap_opcode_send_se)) {
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop malformed UD datagram\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		return;
+	}
+
+	if (list_empty(&qp->rq0.active_head)) {
+		if (qp->srq) {
+			srq_dequeue_recv_wqes(qp, qp->rq0.next_msn);
+		} else {
+			dequeue_recv_wqes(qp);
+		}
+	}
+	wqe = list_top(&qp->rq0.active_head, struct usiw_recv_wqe, active);
+	if (!wqe) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop UD datagram; no receive WQE posted\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		return;
+	}
+
+	wqe->flags = usiw_recv_with_grh;
+	if (RDMAP_GET_OPCODE(rdmap->head.rdmap_info) == rdmap_opcode_send_se) {
+		wqe->flags |= usiw_recv_solicited;
+	}
+	if (URDMA_UD_GRH_SIZE + payload_length > wqe->total_request_size) {
+		wqe->input_size = 0;
+		rte_spinlock_lock(&qp->rq0.lock);
+		post_recv_cqe(qp, wqe, IBV_WC_LOC_LEN_ERR);
+		rte_spinlock_unlock(&qp->rq0.lock);
+		return;
+	}
+
+	memset(grh, 0, sizeof(grh));
+	ether_addr_copy(&eth_hdr->s_addr, &src->ether_addr);
+	src->udp_port = udp_hdr->src_port;
+	src->ipv4_addr = ipv4_hdr->src_addr;
+	memcpy_to_iov(wqe->iov, wqe->iov_count, grh, sizeof(grh), 0);
+	memcpy_to_iov(wqe->iov, wqe->iov_count, PAYLOAD_OF(rdmap),
+			payload_length, sizeof(grh));
+	wqe->input_size = sizeof(grh) + payload_length;
+	rte_spinlock_lock(&qp->rq0.lock);
+	post_recv_cqe(qp, wqe, IBV_WC_SUCCESS);
+	rte_spinlock_unlock(&qp->rq0.lock);
+} /* process_ud_datagram */
+
+
+/** Tracks the PSN of a segment received on an unreliable connected queue
+ * pair.  Nothing is retransmitted, so a gap is never filled: we just count it
+ * and move past it, and let the DDP layer find out which messages it broke.
+ * Returns false if the segment is older than one already received and should
+ * be dropped. */
+static bool
+uc_update_recv_psn(struct usiw_qp *qp, struct ee_state *ep, uint32_t psn)
+{
+	if (serial_less_32(psn, ep->recv_ack_psn)) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> drop late psn %" PRIu32 "; expected psn %" PRIu32 "\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				psn, ep->recv_ack_psn);
+		return false;
+	}
+	if (psn != ep->recv_ack_psn) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive psn %" PRIu32 "; lost %" PRIu32 " segments\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				psn, psn - ep->recv_ack_psn);
+		qp->stats.recv_psn_gap_count++;
+	}
+	ep->recv_ack_psn = psn + 1;
+	return true;
+} /* uc_update_recv_psn */
+
+
+/** Logs the details of a datagram that the NIC flagged with a bad IPv4 or UDP
+ * checksum.  Kept out of line since it only matters when debugging. */
+static void __attribute__((cold))
+log_bad_checksum(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 {
-	struct packet_context ctx;
-	struct ether_hdr *eth_hdr;
 	struct ipv4_hdr *ipv4_hdr;
 	struct udp_hdr *udp_hdr;
-	struct trp_hdr *trp_hdr;
-	uint16_t trp_opcode;
 
-#ifdef DEBUG_PACKET_HEADERS
-	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Begin processing received packet:\n",
+	if (RTE_LOG_LEVEL >= RTE_LOG_DEBUG) {
+		uint16_t actual_udp_checksum, actual_ipv4_cksum;
+		ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,
+				struct ipv4_hdr *, sizeof(struct ether_hdr));
+		udp_hdr = rte_pktmbuf_mtod_offset(mbuf,
+				struct udp_hdr *,
+				sizeof(struct ether_hdr) + sizeof(*ipv4_hdr));
+		actual_udp_checksum = udp_hdr->dgram_cksum;
+		udp_hdr->dgram_cksum = 0;
+		actual_ipv4_cksum = ipv4_hdr->hdr_checksum;
+		ipv4_hdr->hdr_checksum = 0;
+		RTE_LOG(DEBUG, USER1, "ipv4 expected cksum %#" PRIx16 " got %#" PRIx16 "\n",
+				rte_ipv4_cksum(ipv4_hdr),
+				actual_ipv4_cksum);
+		RTE_LOG(DEBUG, USER1, "udp expected cksum %#" PRIx16 " got %#" PRIx16 "\n",
+			rte_ipv4_udptcp_cksum(ipv4_hdr, udp_hdr),
+			actual_udp_checksum);
+	}
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with bad UDP/IP checksum\n",
 		qp->shm_qp->dev_id, qp->shm_qp->qp_id);
-	rte_pktmbuf_dump(stderr, mbuf, 128);
-#endif
+} /* log_bad_checksum */
 
-	if (mbuf->ol_flags & (PKT_RX_L4_CKSUM_BAD|PKT_RX_IP_CKSUM_BAD)) {
-		if (RTE_LOG_LEVEL >= RTE_LOG_DEBUG) {
-			uint16_t actual_udp_checksum, actual_ipv4_cksum;
-			ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf,
-					struct ipv4_hdr *, sizeof(*eth_hdr));
-			udp_hdr = rte_pktmbuf_mtod_offset(mbuf,
-					struct udp_hdr *,
-					sizeof(*eth_hdr) + sizeof(*ipv4_hdr));
-			actual_udp_checksum = udp_hdr->dgram_cksum;
-			udp_hdr->dgram_cksum = 0;
-			actual_ipv4_cksum = ipv4_hdr->hdr_checksum;
-			ipv4_hdr->hdr_checksum = 0;
-			RTE_LOG(DEBUG, USER1, "ipv4 expected cksum %#" PRIx16 " got %#" PRIx16 "\n",
-					rte_ipv4_cksum(ipv4_hdr),
-					actual_ipv4_cksum);
-			RTE_LOG(DEBUG, USER1, "udp expected cksum %#" PRIx16 " got %#" PRIx16 "\n",
-				rte_ipv4_udptcp_cksum(ipv4_hdr, udp_hdr),
-				actual_udp_checksum);
-		}
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with bad UDP/IP checksum\n",
-			qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+
+/** Logs why a datagram did not match the headers expected by this queue
+ * pair. */
+static void __attribute__((cold))
+log_header_mismatch(struct usiw_qp *qp, struct rte_mbuf *mbuf,
+		uint16_t min_len)
+{
+	struct ipv4_hdr *ipv4_hdr;
+	struct udp_hdr *udp_hdr;
+
+	if (rte_pktmbuf_data_len(mbuf) < min_len) {
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop runt packet of length %" PRIu16 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			rte_pktmbuf_data_len(mbuf));
 		return;
 	}
 
-	eth_hdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr *);
-
-	ipv4_hdr = (struct ipv4_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*eth_hdr));
+	ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf, struct ipv4_hdr *,
+			sizeof(struct ether_hdr));
+	udp_hdr = (struct udp_hdr *)(ipv4_hdr + 1);
+	if (ipv4_hdr->version_ihl != RX_IPV4_VERSION_IHL) {
+		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with IPv4 version/IHL %#" PRIx8 "\n",
+			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+			ipv4_hdr->version_ihl);
+	}
 	if (ipv4_hdr->next_proto_id != IP_HDR_PROTO_UDP) {
 		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with IPv4 next header %" PRIu8 " not UDP\n",
 			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
@@ -1770,55 +2809,96 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 			rte_be_to_cpu_32(ipv4_hdr->dst_addr),
 			rte_be_to_cpu_32(qp->dev->ipv4_addr));
 	}
-
-	udp_hdr = (struct udp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*ipv4_hdr));
 	if (udp_hdr->dst_port != qp->shm_qp->local_udp_port) {
 		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Drop packet with UDP dst port %" PRIu16 "; expected %" PRIu16 "\n",
 			qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 			rte_be_to_cpu_16(udp_hdr->dst_port),
 			rte_be_to_cpu_16(qp->shm_qp->local_udp_port));
 	}
+} /* log_header_mismatch */
 
-	ctx.src_ep = &qp->remote_ep;
-	if (!ctx.src_ep) {
-		/* Drop the packet; do not send TERMINATE */
-		return;
+
+/** Checks that a received datagram is long enough to hold its headers and
+ * that they match what this queue pair expects.  All of the fields are
+ * compared at once by folding their differences together, so that a burst of
+ * good packets takes no data-dependent branches here.  The ipv4_addr and
+ * udp_port arguments are in network byte order. */
+static inline bool
+rx_check_headers(struct usiw_qp *qp, struct rte_mbuf *mbuf,
+		uint32_t ipv4_addr, uint16_t udp_port, uint16_t min_len)
+{
+	struct ipv4_hdr *ipv4_hdr;
+	struct udp_hdr *udp_hdr;
+	uint32_t mismatch;
+
+	if (unlikely(mbuf->ol_flags
+			& (PKT_RX_L4_CKSUM_BAD|PKT_RX_IP_CKSUM_BAD))) {
+		log_bad_checksum(qp, mbuf);
+		return false;
+	}
+	if (unlikely(rte_pktmbuf_data_len(mbuf) < min_len)) {
+		log_header_mismatch(qp, mbuf, min_len);
+		return false;
 	}
 
-	trp_hdr = (struct trp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*udp_hdr));
-	trp_opcode = rte_be_to_cpu_16(trp_hdr->opcode) & trp_opcode_mask;
-	switch (trp_opcode) {
-	case 0:
-		/* Normal opcode */
-		break;
-	case trp_sack:
-		/* This is a selective acknowledgement */
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive SACK [%" PRIu32 ", %" PRIu32 "); send_ack_psn %" PRIu32 "\n",
-				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-				rte_be_to_cpu_32(trp_hdr->psn),
-				rte_be_to_cpu_32(trp_hdr->ack_psn),
-				ctx.src_ep->send_last_acked_psn);
-		qp->stats.recv_sack_count++;
-		process_trp_sack(ctx.src_ep, rte_be_to_cpu_32(trp_hdr->psn),
-				rte_be_to_cpu_32(trp_hdr->ack_psn));
-		return;
-	case trp_fin:
-		/* This is a finalize packet */
-		qp_shutdown(qp);
-		return;
-	default:
-		RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive unexpected opcode %" PRIu16 "; dropping\n",
-				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-				trp_opcode >> trp_opcode_shift);
-		return;
+	ipv4_hdr = rte_pktmbuf_mtod_offset(mbuf, struct ipv4_hdr *,
+			sizeof(struct ether_hdr));
+	udp_hdr = (struct udp_hdr *)(ipv4_hdr + 1);
+	mismatch = (uint32_t)(ipv4_hdr->version_ihl ^ RX_IPV4_VERSION_IHL)
+		| (uint32_t)(ipv4_hdr->next_proto_id ^ IP_HDR_PROTO_UDP)
+		| (ipv4_hdr->dst_addr ^ ipv4_addr)
+		| (uint32_t)(udp_hdr->dst_port ^ udp_port);
+	if (unlikely(mismatch)) {
+		log_header_mismatch(qp, mbuf, min_len);
+		return false;
 	}
+	return true;
+} /* rx_check_headers */
 
-	/* Update sender state based on received ack_psn */
-	ctx.src_ep->send_last_acked_psn = rte_be_to_cpu_32(trp_hdr->ack_psn);
-	ctx.src_ep->send_max_psn = ctx.src_ep->send_last_acked_psn
-					+ ctx.src_ep->tx_pending_size - 1;
 
-	if (rte_be_to_cpu_16(udp_hdr->dgram_len) <=
+static void
+process_ud_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
+{
+	struct ether_hdr *eth_hdr;
+	struct ipv4_hdr *ipv4_hdr;
+	struct udp_hdr *udp_hdr;
+
+	eth_hdr = rte_pktmbuf_mtod(mbuf, struct ether_hdr *);
+	ipv4_hdr = (struct ipv4_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*eth_hdr));
+	udp_hdr = (struct udp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*ipv4_hdr));
+	rte_pktmbuf_adj(mbuf, sizeof(*udp_hdr));
+	process_ud_datagram(qp, eth_hdr, ipv4_hdr, udp_hdr, mbuf);
+} /* process_ud_packet */
+
+
+static void
+process_trp_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
+{
+	struct packet_context ctx;
+	struct udp_hdr *udp_hdr;
+	struct trp_hdr *trp_hdr;
+
+#ifdef DEBUG_PACKET_HEADERS
+	RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Begin processing received packet:\n",
+		qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+	rte_pktmbuf_dump(stderr, mbuf, 128);
+#endif
+
+	ctx.src_ep = &qp->remote_ep;
+	rte_pktmbuf_adj(mbuf, sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr));
+	udp_hdr = rte_pktmbuf_mtod(mbuf, struct udp_hdr *);
+	trp_hdr = (struct trp_hdr *)rte_pktmbuf_adj(mbuf, sizeof(*udp_hdr));
+
+	/* Update sender state based on received ack_psn; an unreliable
+	 * connected peer does not acknowledge anything */
+	if (qp->ib_qp.qp_type != IBV_QPT_UC) {
+		ctx.src_ep->send_last_acked_psn
+			= rte_be_to_cpu_32(trp_hdr->ack_psn);
+		ctx.src_ep->send_max_psn = ctx.src_ep->send_last_acked_psn
+					+ ctx.src_ep->tx_pending_size - 1;
+	}
+
+	if (rte_be_to_cpu_16(udp_hdr->dgram_len) <=
 					sizeof(*udp_hdr) + sizeof(*trp_hdr)) {
 		/* No DDP segment attached; ignore PSN */
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> got ACK psn %" PRIu32 "; now last_acked_psn %" PRIu32 " send_next_psn %" PRIu32 " send_max_psn %" PRIu32 "\n",
@@ -1831,7 +2911,11 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 	}
 
 	ctx.psn = rte_be_to_cpu_32(trp_hdr->psn);
-	if (ctx.psn == ctx.src_ep->recv_ack_psn) {
+	if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+		if (!uc_update_recv_psn(qp, ctx.src_ep, ctx.psn)) {
+			return;
+		}
+	} else if (ctx.psn == ctx.src_ep->recv_ack_psn) {
 		ctx.src_ep->recv_ack_psn++;
 		if ((ctx.src_ep->trp_flags & trp_recv_missing)
 				&& ctx.src_ep->recv_ack_psn
@@ -1924,9 +3008,19 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 			case rdmap_opcode_send_inv:
 			case rdmap_opcode_send_se:
 			case rdmap_opcode_send_se_inv:
+			case rdmap_opcode_send_imm:
+			case rdmap_opcode_send_imm_se:
+			case rdmap_opcode_immediate_data:
+			case rdmap_opcode_immediate_data_se:
 				process_send(qp, &ctx);
 				break;
 			case rdmap_opcode_rdma_read_request:
+			case rdmap_opcode_atomic_request:
+				if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+					do_rdmap_terminate(qp, &ctx,
+						rdmap_error_opcode_unexpected);
+					return;
+				}
 				process_rdma_read_request(qp, &ctx);
 				break;
 			case rdmap_opcode_terminate:
@@ -1938,7 +3032,7 @@ process_data_packet(struct usiw_qp *qp, struct rte_mbuf *mbuf)
 				return;
 		}
 	}
-}	/* process_ipv4_packet */
+} /* process_trp_packet */
 
 
 static void
@@ -1951,9 +3045,11 @@ progress_send_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 
 	switch (wqe->opcode) {
 	case usiw_wr_send:
+	case usiw_wr_send_with_imm:
 		do_rdmap_send((struct usiw_qp *)qp, wqe);
 		break;
 	case usiw_wr_write:
+	case usiw_wr_write_with_imm:
 		do_rdmap_write((struct usiw_qp *)qp, wqe);
 		break;
 	case usiw_wr_read:
@@ -1963,88 +3059,225 @@ progress_send_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe)
 } /* progress_send_wqe */
 
 
+/** Receives a burst of datagrams for this queue pair.  The burst is handled
+ * in stages: first every datagram's headers are validated and it is sorted by
+ * its TRP opcode, then all selective acknowledgements are applied, then the
+ * data segments (and bare acknowledgements) are processed in arrival order,
+ * and finally all of the mbufs are returned to their pool together.  This
+ * keeps each stage's code and data hot in cache across the burst rather than
+ * switching between header parsing, RDMAP processing, and the mempool for
+ * each datagram.
+ *
+ * Tagged segments, untagged segments and bare acknowledgements are not
+ * sorted into separate classes, because they share one PSN sequence:
+ * process_trp_packet() must see them in the order they arrived, or it would
+ * record the reordered PSNs as missing and send needless SACKs. */
 static int
 process_receive_queue(struct usiw_qp *qp, void *prefetch_addr, uint64_t *now)
 {
 	struct rte_mbuf *rxmbuf[qp->shm_qp->rx_burst_size];
-	uint16_t rx_count, pkt;
+	struct rte_mbuf *data[qp->shm_qp->rx_burst_size];
+	struct rte_mbuf *sack[qp->shm_qp->rx_burst_size];
+	struct trp_hdr *trp_hdr;
+	uint16_t rx_count, data_count, sack_count, pkt, min_len;
+	uint32_t ipv4_addr;
+	uint16_t udp_port;
+	bool is_ud, got_fin;
+
+	/* Get burst of RX packets, already demultiplexed for us */
+	rx_count = RING_DEQUEUE_BURST(qp->remote_ep.rx_queue,
+			(void **)rxmbuf, qp->shm_qp->rx_burst_size);
+	qp->stats.base.recv_count_histo[rx_count]++;
+	if (now) {
+		*now = rte_get_timer_cycles();
+	}
+	if (rx_count == 0) {
+		return 0;
+	}
 
-	/* Get burst of RX packets */
-	if (qp->dev->flags & port_fdir) {
-		rx_count = rte_eth_rx_burst(qp->dev->portid,
-				qp->shm_qp->rx_queue,
-				rxmbuf, qp->shm_qp->rx_burst_size);
-	} else if (qp->remote_ep.rx_queue) {
-		rx_count = RING_DEQUEUE_BURST(qp->remote_ep.rx_queue,
-				(void **)rxmbuf, qp->shm_qp->rx_burst_size);
-	} else {
-		rx_count = 0;
+	is_ud = qp->ib_qp.qp_type == IBV_QPT_UD;
+	min_len = sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr)
+		+ sizeof(struct udp_hdr) + (is_ud ? 0 : sizeof(struct trp_hdr));
+	ipv4_addr = qp->dev->ipv4_addr;
+	udp_port = qp->shm_qp->local_udp_port;
+	data_count = sack_count = 0;
+	got_fin = false;
+
+	/* Stage 1: validate and classify */
+	rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[0], void *));
+	for (pkt = 0; pkt < rx_count; ++pkt) {
+		if (pkt + 1 < rx_count) {
+			rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[pkt + 1],
+						void *));
+		}
+		if (!rx_check_headers(qp, rxmbuf[pkt], ipv4_addr, udp_port,
+								min_len)) {
+			continue;
+		}
+		if (is_ud) {
+			data[data_count++] = rxmbuf[pkt];
+			continue;
+		}
+
+		trp_hdr = rte_pktmbuf_mtod_offset(rxmbuf[pkt],
+				struct trp_hdr *, sizeof(struct ether_hdr)
+				+ sizeof(struct ipv4_hdr)
+				+ sizeof(struct udp_hdr));
+		switch (rte_be_to_cpu_16(trp_hdr->opcode) & trp_opcode_mask) {
+		case 0:
+			/* Normal opcode */
+			data[data_count++] = rxmbuf[pkt];
+			break;
+		case trp_sack:
+			/* This is a selective acknowledgement; an unreliable
+			 * connected QP keeps nothing to retransmit */
+			if (qp->ib_qp.qp_type != IBV_QPT_UC) {
+				sack[sack_count++] = rxmbuf[pkt];
+			}
+			break;
+		case trp_fin:
+			/* This is a finalize packet */
+			got_fin = true;
+			break;
+		default:
+			RTE_LOG(NOTICE, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive unexpected opcode %" PRIu16 "; dropping\n",
+					qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+					(rte_be_to_cpu_16(trp_hdr->opcode)
+					 & trp_opcode_mask) >> trp_opcode_shift);
+			break;
+		}
 	}
-	qp->stats.base.recv_count_histo[rx_count]++;
-	if (rx_count != 0) {
-		rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[0], void *));
-		if (now) {
-			*now = rte_get_timer_cycles();
-		}
-		for (pkt = 0; pkt < rx_count - 1; ++pkt) {
-			rte_prefetch0(rte_pktmbuf_mtod(rxmbuf[pkt + 1], void *));
-			process_data_packet(qp, rxmbuf[pkt]);
-			rte_pktmbuf_free(rxmbuf[pkt]);
+
+	/* Stage 2: selective acknowledgements only mark entries in the
+	 * retransmit ring, so they can be applied ahead of the data segments
+	 * that arrived with them */
+	for (pkt = 0; pkt < sack_count; ++pkt) {
+		trp_hdr = rte_pktmbuf_mtod_offset(sack[pkt],
+				struct trp_hdr *, sizeof(struct ether_hdr)
+				+ sizeof(struct ipv4_hdr)
+				+ sizeof(struct udp_hdr));
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> receive SACK [%" PRIu32 ", %" PRIu32 "); send_ack_psn %" PRIu32 "\n",
+				qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+				rte_be_to_cpu_32(trp_hdr->psn),
+				rte_be_to_cpu_32(trp_hdr->ack_psn),
+				qp->remote_ep.send_last_acked_psn);
+		qp->stats.recv_sack_count++;
+		process_trp_sack(&qp->remote_ep,
+				rte_be_to_cpu_32(trp_hdr->psn),
+				rte_be_to_cpu_32(trp_hdr->ack_psn));
+	}
+
+	/* Stage 3: data segments, which must be handled in PSN order */
+	if (prefetch_addr) {
+		rte_prefetch0(prefetch_addr);
+	}
+	if (is_ud) {
+		for (pkt = 0; pkt < data_count; ++pkt) {
+			process_ud_packet(qp, data[pkt]);
 		}
-		if (prefetch_addr) {
-			rte_prefetch0(prefetch_addr);
+	} else {
+		for (pkt = 0; pkt < data_count; ++pkt) {
+			process_trp_packet(qp, data[pkt]);
+		}
+		if (got_fin) {
+			qp_shutdown(qp);
 		}
-		process_data_packet(qp, rxmbuf[rx_count - 1]);
-		rte_pktmbuf_free(rxmbuf[rx_count - 1]);
-	} else if (now) {
-		*now = rte_get_timer_cycles();
 	}
 
+	/* Stage 4: no datagram is referenced past this point */
+	free_mbuf_burst(rxmbuf, rx_count);
+
 	return rx_count;
 }
 
 
-/* Make forward progress on the queue pair.  This does not guarantee that
- * everything that could be done will be done, but rather that if this function
- * is called at a regular interval, user operations will eventually complete
- * (given that the network and remote nodes are operational). */
+/** Takes the next posted send WQE off of the ring, assigns its MSN and adds
+ * it to the active set.  Returns NULL if no send WQE has been posted. */
+static struct usiw_send_wqe *
+activate_next_send_wqe(struct usiw_qp *qp)
+{
+	struct usiw_send_wqe *send_wqe;
+
+	if (rte_ring_dequeue(qp->sq.ring, (void **)&send_wqe) < 0) {
+		return NULL;
+	}
+
+	assert(send_wqe->state == SEND_WQE_INIT);
+	send_wqe->state = SEND_WQE_TRANSFER;
+	switch (send_wqe->opcode) {
+		case usiw_wr_send:
+		case usiw_wr_send_with_imm:
+		case usiw_wr_write_with_imm:
+			send_wqe->msn = send_wqe->remote_ep->next_send_msn++;
+			break;
+		case usiw_wr_read:
+			send_wqe->msn = send_wqe->remote_ep->next_read_msn++;
+			break;
+		case usiw_wr_write:
+			break;
+	}
+	usiw_send_wqe_queue_add_active(&qp->sq, send_wqe);
+	return send_wqe;
+} /* activate_next_send_wqe */
+
+
+/** Unreliable connected queue pairs get no acknowledgements to open the TRP
+ * send window.  Instead, each pass opens it by the quantum of the queue pair,
+ * so that a large message does not monopolize the progress thread. */
 static void
-progress_qp(struct usiw_qp *qp)
+uc_open_send_window(struct usiw_qp *qp)
 {
-	struct usiw_send_wqe *send_wqe, *next;
-	uint64_t now;
-	uint32_t psn;
-	int scount, ret;
+	qp->remote_ep.send_max_psn = qp->remote_ep.send_next_psn
+		+ qp->tx_quantum;
+} /* uc_open_send_window */
 
-	/* Receive loop fills in now for us */
-	process_receive_queue(qp, list_top(&qp->sq.active_head, struct usiw_send_wqe, active), &now);
 
-	/* Call any timers only once per millisecond */
-	sweep_unacked_packets(qp, now);
-
-	/* Process RDMA READ Response last segments. */
-	while (!binheap_empty(qp->remote_ep.recv_rresp_last_psn)) {
-		binheap_peek(qp->remote_ep.recv_rresp_last_psn, &psn);
-		if (psn < qp->remote_ep.recv_ack_psn) {
-			/* We have received all prior packets, so since we have
-			 * received the RDMA READ Response segment with L=1, we
-			 * are guaranteed to have placed all data corresponding
-			 * to this RDMA READ Response, and can complete the
-			 * corresponding WQE. The heap ensures that we process
-			 * the segments in the correct order, and
-			 * try_complete_wqe() ensures that we do not complete an
-			 * RDMA READ request out of order. */
-			send_wqe = find_first_rdma_read(qp);
-			if (!(WARN_ONCE(!send_wqe,
-					"No RDMA READ request pending\n"))) {
-				send_wqe->state = SEND_WQE_COMPLETE;
-				try_complete_wqe(qp, send_wqe);
-			}
-			binheap_pop(qp->remote_ep.recv_rresp_last_psn);
-		} else {
+/** Completes RDMA READ and Atomic Requests, in MSN order, whose responses
+ * have been received in full.  The last segment of a response has been
+ * received, and every segment before it has been received, once its PSN is
+ * below recv_ack_psn; since responses are sent in MSN order, all of its data
+ * has then been placed. */
+static void
+complete_read_requests(struct usiw_qp *qp)
+{
+	struct read_request_state *readreq;
+	struct usiw_send_wqe *send_wqe;
+	uint64_t *result;
+
+	for (;;) {
+		readreq = &qp->readreq_store[qp->readreq_head_msn
+						& qp->readreq_mask];
+		if (!readreq->wqe || !readreq->last_received
+				|| !serial_less_32(readreq->last_psn,
+					qp->remote_ep.recv_ack_psn)) {
 			break;
 		}
+		send_wqe = readreq->wqe;
+		readreq->wqe = NULL;
+		readreq->last_received = false;
+		qp->readreq_head_msn++;
+
+		if (send_wqe->atomic_op) {
+			/* The original value arrives in network byte order */
+			result = send_wqe->iov[0].iov_base;
+			*result = rte_be_to_cpu_64(*result);
+		}
+		/* try_complete_wqe() ensures that we do not complete the
+		 * request ahead of earlier WQEs */
+		send_wqe->state = SEND_WQE_COMPLETE;
+		try_complete_wqe(qp, send_wqe);
 	}
+} /* complete_read_requests */
+
+
+/** Progresses every active send WQE, and activates the next posted one if
+ * none of them has anything left to transfer.  Returns the number of send
+ * WQEs that still have data to transfer. */
+static int
+progress_send_queue(struct usiw_qp *qp)
+{
+	struct usiw_send_wqe *send_wqe, *next;
+	int scount;
 
 	scount = 0;
 	list_for_each_safe(&qp->sq.active_head, send_wqe, next, active) {
@@ -2058,29 +3291,92 @@ progress_qp(struct usiw_qp *qp)
 		}
 	}
 	if (scount == 0) {
-		ret = rte_ring_dequeue(qp->sq.ring, (void **)&send_wqe);
-		if (ret == 0) {
-			assert(send_wqe->state == SEND_WQE_INIT);
-			send_wqe->state = SEND_WQE_TRANSFER;
-			switch (send_wqe->opcode) {
-				case usiw_wr_send:
-					send_wqe->msn = send_wqe->remote_ep
-							->next_send_msn++;
-					break;
-				case usiw_wr_read:
-					send_wqe->msn = send_wqe->remote_ep
-							->next_read_msn++;
-					break;
-				case usiw_wr_write:
-					break;
-			}
-			usiw_send_wqe_queue_add_active(&qp->sq, send_wqe);
+		send_wqe = activate_next_send_wqe(qp);
+		if (send_wqe) {
 			progress_send_wqe(qp, send_wqe);
 			scount = 1;
 		}
 	}
+	return scount;
+} /* progress_send_queue */
+
+
+/** Splits the credit of the queue pair for this pass between its own send
+ * WQEs and the RDMA READ Responses it owes its peer, taking turns of
+ * tx_sq_share and tx_readresp_share segments.  A side that does not use its
+ * whole turn has run out of work, and the other side may then use the rest
+ * of the credit.  Returns the number of send WQEs that still have data to
+ * transfer plus the number of READ Response segments sent. */
+static int
+interleave_tx(struct usiw_qp *qp)
+{
+	unsigned int credit, limit;
+	bool sq_more, readresp_more;
+	int scount, rcount;
+
+	credit = qp->tx_credit;
+	rcount = 0;
+	do {
+		limit = RTE_MIN(credit, qp->tx_sq_share);
+		qp->tx_credit = limit;
+		scount = progress_send_queue(qp);
+		sq_more = scount && qp->tx_credit == 0;
+		credit -= limit - qp->tx_credit;
+
+		limit = RTE_MIN(credit, qp->tx_readresp_share);
+		qp->tx_credit = limit;
+		rcount += respond_rdma_read(qp);
+		readresp_more = qp->tx_credit == 0;
+		credit -= limit - qp->tx_credit;
+	} while (credit && (sq_more || readresp_more));
+
+	qp->tx_credit = credit;
+	return scount + rcount;
+} /* interleave_tx */
+
+
+/** Gives the queue pair its quantum of new DDP segments for this pass.  Unused
+ * credit carries over to the next pass, but never beyond one extra quantum,
+ * so that a queue pair held back by its send window cannot later burst past
+ * the others. */
+static void
+add_tx_credit(struct usiw_qp *qp)
+{
+	qp->tx_credit = RTE_MIN(qp->tx_credit + qp->tx_quantum,
+			2 * qp->tx_quantum);
+} /* add_tx_credit */
+
+
+/* Make forward progress on the queue pair.  This does not guarantee that
+ * everything that could be done will be done, but rather that if this function
+ * is called at a regular interval, user operations will eventually complete
+ * (given that the network and remote nodes are operational). */
+static void
+progress_qp(struct usiw_qp *qp)
+{
+	uint64_t now;
+	int scount;
+	bool direct_tx;
+
+	direct_tx = qp->qp_flags & usiw_qp_direct_tx;
+	if (direct_tx) {
+		rte_spinlock_lock(&qp->tx_lock);
+	}
+	add_tx_credit(qp);
 
-	scount += respond_rdma_read(qp);
+	/* Receive loop fills in now for us */
+	process_receive_queue(qp, list_top(&qp->sq.active_head, struct usiw_send_wqe, active), &now);
+
+	if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+		uc_open_send_window(qp);
+	} else {
+		/* Call any timers only once per millisecond */
+		sweep_unacked_packets(qp, now);
+	}
+
+	complete_read_requests(qp);
+
+	scount = interleave_tx(qp);
 
 	if (qp->remote_ep.trp_flags & trp_ack_update) {
 		if (unlikely(qp->remote_ep.trp_flags & trp_recv_missing)) {
@@ -2090,19 +3386,124 @@ progress_qp(struct usiw_qp *qp)
 		}
 	}
 
+	if (scount == 0) {
+		/* Nothing left to send; as in deficit round robin, an idle
+		 * queue pair does not save up credit */
+		qp->tx_credit = 0;
+	}
+
 	flush_tx_queue(qp);
+	if (direct_tx) {
+		rte_spinlock_unlock(&qp->tx_lock);
+	}
 } /* progress_qp */
 
 
+/* Make forward progress on an unreliable datagram queue pair.  There is no
+ * acknowledgement or retransmission state, so each send WQE is completed as
+ * soon as its datagram has been queued for transmission. */
+static void
+progress_ud_qp(struct usiw_qp *qp)
+{
+	struct usiw_send_wqe *send_wqe, *next;
+	unsigned int i;
+
+	process_receive_queue(qp, NULL, NULL);
+
+	/* Retry any WQE that could not get an mbuf or backlog space last
+	 * time */
+	list_for_each_safe(&qp->sq.active_head, send_wqe, next, active) {
+		do_ud_send(qp, send_wqe);
+		if (send_wqe->state != SEND_WQE_COMPLETE) {
+			goto flush;
+		}
+		try_complete_wqe(qp, send_wqe);
+	}
+
+	for (i = 0; i < qp->tx_quantum; ++i) {
+		send_wqe = activate_next_send_wqe(qp);
+		if (!send_wqe) {
+			break;
+		}
+		do_ud_send(qp, send_wqe);
+		if (send_wqe->state != SEND_WQE_COMPLETE) {
+			break;
+		}
+		try_complete_wqe(qp, send_wqe);
+	}
+
+flush:
+	flush_tx_queue(qp);
+} /* progress_ud_qp */
+
+
+void
+qp_direct_tx(struct usiw_qp *qp)
+{
+	struct usiw_send_wqe *send_wqe, *next;
+	int scount;
+
+	usiw_qp_ring_doorbell(qp);
+	if (!(qp->qp_flags & usiw_qp_direct_tx)
+			|| !rte_spinlock_trylock(&qp->tx_lock)) {
+		return;
+	}
+
+	if (atomic_load(&qp->shm_qp->conn_state) != usiw_qp_running) {
+		goto unlock;
+	}
+	if (qp->ib_qp.qp_type == IBV_QPT_UC) {
+		uc_open_send_window(qp);
+	}
+	if (qp->tx_credit == 0) {
+		/* The posting thread would otherwise have to wait for the
+		 * progress thread after every idle period */
+		add_tx_credit(qp);
+	}
+
+	/* Only push out data here; WQEs that are ready to complete are left
+	 * to the progress thread, which is the sole producer for the CQs. */
+	scount = 0;
+	list_for_each_safe(&qp->sq.active_head, send_wqe, next, active) {
+		if (send_wqe->state == SEND_WQE_TRANSFER) {
+			progress_send_wqe(qp, send_wqe);
+			if (send_wqe->state == SEND_WQE_TRANSFER) {
+				scount++;
+			}
+		}
+	}
+	if (scount == 0) {
+		send_wqe = activate_next_send_wqe(qp);
+		if (send_wqe) {
+			progress_send_wqe(qp, send_wqe);
+		}
+	}
+
+	flush_tx_queue(qp);
+
+unlock:
+	rte_spinlock_unlock(&qp->tx_lock);
+} /* qp_direct_tx */
+
+
 void
 urdma_do_destroy_cq(struct usiw_cq *cq)
 {
 	rte_free(cq->cqe_ring);
 	rte_free(cq->free_ring);
-	free(cq);
+	rte_free(cq->storage);
+	rte_free(cq);
 } /* urdma_do_destroy_cq */
 
 
+void
+urdma_do_destroy_srq(struct usiw_srq *srq)
+{
+	usiw_recv_wqe_queue_destroy(&srq->rq);
+	rte_free(srq);
+} /* urdma_do_destroy_srq */
+
+
 void
 usiw_do_destroy_qp(struct usiw_qp *qp)
 {
@@ -2118,6 +3519,21 @@ usiw_do_destroy_qp(struct usiw_qp *qp)
 		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> recv_sack_count %" PRIuMAX "\n",
 				qp->dev->portid, qp->shm_qp->qp_id,
 				qp->stats.recv_sack_count);
+		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> recv_msg_lost_count %" PRIuMAX "\n",
+				qp->dev->portid, qp->shm_qp->qp_id,
+				qp->stats.recv_msg_lost_count);
+		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> tx_alloc_fail_count %" PRIuMAX "\n",
+				qp->dev->portid, qp->shm_qp->qp_id,
+				qp->stats.tx_alloc_fail_count);
+		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> tx_full_count %" PRIuMAX "\n",
+				qp->dev->portid, qp->shm_qp->qp_id,
+				qp->stats.tx_full_count);
+		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> tx_drop_count %" PRIuMAX "\n",
+				qp->dev->portid, qp->shm_qp->qp_id,
+				qp->stats.tx_drop_count);
+		fprintf(stderr, "<dev=%" PRIx16" qp=%" PRIx16 "> tx_backlog_max %" PRIuMAX "\n",
+				qp->dev->portid, qp->shm_qp->qp_id,
+				qp->stats.tx_backlog_max);
 	}
 
 	if (atomic_fetch_sub(&qp->recv_cq->refcnt, 1) == 1) {
@@ -2129,10 +3545,24 @@ usiw_do_destroy_qp(struct usiw_qp *qp)
 		}
 	}
 
+	if (qp->srq && atomic_fetch_sub(&qp->srq->refcnt, 1) == 1) {
+		urdma_do_destroy_srq(qp->srq);
+	}
+
+	if (qp->remote_ep.rx_queue) {
+		struct rte_mbuf *mbuf;
+		while (rte_ring_dequeue(qp->remote_ep.rx_queue,
+					(void **)&mbuf) == 0) {
+			rte_pktmbuf_free(mbuf);
+		}
+		rte_free(qp->remote_ep.rx_queue);
+	}
+
 	usiw_recv_wqe_queue_destroy(&qp->rq0);
 	usiw_send_wqe_queue_destroy(&qp->sq);
-	free(qp->remote_ep.recv_rresp_last_psn);
-	free(qp->readresp_store);
+	rte_free(qp->readreq_store);
+	rte_free(qp->remote_ep.tx_pending);
+	rte_free(qp->readresp_store);
 
 	memset(&msg, 0, sizeof(msg));
 	msg.hdr.opcode = rte_cpu_to_be_32(urdma_sock_destroy_qp_req);
@@ -2140,20 +3570,64 @@ usiw_do_destroy_qp(struct usiw_qp *qp)
 	msg.hdr.qp_id = rte_cpu_to_be_16(qp->shm_qp->qp_id);
 	msg.ptr = rte_cpu_to_be_64((uintptr_t)qp->shm_qp);
 	send(qp->dev->urdmad_fd, &msg, sizeof(msg), 0);
-	free(qp->stats.base.recv_count_histo);
-	free(qp->txq);
-	free(qp);
+	rte_free(qp->stats.base.recv_count_histo);
+	if (qp->txq) {
+		drain_tx_queue(qp);
+		rte_free(qp->txq);
+	}
+	rte_free(qp);
 } /* usiw_do_destroy_qp */
 
 
+/** Records the hardware queue pair that urdmad assigned to this process on the
+ * device, which is the same for all of its queue pairs. */
+static void
+dev_attach_queue(struct usiw_device *dev, struct urdmad_qp *shm_qp)
+{
+	if (dev->queue_attached) {
+		assert(dev->rx_queue == shm_qp->rx_queue);
+		assert(dev->tx_queue == shm_qp->tx_queue);
+		return;
+	}
+
+	dev->rx_burst_size = shm_qp->rx_burst_size;
+	dev->tx_queue = shm_qp->tx_queue;
+	dev->rx_queue = shm_qp->rx_queue;
+	dev->queue_attached = true;
+
+	/* This fails if urdmad did not enable receive interrupts on the port,
+	 * or if the PMD cannot deliver them to a secondary process; the idle
+	 * progress thread then wakes up every idle_sleep_ms to poll */
+	if (dev->driver->idle_poll_count
+			&& rte_eth_dev_rx_intr_ctl_q(dev->portid, dev->rx_queue,
+				RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD,
+				NULL) == 0) {
+		dev->rx_intr = true;
+	}
+} /* dev_attach_queue */
+
+
 static void
 start_qp(struct usiw_qp *qp)
 {
+	char name[RTE_RING_NAMESIZE];
+	struct rte_ring *rx_queue;
 	unsigned int cur_state;
+	uint32_t count;
 
 	pthread_mutex_lock(&qp->shm_qp->conn_event_lock);
-	qp->readresp_store = calloc(qp->shm_qp->ird_max,
-			sizeof(*qp->readresp_store));
+	if (qp->ib_qp.qp_type == IBV_QPT_UD) {
+		/* No READ or TRP state to set up for datagrams */
+		goto alloc_txq;
+	}
+
+	/* Sized to a power of two so that the MSN indexes it correctly
+	 * across the 32-bit wrap */
+	count = rte_align32pow2(RTE_MAX(qp->shm_qp->ird_max, 1));
+	qp->readresp_mask = count - 1;
+	qp->readresp_store = rte_calloc_socket(NULL, count,
+			sizeof(*qp->readresp_store), RTE_CACHE_LINE_SIZE,
+			qp->dev->socket_id);
 	if (!qp->readresp_store) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up readresp_store failed: %s\n",
 						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
@@ -2161,58 +3635,106 @@ start_qp(struct usiw_qp *qp)
 		goto err;
 	}
 
-	/* FIXME: Get this from the peer */
-	qp->remote_ep.send_max_psn = qp->shm_qp->tx_desc_count / 2;
-	qp->remote_ep.tx_pending_size = qp->shm_qp->tx_desc_count / 2;
-	qp->remote_ep.tx_pending = calloc(qp->remote_ep.tx_pending_size,
-			sizeof(*qp->remote_ep.tx_pending));
-	if (!qp->remote_ep.tx_pending) {
-		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up tx_pending failed: %s\n",
-						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
-						strerror(errno));
-		goto free_readresp_store;
+	/* Unreliable connected queue pairs keep nothing for retransmission */
+	if (qp->ib_qp.qp_type == IBV_QPT_RC) {
+		/* FIXME: Get this from the peer */
+		qp->remote_ep.send_max_psn = qp->shm_qp->tx_desc_count / 2;
+		qp->remote_ep.tx_pending_size = qp->shm_qp->tx_desc_count / 2;
+		qp->remote_ep.tx_pending = rte_calloc_socket(NULL,
+				qp->remote_ep.tx_pending_size,
+				sizeof(*qp->remote_ep.tx_pending),
+				RTE_CACHE_LINE_SIZE, qp->dev->socket_id);
+		if (!qp->remote_ep.tx_pending) {
+			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up tx_pending failed: %s\n",
+							qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+							strerror(errno));
+			goto free_readresp_store;
+		}
+		qp->remote_ep.tx_head = qp->remote_ep.tx_pending;
 	}
-	qp->remote_ep.tx_head = qp->remote_ep.tx_pending;
 
-	qp->remote_ep.recv_rresp_last_psn = binheap_new(qp->shm_qp->ord_max);
-	if (!qp->remote_ep.recv_rresp_last_psn) {
+	count = rte_align32pow2(RTE_MAX(qp->shm_qp->ord_max, 1));
+	qp->readreq_mask = count - 1;
+	qp->readreq_store = rte_calloc_socket(NULL, count,
+			sizeof(*qp->readreq_store), RTE_CACHE_LINE_SIZE,
+			qp->dev->socket_id);
+	if (!qp->readreq_store) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up readreq_store failed: %s\n",
+						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
+						strerror(errno));
 		goto free_tx_pending;
 	}
 
-	qp->txq = calloc(qp->shm_qp->tx_burst_size, sizeof(*qp->txq));
+	qp_tx_template_init(qp);
+
+alloc_txq:
+	qp->tx_quantum = qp->tx_weight * qp->shm_qp->tx_burst_size;
+	qp->tx_credit = 0;
+	qp->tx_sq_share = qp->tx_sq_ratio * qp->shm_qp->tx_burst_size;
+	qp->tx_readresp_share = qp->tx_readresp_ratio
+		* qp->shm_qp->tx_burst_size;
+	qp->txq_size = TX_BACKLOG_BURSTS * qp->shm_qp->tx_burst_size;
+	qp->txq = rte_calloc_socket(NULL, qp->txq_size, sizeof(*qp->txq),
+			RTE_CACHE_LINE_SIZE, qp->dev->socket_id);
 	if (!qp->txq) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up txq failed: %s\n",
 						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 						strerror(errno));
-		goto free_recv_rresp_last_psn;
+		goto free_readreq_store;
 	}
 	qp->txq_end = qp->txq;
 
+	dev_attach_queue(qp->dev, qp->shm_qp);
+
+	snprintf(name, RTE_RING_NAMESIZE, "qpn%" PRIu32 "_recv_demux",
+			qp->ib_qp.qp_num);
+	count = rte_align32pow2(qp->shm_qp->rx_desc_count + 1);
+	rx_queue = rte_malloc_socket(NULL, rte_ring_get_memsize(count),
+			RTE_CACHE_LINE_SIZE, qp->dev->socket_id);
+	if (!rx_queue || rte_ring_init(rx_queue, name, count,
+					RING_F_SP_ENQ|RING_F_SC_DEQ) != 0) {
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up rx_queue failed\n",
+						qp->shm_qp->dev_id, qp->shm_qp->qp_id);
+		goto free_rx_queue;
+	}
+
 	qp->stats.base.recv_max_burst_size = qp->shm_qp->rx_burst_size;
-	qp->stats.base.recv_count_histo = calloc(qp->stats.base.recv_max_burst_size + 1,
-			sizeof(*qp->stats.base.recv_count_histo));
+	qp->stats.base.recv_count_histo = rte_calloc_socket(NULL,
+			qp->stats.base.recv_max_burst_size + 1,
+			sizeof(*qp->stats.base.recv_count_histo),
+			RTE_CACHE_LINE_SIZE, qp->dev->socket_id);
 	if (!qp->stats.base.recv_count_histo) {
 		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 " qp=%" PRIx16 "> Set up recv_count_histo failed: %s\n",
 						qp->shm_qp->dev_id, qp->shm_qp->qp_id,
 						strerror(errno));
-		goto free_txq;
+		goto free_rx_queue;
 	}
 
+	qp->remote_ep.rx_queue = rx_queue;
+	qp->dev->rx_demux[qp->shm_qp->local_udp_port] = qp;
+
 	cur_state = usiw_qp_connected;
 	atomic_compare_exchange_strong(&qp->shm_qp->conn_state, &cur_state,
 				       usiw_qp_running);
-	atomic_fetch_sub(&qp->ctx->qp_init_count, 1);
+	usiw_qp_leave_init(qp);
 	goto unlock;
 
-free_txq:
-	free(qp->txq);
-free_recv_rresp_last_psn:
-	free(qp->remote_ep.recv_rresp_last_psn);
+free_rx_queue:
+	rte_free(rx_queue);
+	rte_free(qp->txq);
+	qp->txq = NULL;
+free_readreq_store:
+	rte_free(qp->readreq_store);
+	qp->readreq_store = NULL;
 free_tx_pending:
-	free(qp->remote_ep.tx_pending);
+	rte_free(qp->remote_ep.tx_pending);
+	qp->remote_ep.tx_pending = NULL;
 free_readresp_store:
-	free(qp->readresp_store);
+	rte_free(qp->readresp_store);
+	qp->readresp_store = NULL;
 err:
+	/* The queue pair stays counted in qp_init_count so that the progress
+	 * thread finds it in qp_active and retires it */
 	atomic_store(&qp->shm_qp->conn_state, usiw_qp_error);
 unlock:
 	pthread_mutex_unlock(&qp->shm_qp->conn_event_lock);
@@ -2220,6 +3742,348 @@ unlock:
 } /* start_qp */
 
 
+/** Receives a burst of packets from the hardware queue shared by all queue
+ * pairs of this process and hands each one to the queue pair bound to its
+ * destination UDP port.  Packets for unknown ports, and packets that arrive
+ * when the queue pair has fallen too far behind, are dropped.  Returns true if
+ * any packets were received. */
+static bool
+demux_rx_queue(struct usiw_device *dev)
+{
+	struct rte_mbuf *rxmbuf[dev->rx_burst_size];
+	struct udp_hdr *udp_hdr;
+	struct usiw_qp *qp;
+	uint16_t rx_count, pkt;
+
+	if (!dev->rx_queue) {
+		return false;
+	}
+
+	rx_count = rte_eth_rx_burst(dev->portid, dev->rx_queue,
+			rxmbuf, dev->rx_burst_size);
+	for (pkt = 0; pkt < rx_count; ++pkt) {
+		if (rxmbuf[pkt]->data_len < UDP_IPV4_HDR_LEN) {
+			RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 "> Drop runt packet of %" PRIu16 " bytes\n",
+					dev->portid, rxmbuf[pkt]->data_len);
+			rte_pktmbuf_free(rxmbuf[pkt]);
+			continue;
+		}
+		udp_hdr = rte_pktmbuf_mtod_offset(rxmbuf[pkt],
+				struct udp_hdr *,
+				sizeof(struct ether_hdr)
+						+ sizeof(struct ipv4_hdr));
+		qp = dev->rx_demux[udp_hdr->dst_port];
+		if (qp && rte_ring_enqueue(qp->remote_ep.rx_queue,
+							rxmbuf[pkt]) == 0) {
+			usiw_qp_ring_doorbell(qp);
+			continue;
+		}
+		RTE_LOG(DEBUG, USER1, "<dev=%" PRIx16 "> Drop packet for UDP port %" PRIu16 "\n",
+				dev->portid, rte_be_to_cpu_16(udp_hdr->dst_port));
+		rte_pktmbuf_free(rxmbuf[pkt]);
+	}
+	return rx_count != 0;
+} /* demux_rx_queue */
+
+
+/** Returns true if the queue pair has work that it can make progress on right
+ * away, so that the progress thread should visit it again on its next pass. */
+static bool
+qp_has_work(struct usiw_qp *qp)
+{
+	struct usiw_send_wqe *wqe;
+
+	if (atomic_load(&qp->shm_qp->conn_state) != usiw_qp_running) {
+		return true;
+	}
+	if (qp->txq_end != qp->txq
+			|| !rte_ring_empty(qp->remote_ep.rx_queue)
+			|| !rte_ring_empty(qp->sq.ring)) {
+		return true;
+	}
+	if (qp->ib_qp.qp_type == IBV_QPT_UD) {
+		/* Active WQEs are waiting for an mbuf */
+		return !list_empty(&qp->sq.active_head);
+	}
+	if (qp->remote_ep.trp_flags & trp_ack_update) {
+		return true;
+	}
+	if (qp->readresp_store[qp->readresp_head_msn
+				& qp->readresp_mask].active) {
+		return true;
+	}
+	list_for_each(&qp->sq.active_head, wqe, active) {
+		if (wqe->state == SEND_WQE_TRANSFER) {
+			return true;
+		}
+	}
+	return false;
+} /* qp_has_work */
+
+
+/** Returns true if the queue pair is waiting on its peer, for
+ * acknowledgements or RDMA READ Responses, or on a retransmit timer. */
+static bool
+qp_is_waiting(struct usiw_qp *qp)
+{
+	return !list_empty(&qp->sq.active_head)
+		|| (qp->remote_ep.tx_pending && *qp->remote_ep.tx_head);
+} /* qp_is_waiting */
+
+
+/** Decides when the progress thread next needs to visit a running queue
+ * pair that it has just progressed.  A queue pair whose CQ could not signal
+ * its completion channel is kept on the timer until the event is written. */
+static void
+schedule_qp(struct usiw_qp *qp)
+{
+	struct usiw_device *dev = qp->dev;
+	uint16_t id = qp->shm_qp->qp_id;
+	unsigned long bit = 1UL << (id % DOORBELL_WORD_BITS);
+	bool channel_wait;
+
+	channel_wait = retry_channel_event(qp->send_cq);
+	if (qp->recv_cq != qp->send_cq) {
+		channel_wait |= retry_channel_event(qp->recv_cq);
+	}
+
+	if (qp_has_work(qp)) {
+		usiw_qp_ring_doorbell(qp);
+	} else if (channel_wait || (qp->ib_qp.qp_type != IBV_QPT_UD
+						&& qp_is_waiting(qp))) {
+		dev->timer_bits[id / DOORBELL_WORD_BITS] |= bit;
+	} else {
+		dev->timer_bits[id / DOORBELL_WORD_BITS] &= ~bit;
+	}
+} /* schedule_qp */
+
+
+/** Does whatever the current state of the queue pair calls for. */
+static void
+progress_ctx_qp(struct usiw_context *ctx, struct usiw_qp *qp)
+{
+	struct usiw_device *dev = ctx->dev;
+	uint16_t id = qp->shm_qp->qp_id;
+
+	switch (atomic_load(&qp->shm_qp->conn_state)) {
+	case usiw_qp_connected:
+		/* start_qp() transitions to usiw_qp_running */
+		start_qp(qp);
+		if (atomic_load(&qp->shm_qp->conn_state) == usiw_qp_error) {
+			goto retire;
+		}
+		dev->qp_table[id] = qp;
+		if (qp->priority == urdma_qp_priority_high) {
+			dev->high_prio_bits[id / DOORBELL_WORD_BITS]
+				|= 1UL << (id % DOORBELL_WORD_BITS);
+		}
+		/* fall-through */
+	case usiw_qp_running:
+		if (qp->ib_qp.qp_type == IBV_QPT_UD) {
+			progress_ud_qp(qp);
+		} else {
+			progress_qp(qp);
+		}
+		schedule_qp(qp);
+		break;
+	case usiw_qp_shutdown:
+		qp_shutdown(qp);
+		/* qp_shutdown() transitions to usiw_qp_error */
+		/* fall-through */
+	case usiw_qp_error:
+retire:
+		/* The queue pair may have failed before it was started, in
+		 * which case only the qp_active walk can find it; it stops
+		 * being counted once it is off of the list */
+		list_del(&qp->ctx_entry);
+		usiw_qp_leave_init(qp);
+		if (dev->rx_demux[qp->shm_qp->local_udp_port] == qp) {
+			dev->rx_demux[qp->shm_qp->local_udp_port] = NULL;
+		}
+		if (dev->qp_table[id] == qp) {
+			dev->qp_table[id] = NULL;
+			dev->timer_bits[id / DOORBELL_WORD_BITS]
+				&= ~(1UL << (id % DOORBELL_WORD_BITS));
+			dev->high_prio_bits[id / DOORBELL_WORD_BITS]
+				&= ~(1UL << (id % DOORBELL_WORD_BITS));
+		}
+		if (atomic_fetch_sub(&qp->refcnt, 1) == 1) {
+			usiw_do_destroy_qp(qp);
+		}
+		break;
+	default:
+		break;
+	}
+} /* progress_ctx_qp */
+
+
+/** Progresses the queue pairs of the given context in the rung bits of one
+ * doorbell word. */
+static void
+answer_doorbell_word(struct usiw_context *ctx, unsigned int w,
+		unsigned long bits)
+{
+	struct usiw_device *dev = ctx->dev;
+	struct usiw_qp *qp;
+
+	while (bits) {
+		qp = dev->qp_table[w * DOORBELL_WORD_BITS
+					+ __builtin_ctzl(bits)];
+		bits &= bits - 1;
+		if (qp && qp->ctx == ctx) {
+			progress_ctx_qp(ctx, qp);
+		} else if (qp) {
+			/* Belongs to another context on this device; leave it
+			 * for that context's turn */
+			usiw_qp_ring_doorbell(qp);
+		}
+	}
+} /* answer_doorbell_word */
+
+
+/** Visits every queue pair whose doorbell has been rung since the last pass,
+ * those of urdma_qp_priority_high first.  Doorbells of queue pairs which have
+ * not been started yet are ignored, since the progress thread finds those
+ * through the context's qp_active list.  Returns true if any doorbell was
+ * rung. */
+static bool
+answer_doorbells(struct usiw_context *ctx)
+{
+	struct usiw_device *dev = ctx->dev;
+	unsigned long rung[dev->doorbell_words];
+	unsigned long high, any;
+	unsigned int w;
+
+	any = high = 0;
+	for (w = 0; w < dev->doorbell_words; ++w) {
+		rung[w] = 0;
+		if (atomic_load_explicit(&dev->doorbell[w],
+					memory_order_relaxed)) {
+			rung[w] = atomic_exchange_explicit(&dev->doorbell[w],
+					0, memory_order_acquire);
+		}
+		any |= rung[w];
+		high |= rung[w] & dev->high_prio_bits[w];
+	}
+	if (!any) {
+		return false;
+	}
+
+	if (high) {
+		for (w = 0; w < dev->doorbell_words; ++w) {
+			answer_doorbell_word(ctx, w,
+					rung[w] & dev->high_prio_bits[w]);
+			rung[w] &= ~dev->high_prio_bits[w];
+		}
+	}
+	for (w = 0; w < dev->doorbell_words; ++w) {
+		answer_doorbell_word(ctx, w, rung[w]);
+	}
+	return true;
+} /* answer_doorbells */
+
+
+/** Rings the doorbell of every queue pair that is waiting on a timer. */
+static void
+ring_timer_doorbells(struct usiw_device *dev)
+{
+	unsigned int w;
+
+	for (w = 0; w < dev->doorbell_words; ++w) {
+		if (dev->timer_bits[w]) {
+			atomic_fetch_or_explicit(&dev->doorbell[w],
+					dev->timer_bits[w],
+					memory_order_relaxed);
+		}
+	}
+} /* ring_timer_doorbells */
+
+
+/** Blocks the progress thread until a doorbell is rung, a context is added,
+ * a packet arrives on a receive queue with interrupts, or the sleep bound
+ * expires.  The sleep is bounded by the next timer tick if any queue pair
+ * is waiting on a timer or has not been started yet, and by idle_sleep_ms
+ * if any receive queue cannot interrupt us.  Returns immediately if work
+ * arrived after the caller last looked for it. */
+static void
+progress_thread_sleep(struct usiw_driver *driver)
+{
+	struct rte_epoll_event events[8];
+	struct usiw_context_handle *h;
+	struct usiw_context *ctx;
+	struct usiw_device *dev;
+	bool timer_wait, bounded;
+	eventfd_t value;
+	unsigned int w;
+	int timeout;
+
+	atomic_store(&driver->sleeping, true);
+
+	/* Look for work one last time now that wakeups will be sent */
+	if (!rte_ring_empty(driver->new_ctxs)) {
+		goto wake;
+	}
+	timer_wait = bounded = false;
+	list_for_each(&driver->ctxs, h, driver_entry) {
+		ctx = (void *)atomic_load(&h->ctxp);
+		if (!ctx) {
+			goto wake;
+		}
+		dev = ctx->dev;
+		for (w = 0; w < dev->doorbell_words; ++w) {
+			if (atomic_load(&dev->doorbell[w])) {
+				goto wake;
+			}
+			if (dev->timer_bits[w]) {
+				timer_wait = true;
+			}
+		}
+		if (atomic_load(&ctx->qp_init_count) != 0) {
+			timer_wait = true;
+		}
+		if (!dev->queue_attached) {
+			continue;
+		}
+		if (!dev->rx_intr) {
+			bounded = true;
+			continue;
+		}
+		rte_eth_dev_rx_intr_enable(dev->portid, dev->rx_queue);
+		/* A packet that arrived before the interrupt was enabled
+		 * will not raise it */
+		switch (rte_eth_rx_queue_count(dev->portid, dev->rx_queue)) {
+		case 0:
+			break;
+		case -ENOTSUP:
+			bounded = true;
+			break;
+		default:
+			goto wake;
+		}
+	}
+
+	if (timer_wait) {
+		timeout = 1;
+	} else if (bounded) {
+		timeout = driver->idle_sleep_ms;
+	} else {
+		timeout = -1;
+	}
+	rte_epoll_wait(RTE_EPOLL_PER_THREAD, events, RTE_DIM(events), timeout);
+
+wake:
+	atomic_store(&driver->sleeping, false);
+	eventfd_read(driver->wake_fd, &value);
+	list_for_each(&driver->ctxs, h, driver_entry) {
+		ctx = (void *)atomic_load(&h->ctxp);
+		if (ctx && ctx->dev->rx_intr) {
+			rte_eth_dev_rx_intr_disable(ctx->dev->portid,
+					ctx->dev->rx_queue);
+		}
+	}
+} /* progress_thread_sleep */
+
+
 int
 kni_loop(void *arg)
 {
@@ -2228,18 +4092,39 @@ kni_loop(void *arg)
 	struct usiw_driver *driver;
 	struct usiw_qp *qp, *qp_next;
 	void *ctxs_to_add[NEW_CTX_MAX];
-	unsigned int i, count;
+	unsigned int i, count, idle_passes;
+	uint64_t now, next_tick, tick_cycles;
+	bool tick, busy;
 
 	driver = arg;
 	sem_wait(&driver->go);
+	tick_cycles = rte_get_timer_hz() / 1000;
+	next_tick = 0;
+	idle_passes = 0;
+	if (driver->idle_poll_count) {
+		driver->wake_event.epdata.event = EPOLLIN;
+		if (rte_epoll_ctl(RTE_EPOLL_PER_THREAD, EPOLL_CTL_ADD,
+					driver->wake_fd,
+					&driver->wake_event) < 0) {
+			RTE_LOG(NOTICE, USER1, "Could not wait on progress thread eventfd; idle mode disabled\n");
+			driver->idle_poll_count = 0;
+		}
+	}
 	while (1) {
 		count = RING_DEQUEUE_BURST(driver->new_ctxs, ctxs_to_add,
 					     NEW_CTX_MAX);
+		busy = count != 0;
 		for (i = 0; i < count; ++i) {
 			h = (struct usiw_context_handle *)ctxs_to_add[i];
 			list_add_tail(&driver->ctxs, &h->driver_entry);
 		}
 
+		now = rte_get_timer_cycles();
+		tick = now >= next_tick;
+		if (tick) {
+			next_tick = now + tick_cycles;
+		}
+
 		list_for_each_safe(&driver->ctxs, h, h_next, driver_entry) {
 			ctx = (void *)atomic_load(&h->ctxp);
 			if (unlikely(!ctx)) {
@@ -2247,36 +4132,32 @@ kni_loop(void *arg)
 				free(h);
 				continue;
 			}
-			list_for_each_safe(&ctx->qp_active, qp, qp_next, ctx_entry) {
-				switch (atomic_load(&qp->shm_qp->conn_state)) {
-				case usiw_qp_connected:
-					/* start_qp() transitions to
-					 * usiw_qp_running */
-					start_qp(qp);
+			busy |= demux_rx_queue(ctx->dev);
+			if (tick) {
+				ring_timer_doorbells(ctx->dev);
+			}
+
+			/* Only queue pairs that have not been started yet need
+			 * to be found by walking the whole list */
+			if (atomic_load(&ctx->qp_init_count) != 0) {
+				list_for_each_safe(&ctx->qp_active, qp, qp_next,
+								ctx_entry) {
 					if (atomic_load(&qp->shm_qp->conn_state)
-							== usiw_qp_error) {
-						break;
-					}
-					/* fall-through */
-				case usiw_qp_running:
-					progress_qp(qp);
-					break;
-				case usiw_qp_shutdown:
-					qp_shutdown(qp);
-					/* qp_shutdown() transitions to
-					 * usiw_qp_error */
-					/* fall-through */
-				case usiw_qp_error:
-					list_del(&qp->ctx_entry);
-					if (atomic_fetch_sub(&qp->refcnt,
-								1) == 1) {
-						usiw_do_destroy_qp(qp);
+							!= usiw_qp_running) {
+						progress_ctx_qp(ctx, qp);
 					}
-					break;
-				default:
-					break;
 				}
 			}
+
+			busy |= answer_doorbells(ctx);
+		}
+
+		if (busy) {
+			idle_passes = 0;
+		} else if (driver->idle_poll_count
+				&& ++idle_passes >= driver->idle_poll_count) {
+			progress_thread_sleep(driver);
+			idle_passes = 0;
 		}
 	}
 
@@ -42,9 +42,13 @@
 #ifndef INTERFACE_H
 #define INTERFACE_H
 
+#include <assert.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <sys/eventfd.h>
 
 #include <ccan/list/list.h>
 
@@ -55,23 +59,26 @@
 #include <rte_config.h>
 #include <rte_ethdev.h>
 #include <rte_ether.h>
+#include <rte_interrupts.h>
+#include <rte_ip.h>
 #include <rte_kni.h>
 #include <rte_mbuf.h>
+#include <rte_memory.h>
 #include <rte_mempool.h>
 #include <rte_ring.h>
 #include <rte_spinlock.h>
+#include <rte_udp.h>
 
 #include "urdmad_private.h"
-#include "binheap.h"
 #include "verbs.h"
 
 #define MAX_RECV_WR 1023
 #define MAX_SEND_WR 1023
 #define DPDK_VERBS_IOV_LEN_MAX 32
-#define DPDK_VERBS_RDMA_READ_IOV_LEN_MAX 1
+#define DPDK_VERBS_RDMA_READ_IOV_LEN_MAX 16
 #define MAX_MR_SIZE (UINT32_C(1) << 30)
-#define USIW_IRD_MAX 128
-#define USIW_ORD_MAX 128
+#define USIW_IRD_MAX 255
+#define USIW_ORD_MAX 255
 
 /* MUST be a power of 2 minus 1 */
 #define NEW_CTX_MAX 31
@@ -118,6 +125,16 @@ struct usiw_wc {
 	enum ibv_wc_opcode opcode;
 	uint32_t byte_len;
 	uint32_t qp_num;
+	uint32_t imm_data;
+	unsigned int wc_flags;
+};
+
+enum {
+	usiw_recv_with_imm = 1,
+	usiw_recv_rdma_with_imm = 2,
+	usiw_recv_with_grh = 4,
+	usiw_recv_lost = 8,
+	usiw_recv_solicited = 16,
 };
 
 struct usiw_recv_wqe {
@@ -126,6 +143,8 @@ struct usiw_recv_wqe {
 	struct list_node active;
 	uint32_t msn;
 	bool complete;
+	uint8_t flags;
+	uint32_t imm_data; /* network byte order */
 	size_t total_request_size;
 	size_t recv_size;
 	size_t input_size;
@@ -155,11 +174,16 @@ enum usiw_send_opcode {
 	usiw_wr_send = 0,
 	usiw_wr_write = 1,
 	usiw_wr_read = 2,
+	usiw_wr_send_with_imm = 3,
+	usiw_wr_write_with_imm = 4,
 };
 
 enum {
 	usiw_send_signaled = 1,
 	usiw_send_inline = 2,
+	usiw_send_solicited = 4,
+		/**< Sent with the Solicited Event flag; only meaningful for
+		 * messages that consume a receive WQE at the peer. */
 };
 
 struct usiw_send_wqe {
@@ -174,6 +198,11 @@ struct usiw_send_wqe {
 	enum usiw_send_wqe_state state;
 	uint32_t msn;
 	uint32_t local_stag; /* only used for READs */
+	uint32_t imm_data; /* network byte order */
+	uint32_t atomic_op; /* enum rdmap_atomic_op; only used for READs */
+	uint64_t atomic_swap_add;
+	uint64_t atomic_compare;
+	struct urdma_ah ah; /* only used for UD */
 	size_t total_length;
 	size_t bytes_sent;
 	size_t bytes_acked;
@@ -218,6 +247,20 @@ struct usiw_recv_wqe_queue {
 	rte_spinlock_t lock;
 };
 
+struct usiw_srq {
+	atomic_uint refcnt;
+	struct ibv_srq ib_srq;
+	struct usiw_recv_wqe_queue rq;
+	struct usiw_context *ctx;
+	struct list_head qp_head;
+		/**< Queue pairs attached to this SRQ, protected by rq.lock */
+	size_t qp_count;
+	uint32_t srq_id;
+	atomic_uint srq_limit;
+		/**< Raise SIW_EVENT_SRQ_LIMIT_REACHED when fewer than this
+		 * many receive WQEs remain posted.  Zero when disarmed. */
+};
+
 struct psn_range {
 	uint32_t min;
 	uint32_t max;
@@ -242,7 +285,6 @@ struct ee_state {
 
 	/* RX TRP state */
 	uint32_t recv_ack_psn;
-	struct binheap *recv_rresp_last_psn;
 
 	uint32_t trp_flags;
 	struct psn_range recv_sack_psn;
@@ -251,8 +293,8 @@ struct ee_state {
 	struct rte_mbuf **tx_head;
 	int tx_pending_size;
 
-	/* This fields are only used if the NIC does not support
-	 * filtering. */
+	/* Packets for this endpoint, demultiplexed by demux_rx_queue() from
+	 * the hardware queue shared by all queue pairs of the process. */
 	struct rte_ring *rx_queue;
 };
 
@@ -261,54 +303,148 @@ struct read_response_state {
 	uint32_t msg_size;
 	uint32_t sink_stag; /* network byte order */
 	uint64_t sink_offset; /* host byte order */
+	uint32_t atomic_op; /* enum rdmap_atomic_op; cleared once executed */
+	uint64_t atomic_swap_add; /* host byte order */
+	uint64_t atomic_compare; /* host byte order */
+	uint64_t atomic_orig; /* network byte order */
 	bool active;
 	struct ee_state *sink_ep;
 	struct list_node qp_entry;
 };
 
+/** An RDMA READ or Atomic Request that we have sent and not yet completed.
+ * These are kept in a table indexed by the low bits of the MSN, which every
+ * segment of the response carries in its sink offset (see
+ * RDMAP_READ_SCATTER_FLAG), so that responses can be matched to their
+ * requests and requests completed in order without searching. */
+struct read_request_state {
+	struct usiw_send_wqe *wqe;
+	uint32_t last_psn;
+		/**< PSN of the last segment of the response, once
+		 * last_received is set. */
+	bool last_received;
+};
+
+/** The Ethernet, IPv4 and UDP headers of every datagram sent by a connected
+ * queue pair.  Only the length and checksum fields differ between datagrams;
+ * see send_udp_dgram(). */
+struct usiw_tx_template {
+	struct ether_hdr eth;
+	struct ipv4_hdr ip;
+	struct udp_hdr udp;
+};
+static_assert(sizeof(struct usiw_tx_template) == 42,
+		"unexpected sizeof(usiw_tx_template)");
+
 enum {
 	usiw_qp_sig_all = 0x1,
+	usiw_qp_direct_tx = 0x2,
+		/**< New send WQEs are transmitted by the posting thread;
+		 * see urdma_qp_set_direct_tx(). */
 };
 
 /** This structure contains fields used by my initial reliable datagram-style
  * verbs interface.  This will be used for transition to the reliable connected
  * queue pairs and the libibverbs interface. */
 struct usiw_qp {
+	/* Set up when the queue pair is created and only read afterwards by
+	 * both the posting and the progress threads. */
 	atomic_uint refcnt;
+	atomic_bool init_counted;
+		/**< Set while the queue pair is counted in the qp_init_count of
+		 * its context; see usiw_qp_leave_init(). */
 	struct urdmad_qp *shm_qp;
 	uint16_t qp_flags;
+	uint8_t priority;
+		/**< enum urdma_qp_priority */
+	uint8_t tx_weight;
+		/**< Number of TX bursts of new DDP segments or datagrams that
+		 * the queue pair may send per pass of the progress thread. */
+	uint8_t tx_sq_ratio;
+	uint8_t tx_readresp_ratio;
+		/**< Turns of send WQE segments and RDMA READ Response
+		 * segments, in TX bursts; see interleave_tx(). */
 
 	struct list_node ctx_entry;
+	struct list_node srq_entry;
 	UT_hash_handle hh;
 	struct usiw_context *ctx;
 	struct usiw_device *dev;
 	struct usiw_cq *send_cq;
+	struct usiw_cq *recv_cq;
+	struct usiw_srq *srq;
+	struct usiw_mr_table *pd;
 
-	/* txq_end points one entry beyond the last entry in the table
-	 * the table is full when txq_end == txq + tx_burst_size
-	 * the burst should be flushed at that point
-	 */
-	struct rte_mbuf **txq_end;
+	struct usiw_tx_template tx_hdr;
+		/**< Built by start_qp(); unused for datagram queue pairs. */
+	uint32_t tx_ip_raw_cksum;
+		/**< Raw sum of tx_hdr.ip with total_length zero, or zero if
+		 * checksums are offloaded. */
+	uint32_t tx_udp_raw_cksum;
+		/**< Raw sum of the IPv4 pseudo-header with length zero, plus
+		 * tx_hdr.udp if checksums are not offloaded. */
+
+	/* Written by the posting thread. */
+	rte_spinlock_t tx_lock __rte_cache_aligned;
+		/**< Serializes the progress thread and the posting thread
+		 * on this queue pair.  Only taken in usiw_qp_direct_tx
+		 * mode. */
+
+	/* The work queues are shared through their rings and locks, so each
+	 * gets cache lines of its own. */
+	struct usiw_send_wqe_queue sq __rte_cache_aligned;
+	struct usiw_recv_wqe_queue rq0 __rte_cache_aligned;
+
+	/* Written by the progress thread, and by the posting thread only
+	 * under tx_lock in usiw_qp_direct_tx mode. */
+
+	/* TX backlog: frames waiting for room in the NIC transmit ring.
+	 * txq_end points one entry beyond the last entry in the table; the
+	 * table is full when txq_end == txq + txq_size.  A flush is attempted
+	 * whenever it holds tx_burst_size frames and at the end of each
+	 * progress pass, and whatever the NIC does not take stays here. */
+	struct rte_mbuf **txq_end __rte_cache_aligned;
 	struct rte_mbuf **txq;
+	unsigned int txq_size;
 
-	struct usiw_send_wqe_queue sq;
-
-	struct rte_eth_fdir_filter fdir_filter;
-        struct urdma_qp_stats_ex stats;
+	/* Deficit round robin between the queue pairs of the progress thread:
+	 * each pass adds tx_quantum to tx_credit, and each new DDP segment
+	 * costs one credit.  Retransmissions and control packets are free. */
+	unsigned int tx_quantum;
+	unsigned int tx_credit;
+	unsigned int tx_sq_share;
+	unsigned int tx_readresp_share;
 
 	uint64_t timer_last;
-	struct usiw_recv_wqe_queue rq0;
-
 	struct read_response_state *readresp_store;
+	uint32_t readresp_mask;
+		/**< One less than the size of readresp_store, which is a power
+		 * of two no smaller than ird_max. */
 	uint32_t readresp_head_msn;
+	struct read_request_state *readreq_store;
+	uint32_t readreq_mask;
+		/**< One less than the size of readreq_store, which is a power
+		 * of two no smaller than ord_max. */
+	uint32_t readreq_head_msn;
+		/**< MSN of the oldest RDMA READ or Atomic Request that has not
+		 * been completed. */
 	uint8_t ord_active;
 
-	struct usiw_cq *recv_cq;
-	struct usiw_mr_table *pd;
-
 	struct ee_state remote_ep;
 
-	struct ibv_qp ib_qp;
+	struct urdma_qp_stats_ex stats;
+
+	struct ibv_qp ib_qp __rte_cache_aligned;
+};
+
+/** How a CQ is armed by ibv_req_notify_cq(). */
+enum usiw_cq_notify {
+	usiw_cq_notify_none = 0,
+	usiw_cq_notify_solicited = 1,
+		/**< Signal on the next receive completion of a message with
+		 * the Solicited Event flag, or the next unsuccessful
+		 * completion. */
+	usiw_cq_notify_all = 2,
 };
 
 struct usiw_cq {
@@ -320,7 +456,68 @@ struct usiw_cq {
 	size_t capacity;
 	size_t qp_count;
 	uint32_t cq_id;
-	atomic_bool notify_flag;
+	int socket_id;
+		/**< NUMA socket selected by the comp_vector. */
+	atomic_uint notify;
+		/**< enum usiw_cq_notify; reset to usiw_cq_notify_none when the
+		 * completion channel is signaled. */
+	int channel_fd;
+		/**< Write end of the pipe of a urdma_create_comp_channel()
+		 * channel, or -1 if notifications go through the kernel. */
+	atomic_uint channel_events;
+		/**< The number of events written to channel_fd, which the
+		 * application must acknowledge before the CQ is destroyed. */
+	atomic_bool channel_retry;
+		/**< Set if channel_fd was full when the CQ was signaled; the
+		 * progress thread writes the event again on its timer tick. */
+	atomic_bool resizing;
+		/**< Set by ibv_resize_cq() while it swaps in new rings and
+		 * storage; see usiw_cq_enter(). */
+
+	/* Each side counts itself on its own cache line, so that posting and
+	 * polling do not contend with each other. */
+	atomic_uint post_active __rte_cache_aligned;
+		/**< Threads between get_next_cqe() and finish_post_cqe(). */
+	atomic_uint poll_active __rte_cache_aligned;
+		/**< Threads in ibv_poll_cq(). */
+};
+
+/** Marks the calling thread as using the rings and storage of the CQ, on the
+ * side counted by active, waiting while ibv_resize_cq() replaces them.  The
+ * rings themselves are thread-safe, so this is the only synchronization
+ * between posting and polling. */
+static inline void
+usiw_cq_enter(struct usiw_cq *cq, atomic_uint *active)
+{
+	while (1) {
+		/* Sequentially consistent: either usiw_resize_cq() sees our
+		 * count or we see that it is resizing */
+		atomic_fetch_add(active, 1);
+		if (!atomic_load(&cq->resizing)) {
+			return;
+		}
+		atomic_fetch_sub(active, 1);
+		while (atomic_load(&cq->resizing)) {
+			sched_yield();
+		}
+	}
+} /* usiw_cq_enter */
+
+static inline void
+usiw_cq_exit(atomic_uint *active)
+{
+	atomic_fetch_sub_explicit(active, 1, memory_order_release);
+} /* usiw_cq_exit */
+
+/** A completion channel created by urdma_create_comp_channel(), which
+ * liburdma signals by writing to a pipe instead of through the kernel
+ * module. */
+struct urdma_comp_channel {
+	struct ibv_comp_channel ib_channel;
+	int write_fd;
+	struct list_node entry;
+		/**< Entry in the list of channels created by
+		 * urdma_create_comp_channel(); see verbs.c. */
 };
 
 enum usiw_device_flags {
@@ -361,6 +558,17 @@ usiw_get_context(struct ibv_context *ctx)
 	return container_of(vctx, struct usiw_context, vcontext);
 } /* usiw_get_context */
 
+/** Removes the queue pair from the qp_init_count of its context, once it is
+ * running or the progress thread has taken it off of qp_active.  Safe to call
+ * more than once. */
+static inline void
+usiw_qp_leave_init(struct usiw_qp *qp)
+{
+	if (atomic_exchange(&qp->init_counted, false)) {
+		atomic_fetch_sub(&qp->ctx->qp_init_count, 1);
+	}
+} /* usiw_qp_leave_init */
+
 struct usiw_device {
 	struct verbs_device vdev;
 	struct rte_mempool *rx_mempool;
@@ -373,8 +581,53 @@ struct usiw_device {
 	struct ether_addr ether_addr;
 	uint32_t ipv4_addr;
 	int urdmad_fd;
+	int socket_id;
+		/**< NUMA socket of the NIC, or of the progress lcore if that
+		 * is unknown.  Queue pair state is allocated here. */
+
+	/* The hardware queue pair that urdmad assigned to this process, shared
+	 * by all of its queue pairs on the device.  These are zero until the
+	 * first queue pair is started by the progress thread. */
+	uint16_t rx_queue;
+	uint16_t tx_queue;
+	uint16_t rx_burst_size;
+	bool queue_attached;
+	bool rx_intr;
+		/**< True if rx_queue can interrupt the progress thread while it
+		 * is idle; otherwise its sleep is bounded by idle_sleep_ms. */
+	rte_spinlock_t tx_lock;
+		/**< Serializes rte_eth_tx_burst() on tx_queue between the
+		 * progress thread and usiw_qp_direct_tx posting threads. */
+
+	struct usiw_qp **rx_demux;
+		/**< Running queue pair for each local UDP port, indexed by the
+		 * port in network byte order.  Only accessed by the progress
+		 * thread. */
+
+	/* Doorbells: the progress thread only visits the running queue pairs
+	 * whose bit is set in doorbell, so idle queue pairs cost nothing.  All
+	 * four tables are indexed by the urdmad qp_id, which is unique on
+	 * the port and at most max_qp. */
+	atomic_ulong *doorbell;
+		/**< Set by usiw_qp_ring_doorbell() from any thread; cleared by
+		 * the progress thread when it visits the queue pair. */
+	unsigned long *timer_bits;
+		/**< Queue pairs waiting on the peer or on a retransmit timer,
+		 * whose doorbells the progress thread rings every millisecond.
+		 * Only accessed by the progress thread. */
+	struct usiw_qp **qp_table;
+		/**< Running queue pair for each qp_id.  Only accessed by the
+		 * progress thread. */
+	unsigned long *high_prio_bits;
+		/**< Set for the running queue pairs in qp_table whose priority
+		 * is urdma_qp_priority_high.  Only accessed by the progress
+		 * thread. */
+	unsigned int doorbell_words;
+	struct usiw_driver *driver;
 };
 
+#define DOORBELL_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
 struct usiw_driver {
 	sem_t go;
 	struct nl_sock *sock;
@@ -386,8 +639,45 @@ struct usiw_driver {
 	uint32_t lcore_mask[RTE_MAX_LCORE / 32];
 	uint16_t device_count;
 	uint16_t *max_qp;
+
+	/* Idle mode: after idle_poll_count passes without work, the progress
+	 * thread sets sleeping and blocks in rte_epoll_wait() on wake_fd and
+	 * on any receive queue interrupts. */
+	unsigned int idle_poll_count;
+		/**< 0 if the progress thread should never sleep. */
+	int idle_sleep_ms;
+	int wake_fd;
+		/**< eventfd written by usiw_wake_progress_thread(). */
+	atomic_bool sleeping;
+	struct rte_epoll_event wake_event;
 };
 
+/** Wakes the progress thread if it is sleeping in idle mode.  Must be called
+ * after publishing the work that the progress thread should find. */
+static inline void
+usiw_wake_progress_thread(struct usiw_driver *driver)
+{
+	/* Sequentially consistent ordering pairs with the progress thread,
+	 * which sets sleeping before checking for work a final time: either
+	 * it sees our work or we see that it is sleeping. */
+	if (atomic_load(&driver->sleeping)) {
+		eventfd_write(driver->wake_fd, 1);
+	}
+} /* usiw_wake_progress_thread */
+
+/** Tells the progress thread that the queue pair has work to do.  May be
+ * called from any thread, after the work (e.g., a WQE on a ring) has been
+ * published. */
+static inline void
+usiw_qp_ring_doorbell(struct usiw_qp *qp)
+{
+	uint16_t id = qp->shm_qp->qp_id;
+
+	atomic_fetch_or(&qp->dev->doorbell[id / DOORBELL_WORD_BITS],
+			1UL << (id % DOORBELL_WORD_BITS));
+	usiw_wake_progress_thread(qp->dev->driver);
+} /* usiw_qp_ring_doorbell */
+
 /** Starts the progress thread. */
 void
 start_progress_thread(void);
@@ -419,6 +709,13 @@ void
 qp_free_send_wqe(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 		bool still_in_hash);
 
+/* Called after new send WQEs have been published.  Transmits them from the
+ * calling thread if the queue pair is in direct TX mode and the progress
+ * thread is not currently working on it, and rings the doorbell of the queue
+ * pair so that the progress thread sees them. */
+void
+qp_direct_tx(struct usiw_qp *qp);
+
 /* Places a pointer to the next receive WQE in *wqe and returns 0 if one is
  * available.  If one is not available, returns -ENOSPC.
  *
@@ -429,14 +726,14 @@ qp_get_next_recv_wqe(struct usiw_qp *qp, struct usiw_recv_wqe **wqe);
 
 int
 usiw_send_wqe_queue_init(uint32_t qpn, struct usiw_send_wqe_queue *q,
-		uint32_t max_send_wr, uint32_t max_sge);
+		uint32_t max_send_wr, uint32_t max_sge, int socket_id);
 
 void
 usiw_send_wqe_queue_destroy(struct usiw_send_wqe_queue *q);
 
 int
 usiw_recv_wqe_queue_init(uint32_t qpn, struct usiw_recv_wqe_queue *q,
-		uint32_t max_recv_wr, uint32_t max_sge);
+		uint32_t max_recv_wr, uint32_t max_sge, int socket_id);
 
 void
 usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q);
@@ -444,6 +741,9 @@ usiw_recv_wqe_queue_destroy(struct usiw_recv_wqe_queue *q);
 void
 urdma_do_destroy_cq(struct usiw_cq *cq);
 
+void
+urdma_do_destroy_srq(struct usiw_srq *srq);
+
 void
 usiw_do_destroy_qp(struct usiw_qp *qp);
 
@@ -44,8 +44,10 @@
 #endif
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <ccan/list/list.h>
 #include "infiniband/driver.h"
@@ -59,6 +61,7 @@
 #include <rte_ring.h>
 
 #include "interface.h"
+#include "proto.h"
 #include "urdma_kabi.h"
 #include "util.h"
 #include "verbs.h"
@@ -70,6 +73,11 @@ static_assert(URDMA_VENDOR_ID == URDMA_DEVICE_VENDOR_ID,
 static_assert(URDMA_VENDOR_PART_ID == URDMA_DEVICE_VENDOR_PART_ID,
 		"Vendor part ID in verbs.h does not match kABI");
 
+/** All live channels created by urdma_create_comp_channel(), so that they can
+ * be told apart from channels created by ibv_create_comp_channel(). */
+static struct list_head comp_channels = LIST_HEAD_INIT(comp_channels);
+static pthread_mutex_t comp_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /** Returns the least power of 2 greater than in.  If in is greater than the
  * highest power of 2 representable as a size_t, then the behavior is
  * undefined. */
@@ -133,6 +141,9 @@ urdma_accl_post_recvv(struct ibv_qp *ib_qp, const struct iovec *iov, size_t iov_
 	}
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	if (qp->srq) {
+		return -EINVAL;
+	}
 	x = qp_get_next_recv_wqe(qp, &wqe);
 	if (x < 0)
 		return x;
@@ -148,8 +159,10 @@ urdma_accl_post_recvv(struct ibv_qp *ib_qp, const struct iovec *iov, size_t iov_
 	wqe->recv_size = 0;
 	wqe->input_size = 0;
 	wqe->complete = false;
+	wqe->flags = 0;
 	x = rte_ring_enqueue(qp->rq0.ring, wqe);
 	assert(x == 0);
+	usiw_qp_ring_doorbell(qp);
 
 	return 0;
 } /* urdma_accl_post_recvv */
@@ -194,6 +207,7 @@ urdma_accl_post_sendv(struct ibv_qp *ib_qp, struct iovec *iov, size_t iov_size,
 	struct usiw_qp *qp;
 	struct ee_state *ee;
 	struct usiw_send_wqe *wqe;
+	size_t length;
 	unsigned int y;
 	int x;
 
@@ -206,6 +220,20 @@ urdma_accl_post_sendv(struct ibv_qp *ib_qp, struct iovec *iov, size_t iov_size,
 		return -EINVAL;
 	}
 
+	if (ib_qp->qp_type == IBV_QPT_UD) {
+		/* Each datagram is sent as a single segment */
+		if (!ah || !qp_connected(qp)) {
+			return -EINVAL;
+		}
+		length = 0;
+		for (y = 0; y < iov_size; ++y) {
+			length += iov[y].iov_len;
+		}
+		if (length > qp->shm_qp->mtu) {
+			return -EMSGSIZE;
+		}
+	}
+
 	ee = &qp->remote_ep;
 	if (!ee) {
 		return -EINVAL;
@@ -220,6 +248,9 @@ urdma_accl_post_sendv(struct ibv_qp *ib_qp, struct iovec *iov, size_t iov_size,
 	memcpy(wqe->iov, iov, iov_size * sizeof(*iov));
 	wqe->iov_count = iov_size;
 	wqe->remote_ep = ee;
+	if (ah) {
+		wqe->ah = *ah;
+	}
 	wqe->state = SEND_WQE_INIT;
 	wqe->msn = 0; /* will be assigned at send time */
 	wqe->total_length = 0;
@@ -231,6 +262,7 @@ urdma_accl_post_sendv(struct ibv_qp *ib_qp, struct iovec *iov, size_t iov_size,
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
 
+	qp_direct_tx(qp);
 	return 0;
 } /* urdma_accl_post_sendv */
 
@@ -247,7 +279,7 @@ urdma_accl_post_write(struct ibv_qp *ib_qp, void *addr, size_t length,
 	int x;
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
-	if (!ah && !qp_connected(qp)) {
+	if ((!ah && !qp_connected(qp)) || ib_qp->qp_type == IBV_QPT_UD) {
 		return -EINVAL;
 	}
 
@@ -276,6 +308,7 @@ urdma_accl_post_write(struct ibv_qp *ib_qp, void *addr, size_t length,
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
 
+	qp_direct_tx(qp);
 	return 0;
 } /* urdma_accl_post_write */
 
@@ -292,7 +325,7 @@ urdma_accl_post_read(struct ibv_qp *ib_qp, void *addr, size_t length,
 	int x;
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
-	if (!ah && !qp_connected(qp)) {
+	if ((!ah && !qp_connected(qp)) || ib_qp->qp_type != IBV_QPT_RC) {
 		return -EINVAL;
 	}
 
@@ -306,6 +339,7 @@ urdma_accl_post_read(struct ibv_qp *ib_qp, void *addr, size_t length,
 		return x;
 
 	wqe->opcode = usiw_wr_read;
+	wqe->atomic_op = rdmap_atomic_none;
 	wqe->wr_context = context;
 	wqe->iov[0].iov_base = addr;
 	wqe->iov[0].iov_len = length;
@@ -321,10 +355,178 @@ urdma_accl_post_read(struct ibv_qp *ib_qp, void *addr, size_t length,
 	x = rte_ring_enqueue(qp->sq.ring, wqe);
 	assert(x == 0);
 
+	qp_direct_tx(qp);
 	return 0;
 } /* urdma_accl_post_read */
 
 
+/** Takes count free send WQEs at once, so that a batch is either posted in
+ * full or not at all. */
+static int
+qp_get_send_wqe_batch(struct usiw_qp *qp, struct usiw_send_wqe **wqe,
+		size_t count)
+{
+	int ret;
+
+	ret = 0;
+	rte_spinlock_lock(&qp->sq.lock);
+	/* We are the only consumer of free_ring while holding the lock, so
+	 * the burst is guaranteed to return everything that we counted. */
+	if (rte_ring_count(qp->sq.free_ring) < count) {
+		ret = -ENOSPC;
+	} else {
+		RING_DEQUEUE_BURST(qp->sq.free_ring, (void **)wqe, count);
+	}
+	rte_spinlock_unlock(&qp->sq.lock);
+	return ret;
+} /* qp_get_send_wqe_batch */
+
+
+static int
+accl_post_send_batch(struct ibv_qp *ib_qp, enum usiw_send_opcode opcode,
+		const struct urdma_accl_wr *wr, size_t count,
+		struct urdma_ah *ah)
+{
+	struct usiw_send_wqe *wqe[URDMA_ACCL_BATCH_MAX];
+	struct usiw_qp *qp;
+	unsigned int y;
+	int x;
+
+	if (count == 0 || count > URDMA_ACCL_BATCH_MAX) {
+		return -EINVAL;
+	}
+	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	if (!ah && !qp_connected(qp)) {
+		return -EINVAL;
+	}
+	if (ib_qp->qp_type == IBV_QPT_UC && opcode == usiw_wr_read) {
+		return -EINVAL;
+	}
+	if (ib_qp->qp_type == IBV_QPT_UD) {
+		if (!ah || !qp_connected(qp) || opcode != usiw_wr_send) {
+			return -EINVAL;
+		}
+		for (y = 0; y < count; ++y) {
+			if (wr[y].length > qp->shm_qp->mtu) {
+				return -EMSGSIZE;
+			}
+		}
+	}
+
+	x = qp_get_send_wqe_batch(qp, wqe, count);
+	if (x < 0)
+		return x;
+
+	for (y = 0; y < count; ++y) {
+		wqe[y]->opcode = opcode;
+		wqe[y]->wr_context = wr[y].context;
+		wqe[y]->flags = usiw_send_signaled;
+		wqe[y]->iov[0].iov_base = wr[y].addr;
+		wqe[y]->iov[0].iov_len = wr[y].length;
+		wqe[y]->iov_count = 1;
+		wqe[y]->remote_ep = &qp->remote_ep;
+		if (ah) {
+			wqe[y]->ah = *ah;
+		}
+		wqe[y]->remote_addr = wr[y].remote_addr;
+		wqe[y]->rkey = wr[y].rkey;
+		wqe[y]->atomic_op = rdmap_atomic_none;
+		wqe[y]->local_stag = 0;
+		wqe[y]->state = SEND_WQE_INIT;
+		wqe[y]->msn = 0; /* will be assigned at send time */
+		wqe[y]->total_length = wr[y].length;
+		wqe[y]->bytes_sent = 0;
+		wqe[y]->bytes_acked = 0;
+	}
+	x = RING_ENQUEUE_BURST(qp->sq.ring, (void **)wqe, count);
+	assert(x == count);
+
+	qp_direct_tx(qp);
+	return 0;
+} /* accl_post_send_batch */
+
+
+/** Posts count SEND operations, each from a single buffer, and publishes them
+ * to the progress thread together.  Either all or none of the operations are
+ * posted.  Returns -EINVAL if count is zero or larger than
+ * URDMA_ACCL_BATCH_MAX, or -ENOSPC if fewer than count send WQEs are
+ * free. */
+__attribute__((__visibility__("default")))
+int
+urdma_accl_post_send_batch(struct ibv_qp *ib_qp,
+		const struct urdma_accl_wr *wr, size_t count,
+		struct urdma_ah *ah)
+{
+	return accl_post_send_batch(ib_qp, usiw_wr_send, wr, count, ah);
+} /* urdma_accl_post_send_batch */
+
+
+__attribute__((__visibility__("default")))
+int
+urdma_accl_post_write_batch(struct ibv_qp *ib_qp,
+		const struct urdma_accl_wr *wr, size_t count,
+		struct urdma_ah *ah)
+{
+	return accl_post_send_batch(ib_qp, usiw_wr_write, wr, count, ah);
+} /* urdma_accl_post_write_batch */
+
+
+__attribute__((__visibility__("default")))
+int
+urdma_accl_post_read_batch(struct ibv_qp *ib_qp,
+		const struct urdma_accl_wr *wr, size_t count,
+		struct urdma_ah *ah)
+{
+	return accl_post_send_batch(ib_qp, usiw_wr_read, wr, count, ah);
+} /* urdma_accl_post_read_batch */
+
+
+__attribute__((__visibility__("default")))
+int
+urdma_accl_post_recv_batch(struct ibv_qp *ib_qp,
+		const struct urdma_accl_wr *wr, size_t count)
+{
+	struct usiw_recv_wqe *wqe[URDMA_ACCL_BATCH_MAX];
+	struct usiw_qp *qp;
+	unsigned int y;
+	int x;
+
+	if (count == 0 || count > URDMA_ACCL_BATCH_MAX) {
+		return -EINVAL;
+	}
+	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	if (qp->srq) {
+		return -EINVAL;
+	}
+
+	rte_spinlock_lock(&qp->rq0.lock);
+	if (rte_ring_count(qp->rq0.free_ring) < count) {
+		rte_spinlock_unlock(&qp->rq0.lock);
+		return -ENOSPC;
+	}
+	RING_DEQUEUE_BURST(qp->rq0.free_ring, (void **)wqe, count);
+	rte_spinlock_unlock(&qp->rq0.lock);
+
+	for (y = 0; y < count; ++y) {
+		wqe[y]->wr_context = wr[y].context;
+		wqe[y]->iov[0].iov_base = wr[y].addr;
+		wqe[y]->iov[0].iov_len = wr[y].length;
+		wqe[y]->iov_count = 1;
+		wqe[y]->total_request_size = wr[y].length;
+		wqe[y]->msn = 0;
+		wqe[y]->recv_size = 0;
+		wqe[y]->input_size = 0;
+		wqe[y]->complete = false;
+		wqe[y]->flags = 0;
+	}
+	x = RING_ENQUEUE_BURST(qp->rq0.ring, (void **)wqe, count);
+	assert(x == count);
+	usiw_qp_ring_doorbell(qp);
+
+	return 0;
+} /* urdma_accl_post_recv_batch */
+
+
 static int
 usiw_query_device(struct ibv_context *context,
 		struct ibv_device_attr *device_attr)
@@ -366,7 +568,7 @@ usiw_query_device(struct ibv_context *context,
 	device_attr->max_res_rd_atom = USIW_ORD_MAX;
 	device_attr->max_qp_init_rd_atom = USIW_IRD_MAX;
 	device_attr->max_ee_init_rd_atom = USIW_IRD_MAX;
-	device_attr->atomic_cap = IBV_ATOMIC_NONE;
+	device_attr->atomic_cap = IBV_ATOMIC_GLOB;
 	device_attr->max_ee = 0;
 	device_attr->max_rdd = 0;
 	device_attr->max_mw = 0;
@@ -377,7 +579,9 @@ usiw_query_device(struct ibv_context *context,
 	device_attr->max_total_mcast_qp_attach = 0;
 	device_attr->max_ah = 0;
 	device_attr->max_fmr = 0;
-	device_attr->max_srq = 0;
+	device_attr->max_srq = INT_MAX;
+	device_attr->max_srq_wr = MAX_RECV_WR;
+	device_attr->max_srq_sge = DPDK_VERBS_IOV_LEN_MAX;
 	device_attr->max_pkeys = 0;
 	device_attr->local_ca_ack_delay = 0;
 	device_attr->phys_port_cnt = 1;
@@ -501,6 +705,90 @@ usiw_dealloc_mw(__attribute__((unused)) struct ibv_mw *mw)
 } /* usiw_dealloc_mw */
 
 
+/** Allocates and initializes a ring able to hold at least count entries on
+ * the given NUMA socket. */
+static struct rte_ring *
+cq_ring_create(const char *name, size_t count, unsigned int flags,
+		int socket_id)
+{
+	struct rte_ring *ring;
+	unsigned int ring_size;
+	int ret;
+
+	ring_size = next_pow2(count + 1);
+	ring = rte_malloc_socket(NULL, rte_ring_get_memsize(ring_size),
+			RTE_CACHE_LINE_SIZE, socket_id);
+	if (!ring) {
+		errno = rte_errno;
+		return NULL;
+	}
+	ret = rte_ring_init(ring, name, ring_size, flags);
+	if (ret) {
+		errno = -ret;
+		rte_free(ring);
+		return NULL;
+	}
+	return ring;
+} /* cq_ring_create */
+
+/** Allocates the CQE storage and both rings for a CQ that can hold size
+ * completions, with every CQE initially on the free ring.  Only the rings are
+ * rounded up to a power of two; the storage holds exactly size CQEs. */
+static int
+cq_alloc_queues(uint32_t cq_id, size_t size, int socket_id,
+		struct rte_ring **cqe_ring, struct rte_ring **free_ring,
+		struct usiw_wc **storage)
+{
+	char name[RTE_RING_NAMESIZE];
+	size_t x;
+
+	*storage = rte_calloc_socket(NULL, size, sizeof(**storage),
+			RTE_CACHE_LINE_SIZE, socket_id);
+	if (!*storage) {
+		return ENOMEM;
+	}
+	snprintf(name, RTE_RING_NAMESIZE, "cq%" PRIu32 "_ready_ring", cq_id);
+	*cqe_ring = cq_ring_create(name, size, RING_F_SP_ENQ, socket_id);
+	if (!*cqe_ring) {
+		goto free_storage;
+	}
+	snprintf(name, RTE_RING_NAMESIZE, "cq%" PRIu32 "_empty_ring", cq_id);
+	*free_ring = cq_ring_create(name, size, RING_F_SC_DEQ, socket_id);
+	if (!*free_ring) {
+		goto free_cqe_ring;
+	}
+
+	for (x = 0; x < size; ++x) {
+		rte_ring_enqueue(*free_ring, &(*storage)[x]);
+	}
+	return 0;
+
+free_cqe_ring:
+	rte_free(*cqe_ring);
+free_storage:
+	rte_free(*storage);
+	return errno;
+} /* cq_alloc_queues */
+
+/** Returns true if the channel was created by urdma_create_comp_channel(). */
+static bool
+is_urdma_comp_channel(struct ibv_comp_channel *channel)
+{
+	struct urdma_comp_channel *p;
+	bool found = false;
+
+	pthread_mutex_lock(&comp_channels_lock);
+	list_for_each(&comp_channels, p, entry) {
+		if (&p->ib_channel == channel) {
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&comp_channels_lock);
+	return found;
+} /* is_urdma_comp_channel */
+
+
 static struct ibv_cq *
 usiw_create_cq(struct ibv_context *context, int size,
 		struct ibv_comp_channel *channel, int socket_id)
@@ -511,77 +799,66 @@ usiw_create_cq(struct ibv_context *context, int size,
 		struct urdma_uresp_create_cq priv;
 	} resp;
 	struct usiw_cq *cq;
-	unsigned int x;
-	char name[RTE_RING_NAMESIZE];
 	int ret;
 
-	if (size + 1 > SIZE_POW2_MAX) {
-		errno = -EINVAL;
+	if (size < 1 || size + 1 > SIZE_POW2_MAX) {
+		errno = EINVAL;
 		return NULL;
 	}
-	size = next_pow2(size + 1) - 1;
-	cq = malloc(sizeof(*cq) + size * sizeof(*cq->storage));
-	if (!cq)
+
+	/* The comp_vector selects the NUMA socket that the CQ is allocated
+	 * on; see usiw_num_completion_vectors().  Anything else gets the
+	 * socket of the NIC. */
+	if (socket_id < 0 || socket_id >= context->num_comp_vectors) {
+		socket_id = usiw_get_context(context)->dev->socket_id;
+	}
+	cq = rte_malloc_socket(NULL, sizeof(*cq), RTE_CACHE_LINE_SIZE,
+			socket_id);
+	if (!cq) {
+		errno = ENOMEM;
 		return NULL;
+	}
 	atomic_init(&cq->refcnt, 1);
+	cq->socket_id = socket_id;
 
 	/* Do not pass comp_vector to kernel space, since the kernel space
 	 * implementation is just a dummy to support connection management and
 	 * does not know or care about the userspace handling of
-	 * comp_vectors. */
+	 * comp_vectors.  Neither does it know about our completion channels,
+	 * which liburdma signals itself. */
+	cq->channel_fd = -1;
+	if (channel && is_urdma_comp_channel(channel)) {
+		cq->channel_fd = container_of(channel,
+				struct urdma_comp_channel, ib_channel)->write_fd;
+		channel = NULL;
+	}
+	atomic_init(&cq->channel_events, 0);
+	atomic_init(&cq->channel_retry, false);
 	ret = ibv_cmd_create_cq(context, size, channel, 0, &cq->ib_cq,
 			&cmd, sizeof(cmd), &resp.ibv, sizeof(resp));
 	if (ret) {
 		errno = ret;
-		free(cq);
+		rte_free(cq);
 		return NULL;
 	}
 
 	cq->cq_id = resp.priv.cq_id;
-	snprintf(name, RTE_RING_NAMESIZE, "cq%" PRIu32 "_ready_ring", cq->cq_id);
-	cq->cqe_ring = rte_malloc(NULL, rte_ring_get_memsize(size + 1),
-			socket_id);
-	if (!cq->cqe_ring) {
-		errno = rte_errno;
-		ibv_cmd_destroy_cq(&cq->ib_cq);
-		free(cq);
-		return NULL;
-	}
-	ret = rte_ring_init(cq->cqe_ring, name, size + 1, RING_F_SP_ENQ);
+	ret = cq_alloc_queues(cq->cq_id, size, cq->socket_id, &cq->cqe_ring,
+			&cq->free_ring, &cq->storage);
 	if (ret) {
-		errno = -ret;
-		rte_free(cq->cqe_ring);
-		ibv_cmd_destroy_cq(&cq->ib_cq);
-		free(cq);
-		return NULL;
-	}
-	snprintf(name, RTE_RING_NAMESIZE, "cq%" PRIu32 "_empty_ring", cq->cq_id);
-	cq->free_ring = rte_malloc(NULL, rte_ring_get_memsize(size + 1),
-			socket_id);
-	if (!cq->cqe_ring) {
-		errno = rte_errno;
-		rte_free(cq->cqe_ring);
 		ibv_cmd_destroy_cq(&cq->ib_cq);
-		free(cq);
-		return NULL;
-	}
-	ret = rte_ring_init(cq->free_ring, name, size + 1, RING_F_SC_DEQ);
-	if (!cq->free_ring) {
+		rte_free(cq);
 		errno = ret;
-		rte_free(cq->free_ring);
-		rte_free(cq->cqe_ring);
-		ibv_cmd_destroy_cq(&cq->ib_cq);
-		free(cq);
 		return NULL;
 	}
 
 	cq->capacity = size;
-	cq->storage = (struct usiw_wc *)(cq + 1);
-	for (x = 0; x < cq->capacity; ++x) {
-		rte_ring_enqueue(cq->free_ring, &cq->storage[x]);
-	}
+	cq->ib_cq.cqe = size;
 	cq->qp_count = 0;
-	atomic_init(&cq->notify_flag, false);
+	atomic_init(&cq->notify, usiw_cq_notify_none);
+	atomic_init(&cq->resizing, false);
+	atomic_init(&cq->post_active, 0);
+	atomic_init(&cq->poll_active, 0);
 	return &cq->ib_cq;
 } /* usiw_create_cq */
 
@@ -619,7 +896,8 @@ convert_cqes(struct usiw_wc *cqe, int num_entries, struct ibv_wc *wc)
 		wc[x].opcode = cqe[x].opcode;
 		wc[x].byte_len = cqe[x].byte_len;
 		wc[x].qp_num = cqe[x].qp_num;
-		wc[x].wc_flags = 0;
+		wc[x].wc_flags = cqe[x].wc_flags;
+		wc[x].imm_data = cqe[x].imm_data;
 	}
 } /* convert_cqes */
 
@@ -632,7 +910,9 @@ usiw_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
 	int count;
 
 	ourcq = container_of(cq, struct usiw_cq, ib_cq);
+	usiw_cq_enter(ourcq, &ourcq->poll_active);
 	count = do_poll_cq(ourcq, num_entries, cqe);
+	usiw_cq_exit(&ourcq->poll_active);
 	convert_cqes(cqe, count, wc);
 	return count;
 } /* usiw_poll_cq */
@@ -648,6 +928,20 @@ usiw_destroy_cq(struct ibv_cq *cq)
 		errno = EBUSY;
 		return -1;
 	}
+	if (ourcq->channel_fd >= 0) {
+		/* ibv_cmd_destroy_cq() waits for the application to
+		 * acknowledge the events that the kernel reported, which are
+		 * none for our channels; wait for ours instead */
+		atomic_store(&ourcq->notify, usiw_cq_notify_none);
+		pthread_mutex_lock(&cq->mutex);
+		while (cq->comp_events_completed
+				!= atomic_load(&ourcq->channel_events)) {
+			pthread_cond_wait(&cq->cond, &cq->mutex);
+		}
+		cq->comp_events_completed = 0;
+		atomic_store(&ourcq->channel_events, 0);
+		pthread_mutex_unlock(&cq->mutex);
+	}
 	ret = ibv_cmd_destroy_cq(cq);
 
 	if (atomic_fetch_sub(&ourcq->refcnt, 1) == 1) {
@@ -660,30 +954,159 @@ static int
 usiw_req_notify_cq(struct ibv_cq *ib_cq, int solicited_only)
 {
 	struct usiw_cq *cq = container_of(ib_cq, struct usiw_cq, ib_cq);
+	unsigned int cur;
+
 	if (!ib_cq->channel)
 		return EINVAL;
-	if (solicited_only)
+	if (!solicited_only) {
+		atomic_store(&cq->notify, usiw_cq_notify_all);
 		return 0;
+	}
 
-	atomic_store(&cq->notify_flag, true);
-
+	/* Arming for solicited completions must not narrow an earlier request
+	 * for all completions that has not been signaled yet */
+	cur = usiw_cq_notify_none;
+	atomic_compare_exchange_strong(&cq->notify, &cur,
+			usiw_cq_notify_solicited);
 	return 0;
 } /* usiw_req_notify_cq */
 
+/** Replaces the CQE storage and rings of the CQ with ones of the new size.
+ * Completions that have been posted but not yet polled are carried over in
+ * order.  Setting resizing and waiting for post_active and poll_active to
+ * drain keeps the progress thread and pollers out of the old rings meanwhile;
+ * see usiw_cq_enter().  Fails with EINVAL if more completions are
+ * outstanding than would fit in the new size. */
 static int
-usiw_resize_cq(__attribute__((unused)) struct ibv_cq *cq,
-		__attribute__((unused)) int cqe)
+usiw_resize_cq(struct ibv_cq *ib_cq, int cqe)
 {
-	return ENOSYS;
+	struct usiw_cq *cq = container_of(ib_cq, struct usiw_cq, ib_cq);
+	struct rte_ring *cqe_ring, *free_ring, *old_cqe_ring, *old_free_ring;
+	struct usiw_wc *storage, *old_storage;
+	unsigned int count, x;
+	void *old_cqe, *new_cqe;
+	int ret;
+
+	if (cqe < 1 || cqe + 1 > SIZE_POW2_MAX) {
+		return EINVAL;
+	}
+
+	ret = cq_alloc_queues(cq->cq_id, cqe, cq->socket_id, &cqe_ring,
+			&free_ring, &storage);
+	if (ret) {
+		return ret;
+	}
+
+	while (atomic_exchange(&cq->resizing, true)) {
+		sched_yield();
+	}
+	while (atomic_load(&cq->post_active) || atomic_load(&cq->poll_active)) {
+		sched_yield();
+	}
+	count = rte_ring_count(cq->cqe_ring);
+	if (count > (unsigned int)cqe) {
+		atomic_store(&cq->resizing, false);
+		ret = EINVAL;
+		goto free_new;
+	}
+	for (x = 0; x < count; ++x) {
+		rte_ring_dequeue(free_ring, &new_cqe);
+		rte_ring_dequeue(cq->cqe_ring, &old_cqe);
+		memcpy(new_cqe, old_cqe, sizeof(struct usiw_wc));
+		rte_ring_enqueue(cqe_ring, new_cqe);
+	}
+	old_cqe_ring = cq->cqe_ring;
+	old_free_ring = cq->free_ring;
+	old_storage = cq->storage;
+	cq->cqe_ring = cqe_ring;
+	cq->free_ring = free_ring;
+	cq->storage = storage;
+	cq->capacity = cqe;
+	ib_cq->cqe = cqe;
+	atomic_store(&cq->resizing, false);
+
+	rte_free(old_cqe_ring);
+	rte_free(old_free_ring);
+	rte_free(old_storage);
+	return 0;
+
+free_new:
+	rte_free(free_ring);
+	rte_free(cqe_ring);
+	rte_free(storage);
+	return ret;
 } /* usiw_resize_cq */
 
 
 static struct ibv_srq *
-usiw_create_srq_ex(__attribute__((unused)) struct ibv_context *context,
-		__attribute__((unused))
+usiw_create_srq_ex(struct ibv_context *context,
 		struct ibv_srq_init_attr_ex *srq_init_attr_ex)
 {
-	errno = ENOSYS;
+	struct ibv_create_srq cmd;
+	struct {
+		struct ib_uverbs_create_srq_resp ibv;
+		struct urdma_uresp_create_srq priv;
+	} resp;
+	struct ibv_srq_init_attr init_attr;
+	struct ibv_srq_attr *attr;
+	struct usiw_srq *srq;
+	int ret;
+
+	attr = &srq_init_attr_ex->attr;
+	if (!(srq_init_attr_ex->comp_mask & IBV_SRQ_INIT_ATTR_PD)
+			|| ((srq_init_attr_ex->comp_mask & IBV_SRQ_INIT_ATTR_TYPE)
+			    && srq_init_attr_ex->srq_type != IBV_SRQT_BASIC)
+			|| attr->max_wr > MAX_RECV_WR
+			|| attr->max_sge > DPDK_VERBS_IOV_LEN_MAX
+			|| attr->srq_limit > attr->max_wr) {
+		errno = EINVAL;
+		return NULL;
+	}
+	attr->max_wr = RTE_MAX(next_pow2(attr->max_wr + 1) - 1, 63);
+	if (!attr->max_sge) {
+		attr->max_sge = 3;
+	}
+
+	srq = rte_zmalloc_socket(NULL, sizeof(*srq), RTE_CACHE_LINE_SIZE,
+			usiw_get_context(context)->dev->socket_id);
+	if (!srq) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	atomic_init(&srq->refcnt, 1);
+
+	init_attr.srq_context = srq_init_attr_ex->srq_context;
+	init_attr.attr = *attr;
+	ret = ibv_cmd_create_srq(srq_init_attr_ex->pd, &srq->ib_srq,
+			&init_attr, &cmd, sizeof(cmd),
+			&resp.ibv, sizeof(resp));
+	if (ret) {
+		RTE_LOG(DEBUG, USER1, "uverbs create_srq failed\n");
+		errno = ret;
+		goto free_srq;
+	}
+	srq->srq_id = resp.priv.srq_id;
+
+	ret = usiw_recv_wqe_queue_init(srq->srq_id, &srq->rq,
+			attr->max_wr, attr->max_sge,
+			usiw_get_context(context)->dev->socket_id);
+	if (ret) {
+		RTE_LOG(DEBUG, USER1, "create SRQ WQ failed\n");
+		errno = -ret;
+		goto destroy_srq;
+	}
+
+	srq->ctx = usiw_get_context(context);
+	list_head_init(&srq->qp_head);
+	srq->qp_count = 0;
+	atomic_init(&srq->srq_limit, attr->srq_limit);
+	return &srq->ib_srq;
+
+destroy_srq:
+	usiw_recv_wqe_queue_destroy(&srq->rq);
+	ibv_cmd_destroy_srq(&srq->ib_srq);
+free_srq:
+	rte_free(srq);
 	return NULL;
 } /* usiw_create_srq_ex */
 
@@ -692,21 +1115,41 @@ static struct ibv_srq *
 usiw_create_srq(struct ibv_pd *pd, struct ibv_srq_init_attr *init_attr)
 {
 	struct ibv_srq_init_attr_ex init_attr_ex;
+	struct ibv_srq *srq;
+
 	init_attr_ex.srq_context = init_attr->srq_context;
 	memcpy(&init_attr_ex.attr, &init_attr->attr, sizeof(init_attr_ex.attr));
 	init_attr_ex.comp_mask = IBV_SRQ_INIT_ATTR_TYPE|IBV_SRQ_INIT_ATTR_PD;
 	init_attr_ex.srq_type = IBV_SRQT_BASIC;
 	init_attr_ex.pd = pd;
-	return usiw_create_srq_ex(pd->context, &init_attr_ex);
+	srq = usiw_create_srq_ex(pd->context, &init_attr_ex);
+	if (srq) {
+		memcpy(&init_attr->attr, &init_attr_ex.attr,
+				sizeof(init_attr->attr));
+	}
+	return srq;
 } /* usiw_create_srq */
 
 
 static int
-usiw_modify_srq(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_srq_attr *srq_attr,
-		__attribute__((unused)) int srq_attr_mask)
+usiw_modify_srq(struct ibv_srq *ib_srq, struct ibv_srq_attr *srq_attr,
+		int srq_attr_mask)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+
+	/* Resizing a shared receive queue is not supported */
+	if (srq_attr_mask & IBV_SRQ_MAX_WR) {
+		return EINVAL;
+	}
+
+	if (srq_attr_mask & IBV_SRQ_LIMIT) {
+		if (srq_attr->srq_limit > (uint32_t)srq->rq.max_wr) {
+			return EINVAL;
+		}
+		atomic_store(&srq->srq_limit, srq_attr->srq_limit);
+	}
+
+	return 0;
 } /* usiw_modify_srq */
 
 
@@ -719,26 +1162,91 @@ usiw_get_srq_num(__attribute__((unused)) struct ibv_srq *srq,
 
 
 static int
-usiw_query_srq(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_srq_attr *srq_attr)
+usiw_query_srq(struct ibv_srq *ib_srq, struct ibv_srq_attr *srq_attr)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+
+	srq_attr->max_wr = srq->rq.max_wr;
+	srq_attr->max_sge = srq->rq.max_sge;
+	srq_attr->srq_limit = atomic_load(&srq->srq_limit);
+	return 0;
 } /* usiw_query_srq */
 
 
 static int
-usiw_destroy_srq(__attribute__((unused)) struct ibv_srq *srq)
+usiw_destroy_srq(struct ibv_srq *ib_srq)
 {
-	return ENOSYS;
+	struct usiw_srq *srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+	int ret;
+
+	if (srq->qp_count) {
+		return EBUSY;
+	}
+	ret = ibv_cmd_destroy_srq(ib_srq);
+
+	if (atomic_fetch_sub(&srq->refcnt, 1) == 1) {
+		urdma_do_destroy_srq(srq);
+	}
+	return ret;
 } /* usiw_destroy_srq */
 
 
 static int
-usiw_post_srq_recv(__attribute__((unused)) struct ibv_srq *srq,
-		__attribute__((unused)) struct ibv_recv_wr *recv_wr,
-		__attribute__((unused)) struct ibv_recv_wr **bad_recv_wr)
+usiw_post_srq_recv(struct ibv_srq *ib_srq, struct ibv_recv_wr *wr,
+		struct ibv_recv_wr **bad_wr)
 {
-	return ENOSYS;
+	struct usiw_recv_wqe *wqe;
+	struct usiw_srq *srq;
+	struct usiw_qp *qp;
+	bool posted = false;
+	int x, ret;
+
+	srq = container_of(ib_srq, struct usiw_srq, ib_srq);
+	rte_spinlock_lock(&srq->rq.lock);
+	for (; wr != NULL; wr = wr->next) {
+		if (wr->num_sge > srq->rq.max_sge) {
+			ret = EINVAL;
+			goto errout;
+		}
+
+		if (rte_ring_dequeue(srq->rq.free_ring, (void **)&wqe) < 0) {
+			ret = ENOSPC;
+			goto errout;
+		}
+
+		wqe->wr_context = (void *)(uintptr_t)wr->wr_id;
+		wqe->total_request_size = 0;
+		wqe->iov_count = wr->num_sge;
+		for (x = 0; x < wr->num_sge; ++x) {
+			wqe->iov[x].iov_base
+				= (void *)(uintptr_t)wr->sg_list[x].addr;
+			wqe->iov[x].iov_len = wr->sg_list[x].length;
+			wqe->total_request_size += wqe->iov[x].iov_len;
+		}
+		wqe->remote_ep = NULL;
+		wqe->msn = 0;
+		wqe->recv_size = 0;
+		wqe->input_size = 0;
+		wqe->complete = false;
+		wqe->flags = 0;
+		x = rte_ring_enqueue(srq->rq.ring, wqe);
+		assert(x == 0);
+		posted = true;
+	}
+	ret = 0;
+
+errout:
+	/* Any of the attached queue pairs may be waiting for these WQEs */
+	if (posted) {
+		list_for_each(&srq->qp_head, qp, srq_entry) {
+			usiw_qp_ring_doorbell(qp);
+		}
+	}
+	rte_spinlock_unlock(&srq->rq.lock);
+	if (ret) {
+		*bad_wr = wr;
+	}
+	return ret;
 } /* usiw_post_srq_recv */
 
 
@@ -796,6 +1304,7 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	int retval;
 
 	if ((qp_init_attr->qp_type != IBV_QPT_UD
+				&& qp_init_attr->qp_type != IBV_QPT_UC
 				&& qp_init_attr->qp_type != IBV_QPT_RC)
 			|| qp_init_attr->cap.max_send_wr > MAX_SEND_WR
 			|| qp_init_attr->cap.max_recv_wr > MAX_RECV_WR
@@ -810,15 +1319,22 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	}
 	qp_init_attr->cap.max_send_wr
 		= RTE_MAX(next_pow2(qp_init_attr->cap.max_send_wr + 1) - 1, 63);
-	qp_init_attr->cap.max_recv_wr
-		= RTE_MAX(next_pow2(qp_init_attr->cap.max_recv_wr + 1) - 1, 63);
+	if (qp_init_attr->srq) {
+		/* Receive WQEs are drawn from the shared receive queue */
+		qp_init_attr->cap.max_recv_wr = 0;
+		qp_init_attr->cap.max_recv_sge = 0;
+	} else {
+		qp_init_attr->cap.max_recv_wr
+			= RTE_MAX(next_pow2(qp_init_attr->cap.max_recv_wr + 1)
+					- 1, 63);
+	}
 
 	/* By default provide one cache line of scatter-gather elements (the
 	 * cache line includes the count at the start) */
 	if (!qp_init_attr->cap.max_send_sge) {
 		qp_init_attr->cap.max_send_sge = 3;
 	}
-	if (!qp_init_attr->cap.max_recv_sge) {
+	if (!qp_init_attr->srq && !qp_init_attr->cap.max_recv_sge) {
 		qp_init_attr->cap.max_recv_sge = 3;
 	}
 	sz = qp_init_attr->cap.max_send_sge * sizeof(struct iovec);
@@ -832,9 +1348,11 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 
 	ctx = usiw_get_context(pd->context);
 
-	qp = calloc(1, sizeof(*qp));
+	qp = rte_zmalloc_socket(NULL, sizeof(*qp), RTE_CACHE_LINE_SIZE,
+			ctx->dev->socket_id);
 	if (!qp) {
-		RTE_LOG(DEBUG, USER1, "calloc QP struct failed\n");
+		RTE_LOG(DEBUG, USER1, "alloc QP struct failed\n");
+		errno = ENOMEM;
 		goto errout;
 	}
 	qp->shm_qp = port_get_next_qp(ctx->dev);
@@ -860,6 +1378,11 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 
 	qp->qp_flags = qp_init_attr->sq_sig_all
 		? usiw_qp_sig_all : 0;
+	qp->priority = urdma_qp_priority_normal;
+	qp->tx_weight = 1;
+	qp->tx_sq_ratio = 1;
+	qp->tx_readresp_ratio = 1;
+	rte_spinlock_init(&qp->tx_lock);
 	atomic_store(&qp->shm_qp->conn_state, usiw_qp_unbound);
 	qp->ctx = ctx;
 	qp->dev = ctx->dev;
@@ -879,7 +1402,7 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 
 	retval = usiw_send_wqe_queue_init(qp->ib_qp.qp_num,
 			&qp->sq, qp_init_attr->cap.max_send_wr,
-			qp_init_attr->cap.max_send_sge);
+			qp_init_attr->cap.max_send_sge, ctx->dev->socket_id);
 	if (retval != 0) {
 		RTE_LOG(DEBUG, USER1, "create SEND WQ failed\n");
 		errno = -retval;
@@ -887,17 +1410,36 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	}
 	qp->sq.max_inline = qp_init_attr->cap.max_inline_data;
 
-	retval = usiw_recv_wqe_queue_init(qp->ib_qp.qp_num,
-			&qp->rq0, qp_init_attr->cap.max_recv_wr,
-			qp_init_attr->cap.max_recv_sge);
-	if (retval != 0) {
-		RTE_LOG(DEBUG, USER1, "create RECV WQ failed\n");
-		errno = -retval;
-		goto free_txq;
+	if (qp_init_attr->srq) {
+		/* rq0 only tracks the WQEs that this queue pair has taken
+		 * from the shared receive queue, so it needs no rings or
+		 * storage of its own. */
+		qp->srq = container_of(qp_init_attr->srq,
+				struct usiw_srq, ib_srq);
+		list_head_init(&qp->rq0.active_head);
+		rte_spinlock_init(&qp->rq0.lock);
+		qp->rq0.next_msn = 1;
+		qp->rq0.max_sge = qp->srq->rq.max_sge;
+		rte_spinlock_lock(&qp->srq->rq.lock);
+		list_add_tail(&qp->srq->qp_head, &qp->srq_entry);
+		qp->srq->qp_count++;
+		rte_spinlock_unlock(&qp->srq->rq.lock);
+		atomic_fetch_add(&qp->srq->refcnt, 1);
+	} else {
+		retval = usiw_recv_wqe_queue_init(qp->ib_qp.qp_num,
+				&qp->rq0, qp_init_attr->cap.max_recv_wr,
+				qp_init_attr->cap.max_recv_sge,
+				ctx->dev->socket_id);
+		if (retval != 0) {
+			RTE_LOG(DEBUG, USER1, "create RECV WQ failed\n");
+			errno = -retval;
+			goto free_txq;
+		}
 	}
 
 	qp->readresp_store = NULL;
 	qp->readresp_head_msn = 1;
+	qp->readreq_head_msn = 1;
 	qp->ord_active = 0;
 
 	ee = &qp->remote_ep;
@@ -914,6 +1456,7 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	atomic_init(&qp->refcnt, 2);
 
 	rte_spinlock_lock(&ctx->qp_lock);
+	atomic_init(&qp->init_counted, true);
 	atomic_fetch_add(&ctx->qp_init_count, 1);
 	HASH_ADD(hh, ctx->qp, ib_qp.qp_num,
 			sizeof(qp->ib_qp.qp_num), qp);
@@ -923,12 +1466,12 @@ usiw_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 	return &qp->ib_qp;
 
 free_txq:
-	free(qp->txq);
+	rte_free(qp->txq);
 	ibv_cmd_destroy_qp(&qp->ib_qp);
 return_user_qp:
 	port_return_qp(qp);
 free_user_qp:
-	free(qp);
+	rte_free(qp);
 errout:
 	return NULL;
 } /* usiw_create_qp */
@@ -1035,6 +1578,7 @@ usiw_modify_qp(struct ibv_qp *ib_qp, struct ibv_qp_attr *attr, int attr_mask)
 			}
 		} while (!atomic_compare_exchange_weak(&qp->shm_qp->conn_state,
 					&cur_state, next_state));
+		usiw_qp_ring_doorbell(qp);
 		break;
 	default:
 		break;
@@ -1059,20 +1603,28 @@ usiw_destroy_qp(struct ibv_qp *ib_qp)
 
 	ctx = qp->ctx;
 	cur_state = atomic_load(&qp->shm_qp->conn_state);
-	if (cur_state == usiw_qp_unbound) {
-		assert(atomic_load(&ctx->qp_init_count) != 0);
-		atomic_fetch_sub(&ctx->qp_init_count, 1);
-	}
 	qp->recv_cq->qp_count--;
 	if (qp->send_cq != qp->recv_cq) {
 		qp->send_cq->qp_count--;
 	}
-	if (cur_state > usiw_qp_unbound && cur_state < usiw_qp_shutdown) {
+	if (qp->srq) {
+		rte_spinlock_lock(&qp->srq->rq.lock);
+		list_del(&qp->srq_entry);
+		qp->srq->qp_count--;
+		rte_spinlock_unlock(&qp->srq->rq.lock);
+	}
+	/* Move the queue pair to the error state, even if it was never
+	 * started, so that the progress thread retires it and drops its
+	 * reference.  One that has not been started is still counted in
+	 * qp_init_count, so the progress thread finds it in qp_active even
+	 * though nothing answers its doorbell. */
+	if (cur_state < usiw_qp_shutdown) {
 		do {
 			cmpxchg_res = atomic_compare_exchange_weak(
 						&qp->shm_qp->conn_state,
 						&cur_state, usiw_qp_error);
 		} while (!cmpxchg_res && cur_state < usiw_qp_shutdown);
+		usiw_qp_ring_doorbell(qp);
 	}
 	pthread_mutex_unlock(&qp->shm_qp->conn_event_lock);
 
@@ -1111,13 +1663,45 @@ do_inline(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
 	return 0;
 } /* do_inline */
 
+/** Validates the local sink of an RDMA READ or atomic operation and sets the
+ * STag that is sent in the request.  The response is placed directly into the
+ * sink list, so every SGE must be writable and the total must fit in
+ * read_msg_size. */
+static int
+set_read_sink(struct usiw_qp *qp, struct usiw_send_wqe *wqe,
+		const struct ibv_sge *sg_list, size_t num_sge)
+{
+	struct usiw_mr **mr;
+	uint64_t read_length;
+	size_t x;
+
+	if (num_sge < 1) {
+		return EINVAL;
+	}
+
+	read_length = 0;
+	for (x = 0; x < num_sge; ++x) {
+		mr = usiw_mr_lookup(qp->pd, sg_list[x].lkey);
+		if (!mr || !((*mr)->access & IBV_ACCESS_REMOTE_WRITE)) {
+			return EINVAL;
+		}
+		read_length += sg_list[x].length;
+	}
+	if (read_length > UINT32_MAX) {
+		return EINVAL;
+	}
+
+	mr = usiw_mr_lookup(qp->pd, sg_list[0].lkey);
+	wqe->local_stag = (*mr)->mr.rkey;
+	return 0;
+} /* set_read_sink */
+
 static int
 usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 		struct ibv_send_wr **bad_wr)
 {
 	struct usiw_qp *qp;
 	struct usiw_send_wqe *wqe;
-	struct usiw_mr **mr;
 	int sge_limit, x, ret;
 
 	if (!wr) {
@@ -1126,6 +1710,12 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 	}
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	if (ib_qp->qp_type == IBV_QPT_UD) {
+		/* We have no ibv_ah; datagrams are sent with
+		 * urdma_accl_post_send() and a struct urdma_ah */
+		ret = EINVAL;
+		goto errout;
+	}
 	switch (atomic_load(&qp->shm_qp->conn_state)) {
 	case usiw_qp_connected:
 	case usiw_qp_running:
@@ -1137,7 +1727,9 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 	}
 	for (; wr != NULL; wr = wr->next) {
 		sge_limit = (wr->opcode == IBV_WR_RDMA_READ)
-					? 1 : qp->sq.max_sge;
+			? RTE_MIN(qp->sq.max_sge,
+					DPDK_VERBS_RDMA_READ_IOV_LEN_MAX)
+			: qp->sq.max_sge;
 		if (wr->num_sge > sge_limit) {
 			ret = EINVAL;
 			goto errout;
@@ -1151,17 +1743,28 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 		wqe->flags = ((wr->send_flags & IBV_SEND_SIGNALED)
 				|| (qp->qp_flags & usiw_qp_sig_all))
 			? usiw_send_signaled : 0;
+		if (wr->send_flags & IBV_SEND_SOLICITED) {
+			wqe->flags |= usiw_send_solicited;
+		}
 
 		switch (wr->opcode) {
+		case IBV_WR_SEND_WITH_IMM:
+			wqe->imm_data = wr->imm_data;
+			/* fall through */
 		case IBV_WR_SEND:
-			wqe->opcode = usiw_wr_send;
+			wqe->opcode = (wr->opcode == IBV_WR_SEND_WITH_IMM)
+				? usiw_wr_send_with_imm : usiw_wr_send;
 			if ((wr->send_flags & IBV_SEND_INLINE)
 					&& (ret = do_inline(qp, wqe, wr))!=0) {
 				goto errout;
 			}
 			break;
+		case IBV_WR_RDMA_WRITE_WITH_IMM:
+			wqe->imm_data = wr->imm_data;
+			/* fall through */
 		case IBV_WR_RDMA_WRITE:
-			wqe->opcode = usiw_wr_write;
+			wqe->opcode = (wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+				? usiw_wr_write_with_imm : usiw_wr_write;
 			wqe->remote_addr = wr->wr.rdma.remote_addr;
 			wqe->rkey = wr->wr.rdma.rkey;
 			if ((wr->send_flags & IBV_SEND_INLINE)
@@ -1170,19 +1773,54 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 			}
 			break;
 		case IBV_WR_RDMA_READ:
-			if (wr->send_flags & IBV_SEND_INLINE) {
+			if ((wr->send_flags & IBV_SEND_INLINE)
+					|| ib_qp->qp_type == IBV_QPT_UC) {
 				ret = EINVAL;
 				goto errout;
 			}
 			wqe->opcode = usiw_wr_read;
+			wqe->atomic_op = rdmap_atomic_none;
 			wqe->remote_addr = wr->wr.rdma.remote_addr;
 			wqe->rkey = wr->wr.rdma.rkey;
-			mr = usiw_mr_lookup(qp->pd, wr->sg_list[0].lkey);
-			if (!mr || !((*mr)->access & IBV_ACCESS_REMOTE_WRITE)) {
+			ret = set_read_sink(qp, wqe, wr->sg_list, wr->num_sge);
+			if (ret) {
+				goto free_wqe;
+			}
+			break;
+		case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		case IBV_WR_ATOMIC_CMP_AND_SWP:
+			/* Atomic operations are carried as a variant of RDMA
+			 * READ so that they share its ordering and credits;
+			 * the original value is returned like a READ
+			 * Response. */
+			if ((wr->send_flags & IBV_SEND_INLINE)
+					|| ib_qp->qp_type == IBV_QPT_UC
+					|| wr->num_sge != 1
+					|| wr->sg_list[0].length
+						< sizeof(uint64_t)
+					|| (wr->wr.atomic.remote_addr
+						& (sizeof(uint64_t) - 1))) {
 				ret = EINVAL;
 				goto free_wqe;
 			}
-			wqe->local_stag = (*mr)->mr.rkey;
+			wqe->opcode = usiw_wr_read;
+			if (wr->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+				wqe->atomic_op = rdmap_atomic_fetch_add;
+				wqe->atomic_swap_add
+					= wr->wr.atomic.compare_add;
+				wqe->atomic_compare = 0;
+			} else {
+				wqe->atomic_op = rdmap_atomic_cmp_swap;
+				wqe->atomic_swap_add = wr->wr.atomic.swap;
+				wqe->atomic_compare
+					= wr->wr.atomic.compare_add;
+			}
+			wqe->remote_addr = wr->wr.atomic.remote_addr;
+			wqe->rkey = wr->wr.atomic.rkey;
+			ret = set_read_sink(qp, wqe, wr->sg_list, wr->num_sge);
+			if (ret) {
+				goto free_wqe;
+			}
 			break;
 		default:
 			ret = EOPNOTSUPP;
@@ -1208,6 +1846,7 @@ usiw_post_send(struct ibv_qp *ib_qp, struct ibv_send_wr *wr,
 		assert(x == 0);
 	}
 
+	qp_direct_tx(qp);
 	return 0;
 
 free_wqe:
@@ -1226,7 +1865,7 @@ usiw_post_recv(struct ibv_qp *ib_qp, struct ibv_recv_wr *wr,
 	int x, ret;
 
 	qp = container_of(ib_qp, struct usiw_qp, ib_qp);
-	if (atomic_load(&qp->shm_qp->conn_state) == usiw_qp_error) {
+	if (qp->srq || atomic_load(&qp->shm_qp->conn_state) == usiw_qp_error) {
 		*bad_wr = wr;
 		return EINVAL;
 	}
@@ -1257,9 +1896,11 @@ usiw_post_recv(struct ibv_qp *ib_qp, struct ibv_recv_wr *wr,
 		wqe->recv_size = 0;
 		wqe->input_size = 0;
 		wqe->complete = false;
+		wqe->flags = 0;
 		x = rte_ring_enqueue(qp->rq0.ring, wqe);
 		assert(x == 0);
 	}
+	usiw_qp_ring_doorbell(qp);
 
 	return 0;
 
@@ -1314,6 +1955,205 @@ usiw_num_completion_vectors(void)
 	return max_socket_id + 1;
 } /* usiw_num_completion_vectors */
 
+/** Enables or disables direct transmit for the given queue pair.  In this
+ * mode, the thread that posts a send WQE also builds and transmits its
+ * packets, as far as the peer's credits allow, instead of waiting for the next
+ * pass of the progress thread.  Acknowledgements, retransmissions, receive
+ * processing and completions are still handled by the progress thread.  This
+ * must be called before the queue pair is connected; returns EBUSY
+ * otherwise. */
+__attribute__((__visibility__("default")))
+int
+urdma_qp_set_direct_tx(struct ibv_qp *ib_qp, bool enable)
+{
+	struct usiw_qp *qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+
+	if (ib_qp->qp_type == IBV_QPT_UD) {
+		return EINVAL;
+	}
+	if (atomic_load(&qp->shm_qp->conn_state) != usiw_qp_unbound) {
+		return EBUSY;
+	}
+	if (enable) {
+		qp->qp_flags |= usiw_qp_direct_tx;
+	} else {
+		qp->qp_flags &= ~usiw_qp_direct_tx;
+	}
+	return 0;
+} /* urdma_qp_set_direct_tx */
+
+
+/** Sets the scheduling class and weight of the given queue pair.  On each
+ * pass, the progress thread serves queue pairs of urdma_qp_priority_high
+ * before those of urdma_qp_priority_normal, and within each class lets every
+ * queue pair send up to weight TX bursts of new messages, so that bandwidth
+ * is shared in proportion to weight among queue pairs with data to send.
+ * The defaults are urdma_qp_priority_normal and a weight of 1.  This must be
+ * called before the queue pair is connected; returns EBUSY otherwise, or
+ * EINVAL if weight is zero or larger than URDMA_QP_WEIGHT_MAX. */
+__attribute__((__visibility__("default")))
+int
+urdma_qp_set_priority(struct ibv_qp *ib_qp, enum urdma_qp_priority priority,
+		unsigned int weight)
+{
+	struct usiw_qp *qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+
+	if ((priority != urdma_qp_priority_normal
+				&& priority != urdma_qp_priority_high)
+			|| weight == 0 || weight > URDMA_QP_WEIGHT_MAX) {
+		return EINVAL;
+	}
+	if (atomic_load(&qp->shm_qp->conn_state) != usiw_qp_unbound) {
+		return EBUSY;
+	}
+	qp->priority = priority;
+	qp->tx_weight = weight;
+	return 0;
+} /* urdma_qp_set_priority */
+
+
+/** Creates a completion channel which liburdma signals directly, without a
+ * system call into the kernel module and a second hop through the uverbs
+ * event file for every notification.  It is used exactly like one created by
+ * ibv_create_comp_channel(): pass it to ibv_create_cq(), arm the CQ with
+ * ibv_req_notify_cq(), and wait with ibv_get_cq_event() or by polling its fd.
+ * It must be destroyed with urdma_destroy_comp_channel(), not
+ * ibv_destroy_comp_channel().  Returns NULL and sets errno on failure. */
+__attribute__((__visibility__("default")))
+struct ibv_comp_channel *
+urdma_create_comp_channel(struct ibv_context *context)
+{
+	struct urdma_comp_channel *channel;
+	int fds[2];
+
+	channel = malloc(sizeof(*channel));
+	if (!channel) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (pipe(fds) < 0) {
+		goto free_channel;
+	}
+	/* The progress thread must never block on an application that is
+	 * not reading its events */
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0
+			|| fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0
+			|| fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {
+		goto close_pipe;
+	}
+
+	channel->ib_channel.context = context;
+	channel->ib_channel.fd = fds[0];
+	channel->ib_channel.refcnt = 0;
+	channel->write_fd = fds[1];
+	pthread_mutex_lock(&comp_channels_lock);
+	list_add_tail(&comp_channels, &channel->entry);
+	pthread_mutex_unlock(&comp_channels_lock);
+	return &channel->ib_channel;
+
+close_pipe:
+	close(fds[0]);
+	close(fds[1]);
+free_channel:
+	free(channel);
+	return NULL;
+} /* urdma_create_comp_channel */
+
+
+/** Destroys a completion channel created by urdma_create_comp_channel().
+ * Returns EBUSY if any CQs are still associated with the channel, or EINVAL
+ * if it was not created by urdma_create_comp_channel(). */
+__attribute__((__visibility__("default")))
+int
+urdma_destroy_comp_channel(struct ibv_comp_channel *ib_channel)
+{
+	struct urdma_comp_channel *channel = container_of(ib_channel,
+			struct urdma_comp_channel, ib_channel);
+
+	if (!is_urdma_comp_channel(ib_channel)) {
+		return EINVAL;
+	}
+	if (ib_channel->refcnt) {
+		return EBUSY;
+	}
+	pthread_mutex_lock(&comp_channels_lock);
+	list_del(&channel->entry);
+	pthread_mutex_unlock(&comp_channels_lock);
+	close(ib_channel->fd);
+	close(channel->write_fd);
+	free(channel);
+	return 0;
+} /* urdma_destroy_comp_channel */
+
+
+/** Sets how the given reliable connected queue pair shares its bandwidth
+ * between segments of its own send WQEs and RDMA READ Responses to its peer
+ * when it has both to send.  The two take turns of request_bursts and
+ * response_bursts TX bursts respectively; either side gets all of the
+ * bandwidth when the other has nothing to send.  The default is 1:1.  This
+ * must be called before the queue pair is connected; returns EBUSY otherwise,
+ * or EINVAL if either argument is zero or larger than
+ * URDMA_QP_WEIGHT_MAX. */
+__attribute__((__visibility__("default")))
+int
+urdma_qp_set_read_response_ratio(struct ibv_qp *ib_qp,
+		unsigned int request_bursts, unsigned int response_bursts)
+{
+	struct usiw_qp *qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+
+	if (ib_qp->qp_type != IBV_QPT_RC
+			|| request_bursts == 0
+			|| request_bursts > URDMA_QP_WEIGHT_MAX
+			|| response_bursts == 0
+			|| response_bursts > URDMA_QP_WEIGHT_MAX) {
+		return EINVAL;
+	}
+	if (atomic_load(&qp->shm_qp->conn_state) != usiw_qp_unbound) {
+		return EBUSY;
+	}
+	qp->tx_sq_ratio = request_bursts;
+	qp->tx_readresp_ratio = response_bursts;
+	return 0;
+} /* urdma_qp_set_read_response_ratio */
+
+
+/** Binds an unreliable datagram queue pair to the given local UDP port (in
+ * host byte order), after which it can send and receive datagrams.  Peers
+ * address datagrams to this queue pair by this port and the IPv4 address of
+ * the device.  Returns EINVAL if the queue pair is not an unbound IBV_QPT_UD
+ * queue pair, or EADDRINUSE if another queue pair or a kernel socket on the
+ * device's address already uses the port. */
+__attribute__((__visibility__("default")))
+int
+urdma_ud_qp_bind(struct ibv_qp *ib_qp, uint16_t udp_port)
+{
+	struct usiw_qp *qp = container_of(ib_qp, struct usiw_qp, ib_qp);
+	struct urdmad_sock_bind_ud_qp_msg msg;
+	ssize_t ret;
+
+	if (ib_qp->qp_type != IBV_QPT_UD || udp_port == 0
+			|| atomic_load(&qp->shm_qp->conn_state)
+							!= usiw_qp_unbound) {
+		return EINVAL;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.opcode = rte_cpu_to_be_32(urdma_sock_bind_ud_qp_req);
+	msg.hdr.dev_id = rte_cpu_to_be_16(qp->dev->portid);
+	msg.hdr.qp_id = rte_cpu_to_be_16(qp->shm_qp->qp_id);
+	msg.udp_port = rte_cpu_to_be_16(udp_port);
+	ret = send(qp->dev->urdmad_fd, &msg, sizeof(msg), 0);
+	if (ret < sizeof(msg)) {
+		return EIO;
+	}
+	ret = recv(qp->dev->urdmad_fd, &msg, sizeof(msg), 0);
+	if (ret < sizeof(msg) || rte_be_to_cpu_32(msg.hdr.opcode)
+					!= urdma_sock_bind_ud_qp_resp) {
+		return EIO;
+	}
+	return rte_be_to_cpu_32(msg.status);
+} /* urdma_ud_qp_bind */
+
 /** Returns statistics for the given queue pair. Note that recv_count_histo is
  * dynamically allocated and should be free'd after use.
  *
@@ -1351,6 +2191,11 @@ urdma_query_qp_stats_ex(const struct ibv_qp *ib_qp)
 		stats->recv_psn_gap_count = qp->stats.recv_psn_gap_count;
 		stats->recv_retransmit_count = qp->stats.recv_retransmit_count;
 		stats->recv_sack_count = qp->stats.recv_sack_count;
+		stats->recv_msg_lost_count = qp->stats.recv_msg_lost_count;
+		stats->tx_alloc_fail_count = qp->stats.tx_alloc_fail_count;
+		stats->tx_full_count = qp->stats.tx_full_count;
+		stats->tx_drop_count = qp->stats.tx_drop_count;
+		stats->tx_backlog_max = qp->stats.tx_backlog_max;
 	}
 	return stats;
 } /* urdma_query_qp_stats_ex */
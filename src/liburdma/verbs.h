@@ -44,6 +44,7 @@
 
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/uio.h>
 
@@ -58,15 +59,51 @@
 struct urdma_ah {
 	struct ether_addr ether_addr;
 	uint16_t udp_port;
+		/**< UDP port of the remote queue pair, in network byte
+		 * order. */
 	uint32_t ipv4_addr;
+		/**< IPv4 address of the remote node, in network byte order. */
 };
 
+/** Size of the area at the start of every receive buffer of an IBV_QPT_UD
+ * queue pair that is filled in before the datagram payload, in the place of
+ * the InfiniBand GRH.  It begins with a struct urdma_ah describing the sender,
+ * which may be passed as-is to send a reply; the rest is zero.  As with
+ * InfiniBand, the byte_len of the completion includes this area. */
+#define URDMA_UD_GRH_SIZE 40
+
+/** Largest count accepted by the urdma_accl_post_*_batch() calls. */
+#define URDMA_ACCL_BATCH_MAX 64
+
+/** One work request of a urdma_accl_post_*_batch() call. */
+struct urdma_accl_wr {
+	void *addr;
+	size_t length;
+	uint64_t remote_addr;
+		/**< Ignored for SEND and receive work requests. */
+	uint32_t rkey;
+		/**< Ignored for SEND and receive work requests. */
+	void *context;
+};
+
+/** Scheduling class of a queue pair; see urdma_qp_set_priority(). */
+enum urdma_qp_priority {
+	urdma_qp_priority_normal = 0,
+	urdma_qp_priority_high = 1,
+		/**< Served ahead of all normal priority queue pairs on each
+		 * pass of the progress thread. */
+};
+
+/** Largest weight accepted by urdma_qp_set_priority(). */
+#define URDMA_QP_WEIGHT_MAX 64
+
 struct urdma_qp_stats {
         uintmax_t *recv_count_histo;
 		/**< An array of recv_max_burst_size + 1 elements.  The
 		 * element at index X corresponds to the number of times that a
-		 * burst of X messages was received by a call to
-		 * rte_eth_rx_burst(). */
+		 * burst of X messages was received for this queue pair from
+		 * the hardware queue that it shares with the other queue
+		 * pairs of the process. */
 	size_t recv_max_burst_size;
 		/**< The maximum burst size that usiw requests from DPDK. */
 };
@@ -85,6 +122,21 @@ struct urdma_qp_stats_ex {
 		/**< The number of received retransmissions. */
 	uintmax_t recv_sack_count;
 		/**< The number of received SACK packets. */
+	uintmax_t recv_msg_lost_count;
+		/**< The number of messages received on an unreliable
+		 * connected queue pair that were dropped because a segment was
+		 * lost or no receive WQE was posted. */
+	uintmax_t tx_alloc_fail_count;
+		/**< The number of times transmission was deferred because no
+		 * mbuf was available. */
+	uintmax_t tx_full_count;
+		/**< The number of times the NIC transmit ring could not take
+		 * the whole TX backlog. */
+	uintmax_t tx_drop_count;
+		/**< The number of packets dropped because the TX backlog was
+		 * full. */
+	uintmax_t tx_backlog_max;
+		/**< The largest number of packets held in the TX backlog. */
 };
 
 struct ibv_mr *
@@ -117,6 +169,42 @@ urdma_accl_post_read(struct ibv_qp *qp, void *addr, size_t length,
 		struct urdma_ah *ah, uint64_t remote_addr,
 		uint32_t rkey, void *context);
 
+int
+urdma_accl_post_recv_batch(struct ibv_qp *qp, const struct urdma_accl_wr *wr,
+		size_t count);
+
+int
+urdma_accl_post_send_batch(struct ibv_qp *qp, const struct urdma_accl_wr *wr,
+		size_t count, struct urdma_ah *ah);
+
+int
+urdma_accl_post_write_batch(struct ibv_qp *qp, const struct urdma_accl_wr *wr,
+		size_t count, struct urdma_ah *ah);
+
+int
+urdma_accl_post_read_batch(struct ibv_qp *qp, const struct urdma_accl_wr *wr,
+		size_t count, struct urdma_ah *ah);
+
+int
+urdma_qp_set_direct_tx(struct ibv_qp *qp, bool enable);
+
+int
+urdma_qp_set_priority(struct ibv_qp *qp, enum urdma_qp_priority priority,
+		unsigned int weight);
+
+int
+urdma_qp_set_read_response_ratio(struct ibv_qp *qp,
+		unsigned int request_bursts, unsigned int response_bursts);
+
+int
+urdma_ud_qp_bind(struct ibv_qp *qp, uint16_t udp_port);
+
+struct ibv_comp_channel *
+urdma_create_comp_channel(struct ibv_context *context);
+
+int
+urdma_destroy_comp_channel(struct ibv_comp_channel *channel);
+
 void
 urdma_query_qp_stats(const struct ibv_qp *restrict qp,
 		struct urdma_qp_stats *restrict stats);
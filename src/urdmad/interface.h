@@ -60,8 +60,12 @@ enum usiw_port_flags {
 	port_fdir = 2,
 	port_2tuple = 4,
 	port_5tuple = 8,
+	port_flow = 16,
 };
 
+struct rte_flow;
+struct urdma_process;
+
 struct usiw_port {
 	int portid;
 	uint64_t timer_freq;
@@ -77,6 +81,15 @@ struct usiw_port {
 	uint16_t max_qp;
 	struct list_head avail_qp;
 	struct urdmad_qp *qp;
+	uint16_t queue_count;
+		/* Number of hardware data queue pairs, not counting queue 0 */
+	struct urdma_process **queue_owner;
+		/* Process using each hardware queue pair, or NULL if free */
+	struct rte_flow **qp_flow;
+		/* rte_flow rule steering each queue pair, indexed by qp_id */
+	int *ud_port_fd;
+		/* Kernel socket reserving the UDP port of each bound unreliable
+		 * datagram queue pair, indexed by qp_id, or -1 */
 
 	uint64_t flags;
 
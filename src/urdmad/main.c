@@ -50,6 +50,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
@@ -62,6 +63,9 @@
 #include <rte_config.h>
 #include <rte_ethdev.h>
 #include <rte_errno.h>
+#ifdef HAVE_RTE_FLOW_H
+#include <rte_flow.h>
+#endif
 #include <rte_ip.h>
 #include <rte_kni.h>
 #include <rte_malloc.h>
@@ -109,11 +113,14 @@ static void init_core_mask(void)
 /** Reserve count lcores for the given process.  Expects out_mask to be a
  * zero-initialized bitmask that can hold RTE_MAX_LCORE bits; i.e., an array
  * with at least (RTE_MAX_LCORE / 32) uint32_t elements.  This can be done with
- * the alloc_lcore_mask() function. */
+ * the alloc_lcore_mask() function.  lcores on the NUMA socket of the first
+ * port are handed out first, so that the progress thread of the process runs
+ * next to the NIC. */
 static bool reserve_cores(unsigned int count, uint32_t *out_mask)
 {
 	uint32_t bit;
-	unsigned int i, j;
+	unsigned int i, pass, reserved;
+	int socket_id;
 
 	RTE_LOG(DEBUG, USER1, "requesting %u cores; %u cores available\n",
 			count, core_avail);
@@ -121,15 +128,25 @@ static bool reserve_cores(unsigned int count, uint32_t *out_mask)
 		return false;
 	}
 
-	for (i = 0, j = 0; i < count; ++i) {
-		while (!core_mask[j]) {
-			j++;
-			assert(j < RTE_MAX_LCORE / 32);
+	socket_id = driver->port_count > 0
+		? rte_eth_dev_socket_id(driver->ports[0].portid) : -1;
+	reserved = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < RTE_MAX_LCORE && reserved < count; ++i) {
+			bit = 1 << (i & core_mask_mask);
+			if (!(core_mask[i >> core_mask_shift] & bit)) {
+				continue;
+			}
+			if (pass == 0 && socket_id >= 0
+				&& (int)rte_lcore_to_socket_id(i) != socket_id) {
+				continue;
+			}
+			core_mask[i >> core_mask_shift] &= ~bit;
+			out_mask[i >> core_mask_shift] |= bit;
+			reserved++;
 		}
-		bit = 1 << rte_bsf32(core_mask[j]);
-		core_mask[j] &= ~bit;
-		out_mask[j] |= bit;
 	}
+	assert(reserved == count);
 
 	core_avail -= count;
 	return true;
@@ -157,17 +174,229 @@ static void return_lcores(uint32_t *in_mask)
 } /* return_lcores */
 
 
+/** Returns a human-readable name for the receive steering mode of the port. */
+static const char *
+steering_mode_name(struct usiw_port *dev)
+{
+	if (dev->flags & port_flow) {
+		return "rte_flow 5-tuple";
+	} else if (dev->flags & port_5tuple) {
+		return "ntuple 5-tuple";
+	} else if (dev->flags & port_2tuple) {
+		return "ntuple 2-tuple";
+	} else if (dev->flags & port_fdir) {
+		return "flow director";
+	} else {
+		return "none";
+	}
+} /* steering_mode_name */
+
+
+#ifdef HAVE_RTE_FLOW_H
+/** Steers UDP datagrams addressed to local_port on the port to the given
+ * hardware queue with an rte_flow rule.  If remote_ipv4 is nonzero, the rule
+ * matches the full 5-tuple, so that only datagrams from the peer of a
+ * connected queue pair are steered.  Addresses and ports are in network byte
+ * order.  If flow is NULL, the rule is only validated.  Returns 0 on success
+ * or a negative errno value on failure. */
+static int
+flow_steer_udp(struct usiw_port *dev, uint32_t remote_ipv4,
+		uint16_t remote_port, uint16_t local_port, uint16_t queue,
+		struct rte_flow **flow)
+{
+	struct rte_flow_item_ipv4 ipv4_spec, ipv4_mask;
+	struct rte_flow_item_udp udp_spec, udp_mask;
+	struct rte_flow_action_queue queue_conf;
+	struct rte_flow_item pattern[] = {
+		{ .type = RTE_FLOW_ITEM_TYPE_ETH },
+		{ .type = RTE_FLOW_ITEM_TYPE_IPV4,
+			.spec = &ipv4_spec, .mask = &ipv4_mask },
+		{ .type = RTE_FLOW_ITEM_TYPE_UDP,
+			.spec = &udp_spec, .mask = &udp_mask },
+		{ .type = RTE_FLOW_ITEM_TYPE_END },
+	};
+	struct rte_flow_action actions[] = {
+		{ .type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &queue_conf },
+		{ .type = RTE_FLOW_ACTION_TYPE_END },
+	};
+	struct rte_flow_attr attr;
+	struct rte_flow_error error;
+	int ret;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.ingress = 1;
+	memset(&ipv4_spec, 0, sizeof(ipv4_spec));
+	memset(&ipv4_mask, 0, sizeof(ipv4_mask));
+	memset(&udp_spec, 0, sizeof(udp_spec));
+	memset(&udp_mask, 0, sizeof(udp_mask));
+	ipv4_spec.hdr.dst_addr = dev->ipv4_addr;
+	ipv4_mask.hdr.dst_addr = UINT32_MAX;
+	udp_spec.hdr.dst_port = local_port;
+	udp_mask.hdr.dst_port = UINT16_MAX;
+	if (remote_ipv4) {
+		ipv4_spec.hdr.src_addr = remote_ipv4;
+		ipv4_mask.hdr.src_addr = UINT32_MAX;
+		udp_spec.hdr.src_port = remote_port;
+		udp_mask.hdr.src_port = UINT16_MAX;
+	}
+	queue_conf.index = queue;
+
+	memset(&error, 0, sizeof(error));
+	if (flow) {
+		*flow = rte_flow_create(dev->portid, &attr, pattern, actions,
+				&error);
+		ret = *flow ? 0 : -rte_errno;
+	} else {
+		ret = rte_flow_validate(dev->portid, &attr, pattern, actions,
+				&error);
+	}
+	if (ret < 0) {
+		RTE_LOG(DEBUG, USER1, "port %d: rte_flow rule for UDP port %" PRIu16 " rejected: %s\n",
+				dev->portid, rte_be_to_cpu_16(local_port),
+				error.message ? error.message
+						: rte_strerror(-ret));
+	}
+	return ret;
+} /* flow_steer_udp */
+
+
+/** Destroys the rte_flow rule steering a queue pair that is being returned.
+ * This must finish before the queue pair, and with it its UDP port, can be
+ * handed out again, or traffic to the port would still be steered to the
+ * hardware queue of its previous owner. */
 static void
-return_qp(struct usiw_port *dev, struct urdmad_qp *qp)
+flow_destroy(struct usiw_port *dev, struct rte_flow *flow)
+{
+	struct rte_flow_error error;
+	int ret;
+
+	ret = rte_flow_destroy(dev->portid, flow, &error);
+	if (ret < 0) {
+		RTE_LOG(WARNING, USER1, "port %d: could not destroy rte_flow rule: %s\n",
+				dev->portid,
+				error.message ? error.message
+						: rte_strerror(-ret));
+	}
+} /* flow_destroy */
+#else
+static int
+flow_steer_udp(struct usiw_port *dev, uint32_t remote_ipv4,
+		uint16_t remote_port, uint16_t local_port, uint16_t queue,
+		struct rte_flow **flow)
+{
+	return -ENOTSUP;
+} /* flow_steer_udp */
+
+
+static void
+flow_destroy(struct usiw_port *dev, struct rte_flow *flow)
+{
+} /* flow_destroy */
+#endif
+
+
+/** Returns a hardware queue pair to the pool once the process that owned it
+ * has gone away.  All queue pairs using it must have been returned first, so
+ * that no more packets are steered to it. */
+static void
+return_queue(struct usiw_port *dev, uint16_t queue)
 {
 	enum { mbuf_count = 4 };
 	struct rte_mbuf *mbuf[mbuf_count];
-	int ret, count;
+	int i, ret, count;
+
+	/* Drain the queue of any outstanding messages. */
+	count = 0;
+	do {
+		ret = rte_eth_rx_burst(dev->portid, queue, mbuf, mbuf_count);
+		for (i = 0; i < ret; ++i) {
+			rte_pktmbuf_free(mbuf[i]);
+		}
+		count += ret;
+	} while (ret > 0);
+	if (count > 0) {
+		RTE_LOG(INFO, USER1, "Drained %d packets from queue %" PRIu16 "\n",
+				count, queue);
+	}
+
+	ret = rte_eth_dev_rx_queue_stop(dev->portid, queue);
+	if (ret < 0 && ret != -ENOTSUP) {
+		RTE_LOG(INFO, USER1, "Disable RX queue %u failed: %s\n",
+				queue, rte_strerror(-ret));
+	}
+
+	ret = rte_eth_dev_tx_queue_stop(dev->portid, queue);
+	if (ret < 0 && ret != -ENOTSUP) {
+		RTE_LOG(INFO, USER1, "Disable TX queue %u failed: %s\n",
+				queue, rte_strerror(-ret));
+	}
+
+	dev->queue_owner[queue] = NULL;
+} /* return_queue */
+
+
+/** Returns the hardware queue pair that the process shares between all of its
+ * queue pairs on the port, claiming a free one if it does not have one yet.
+ * Returns 0 if every hardware queue pair is in use by other processes. */
+static uint16_t
+process_get_queue(struct urdma_process *process, struct usiw_port *dev)
+{
+	uint16_t q, free_q;
+
+	free_q = 0;
+	for (q = 1; q <= dev->queue_count; ++q) {
+		if (dev->queue_owner[q] == process) {
+			return q;
+		} else if (!free_q && !dev->queue_owner[q]) {
+			free_q = q;
+		}
+	}
+	if (free_q) {
+		dev->queue_owner[free_q] = process;
+	}
+	return free_q;
+} /* process_get_queue */
+
+
+/** Returns all of the hardware queue pairs owned by the process.  Its queue
+ * pairs must already have been returned. */
+static void
+process_return_queues(struct urdma_process *process)
+{
+	struct usiw_port *dev;
+	uint16_t q;
+	int i;
+
+	for (i = 0; i < driver->port_count; ++i) {
+		dev = &driver->ports[i];
+		for (q = 1; q <= dev->queue_count; ++q) {
+			if (dev->queue_owner[q] == process) {
+				return_queue(dev, q);
+			}
+		}
+	}
+} /* process_return_queues */
+
+
+static void
+return_qp(struct usiw_port *dev, struct urdmad_qp *qp)
+{
+	int ret;
 
 	list_del(&qp->urdmad__entry);
 	list_add_tail(&dev->avail_qp, &qp->urdmad__entry);
 
-	if (dev->flags & port_5tuple) {
+	if (dev->ud_port_fd[qp->qp_id] >= 0) {
+		close(dev->ud_port_fd[qp->qp_id]);
+		dev->ud_port_fd[qp->qp_id] = -1;
+	}
+
+	if (dev->flags & port_flow) {
+		if (dev->qp_flow[qp->qp_id]) {
+			flow_destroy(dev, dev->qp_flow[qp->qp_id]);
+			dev->qp_flow[qp->qp_id] = NULL;
+		}
+	} else if (dev->flags & port_5tuple) {
 		struct rte_eth_ntuple_filter ntuple;
 		memset(&ntuple, 0, sizeof(ntuple));
 		ntuple.flags = RTE_5TUPLE_FLAGS;
@@ -228,29 +457,11 @@ return_qp(struct usiw_port *dev, struct urdmad_qp *qp)
 		}
 	}
 
-	/* Drain the queue of any outstanding messages. */
-	count = 0;
-	do {
-		ret = rte_eth_rx_burst(dev->portid, qp->rx_queue,
-				mbuf, mbuf_count);
-		count += ret;
-	} while (ret > 0);
-	if (count > 0) {
-		RTE_LOG(INFO, USER1, "Drained %d packets from qp %" PRIu32 "\n",
-				count, qp->qp_id);
-	}
-
-	ret = rte_eth_dev_rx_queue_stop(dev->portid, qp->rx_queue);
-	if (ret < 0 && ret != -ENOTSUP) {
-		RTE_LOG(INFO, USER1, "Disable RX queue %u failed: %s\n",
-				qp->rx_queue, rte_strerror(-ret));
-	}
-
-	ret = rte_eth_dev_tx_queue_stop(dev->portid, qp->tx_queue);
-	if (ret < 0 && ret != -ENOTSUP) {
-		RTE_LOG(INFO, USER1, "Disable RX queue %u failed: %s\n",
-				qp->tx_queue, rte_strerror(-ret));
-	}
+	/* The hardware queues are shared with the other queue pairs of the
+	 * process, so they stay running until the process goes away.  Any
+	 * packets still queued for this queue pair are dropped by the
+	 * process when it finds no queue pair bound to their UDP port. */
+	atomic_store(&qp->conn_state, usiw_qp_unbound);
 } /* return_qp */
 
 
@@ -288,6 +499,13 @@ do_setup_qp(struct urdma_qp_connected_event *event, struct usiw_port *dev,
 	int ret;
 
 	pthread_mutex_lock(&qp->conn_event_lock);
+	if (atomic_load(&qp->conn_state) != usiw_qp_unbound) {
+		/* The process destroyed the queue pair before it was bound */
+		RTE_LOG(DEBUG, USER1, "qp %" PRIu16 " is no longer unbound; not setting it up\n",
+				qp->qp_id);
+		ret = -EINVAL;
+		goto unlock;
+	}
 	assert(event->src_port != 0);
 	assert(event->src_ipv4 == dev->ipv4_addr);
 	assert(event->rxq == qp->rx_queue);
@@ -306,14 +524,14 @@ do_setup_qp(struct urdma_qp_connected_event *event, struct usiw_port *dev,
 		qp->mtu = 1024;
 	}
 	ret = rte_eth_rx_queue_info_get(event->urdmad_dev_id,
-			event->urdmad_qp_id, &rxq_info);
+			event->rxq, &rxq_info);
 	if (ret < 0) {
 		qp->rx_desc_count = dev->rx_desc_count;
 	} else {
 		qp->rx_desc_count = rxq_info.nb_desc;
 	}
 	ret = rte_eth_tx_queue_info_get(event->urdmad_dev_id,
-			event->urdmad_qp_id, &txq_info);
+			event->txq, &txq_info);
 	if (ret < 0) {
 		qp->tx_desc_count = dev->tx_desc_count;
 	} else {
@@ -328,7 +546,16 @@ do_setup_qp(struct urdma_qp_connected_event *event, struct usiw_port *dev,
 		qp->tx_burst_size = dev->tx_desc_count;
 	}
 	memcpy(&qp->remote_ether_addr, event->dst_ether, ETHER_ADDR_LEN);
-	if (dev->flags & port_5tuple) {
+	if (dev->flags & port_flow) {
+		ret = flow_steer_udp(dev, qp->remote_ipv4_addr,
+				qp->remote_udp_port, qp->local_udp_port,
+				qp->rx_queue, &dev->qp_flow[qp->qp_id]);
+		if (ret != 0) {
+			RTE_LOG(CRIT, USER1, "Could not add rte_flow UDP rule: %s\n",
+					rte_strerror(-ret));
+			goto unlock;
+		}
+	} else if (dev->flags & port_5tuple) {
 		struct rte_eth_ntuple_filter ntuple;
 		memset(&ntuple, 0, sizeof(ntuple));
 		ntuple.flags = RTE_5TUPLE_FLAGS;
@@ -350,6 +577,8 @@ do_setup_qp(struct urdma_qp_connected_event *event, struct usiw_port *dev,
 				&ntuple);
 		if (ret == -ENOTSUP) {
 			dev->flags = (dev->flags & ~port_5tuple) | port_2tuple;
+			RTE_LOG(NOTICE, USER1, "port %d steering mode: %s\n",
+					dev->portid, steering_mode_name(dev));
 			ret = add_2tuple_filter(dev->portid,
 						qp->local_udp_port,
 						qp->rx_queue);
@@ -477,15 +706,18 @@ chardev_data_ready(struct urdma_fd *fd)
 } /* chardev_data_ready */
 
 
+/** Sends the response to a create QP request.  If qp is NULL, no queue pair
+ * could be allocated and the process will fail the request. */
 static int
-send_create_qp_resp(struct urdma_process *process, struct urdmad_qp *qp)
+send_create_qp_resp(struct urdma_process *process, uint16_t dev_id,
+		struct urdmad_qp *qp)
 {
 	struct urdmad_sock_qp_msg msg;
 	int ret;
 
 	msg.hdr.opcode = rte_cpu_to_be_32(urdma_sock_create_qp_resp);
-	msg.hdr.dev_id = rte_cpu_to_be_16(qp->dev_id);
-	msg.hdr.qp_id = rte_cpu_to_be_16(qp->qp_id);
+	msg.hdr.dev_id = rte_cpu_to_be_16(dev_id);
+	msg.hdr.qp_id = rte_cpu_to_be_16(qp ? qp->qp_id : 0);
 	msg.ptr = rte_cpu_to_be_64((uintptr_t)qp);
 	ret = send(process->fd.fd, &msg, sizeof(msg), 0);
 	if (ret < 0) {
@@ -537,6 +769,113 @@ handle_hello(struct urdma_process *process, struct urdmad_sock_hello_req *req)
 } /* handle_hello */
 
 
+/* Reserves the given local UDP port (in network byte order) with the kernel by
+ * binding a socket to it, so that the kernel will not also choose it for the
+ * connection of a reliable or unreliable connected queue pair.  Returns the
+ * socket, or -1 and sets errno if the port is already in use. */
+static int
+reserve_udp_port(struct usiw_port *dev, uint16_t udp_port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, IPPROTO_UDP);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = dev->ipv4_addr;
+	addr.sin_port = udp_port;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+} /* reserve_udp_port */
+
+
+/* Binds an unreliable datagram queue pair to the requested local UDP port.
+ * There is no connection for the kernel to establish, so we set up the queue
+ * pair exactly as if the kernel had reported it connected to an unspecified
+ * peer, and then report the result back to the process. */
+static int
+handle_bind_ud_qp(struct urdma_process *process,
+		struct urdmad_sock_bind_ud_qp_msg *msg)
+{
+	struct urdma_qp_connected_event event;
+	struct usiw_port *dev;
+	struct urdmad_qp *qp;
+	uint16_t dev_id, qp_id;
+	unsigned int i, state;
+	uint32_t status;
+	ssize_t ret;
+	int fd;
+
+	dev_id = rte_be_to_cpu_16(msg->hdr.dev_id);
+	qp_id = rte_be_to_cpu_16(msg->hdr.qp_id);
+	if (dev_id >= driver->port_count || qp_id == 0
+			|| qp_id > driver->ports[dev_id].max_qp) {
+		errno = EINVAL;
+		return -1;
+	}
+	dev = &driver->ports[dev_id];
+	qp = &dev->qp[qp_id];
+
+	status = 0;
+	if (msg->udp_port == 0
+			|| atomic_load(&qp->conn_state) != usiw_qp_unbound) {
+		status = EINVAL;
+	}
+	for (i = 1; !status && i <= dev->max_qp; ++i) {
+		state = atomic_load(&dev->qp[i].conn_state);
+		if ((state == usiw_qp_connected || state == usiw_qp_running)
+				&& dev->qp[i].local_udp_port == msg->udp_port) {
+			status = EADDRINUSE;
+		}
+	}
+
+	if (!status) {
+		fd = reserve_udp_port(dev, msg->udp_port);
+		if (fd < 0) {
+			status = errno;
+		}
+	}
+
+	if (!status) {
+		memset(&event, 0, sizeof(event));
+		event.event_type = SIW_EVENT_QP_CONNECTED;
+		event.urdmad_dev_id = dev_id;
+		event.urdmad_qp_id = qp_id;
+		event.src_ipv4 = dev->ipv4_addr;
+		event.src_port = msg->udp_port;
+		event.rxq = qp->rx_queue;
+		event.txq = qp->tx_queue;
+		if (do_setup_qp(&event, dev, qp) != 0) {
+			close(fd);
+			status = EIO;
+		} else {
+			dev->ud_port_fd[qp_id] = fd;
+		}
+	}
+
+	RTE_LOG(DEBUG, USER1, "BIND UD QP qp_id=%" PRIu16 " dev_id=%" PRIu16 " UDP port %" PRIu16 " on fd %d: status %" PRIu32 "\n",
+			qp_id, dev_id, rte_be_to_cpu_16(msg->udp_port),
+			process->fd.fd, status);
+	msg->hdr.opcode = rte_cpu_to_be_32(urdma_sock_bind_ud_qp_resp);
+	msg->status = rte_cpu_to_be_32(status);
+	ret = send(process->fd.fd, msg, sizeof(*msg), 0);
+	if (ret < 0) {
+		return ret;
+	} else if (ret == sizeof(*msg)) {
+		return 0;
+	} else {
+		errno = EMSGSIZE;
+		return -1;
+	}
+} /* handle_bind_ud_qp */
+
+
 static void
 process_data_ready(struct urdma_fd *process_fd)
 {
@@ -545,7 +884,7 @@ process_data_ready(struct urdma_fd *process_fd)
 	struct usiw_port *port;
 	union urdmad_sock_any_msg msg;
 	struct urdmad_qp *qp, *next;
-	uint16_t dev_id, qp_id;
+	uint16_t dev_id, qp_id, q;
 	ssize_t ret;
 
 	ret = recv(process->fd.fd, &msg, sizeof(msg), 0);
@@ -556,6 +895,7 @@ process_data_ready(struct urdma_fd *process_fd)
 					qp->qp_id);
 			return_qp(&driver->ports[qp->dev_id], qp);
 		}
+		process_return_queues(process);
 		return_lcores(process->core_mask);
 		goto err;
 	}
@@ -567,12 +907,23 @@ process_data_ready(struct urdma_fd *process_fd)
 			goto err;
 		}
 		port = &driver->ports[dev_id];
+		q = process_get_queue(process, port);
 		qp = list_top(&port->avail_qp, struct urdmad_qp, urdmad__entry);
-		list_del(&qp->urdmad__entry);
-		RTE_LOG(DEBUG, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d => qp_id=%" PRIu16 "\n",
-				dev_id, process->fd.fd, qp->qp_id);
-		list_add_tail(&process->owned_qps, &qp->urdmad__entry);
-		ret = send_create_qp_resp(process, qp);
+		if (q && qp) {
+			list_del(&qp->urdmad__entry);
+			qp->rx_queue = q;
+			qp->tx_queue = q;
+			RTE_LOG(DEBUG, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d => qp_id=%" PRIu16 " queue %" PRIu16 "\n",
+					dev_id, process->fd.fd, qp->qp_id, q);
+			list_add_tail(&process->owned_qps,
+					&qp->urdmad__entry);
+		} else {
+			RTE_LOG(NOTICE, USER1, "CREATE QP dev_id=%" PRIu16 " on fd %d: no %s available\n",
+					dev_id, process->fd.fd,
+					q ? "queue pairs" : "hardware queues");
+			qp = NULL;
+		}
+		ret = send_create_qp_resp(process, dev_id, qp);
 		if (ret < 0) {
 			goto err;
 		}
@@ -596,6 +947,13 @@ process_data_ready(struct urdma_fd *process_fd)
 			goto err;
 		}
 		break;
+	case urdma_sock_bind_ud_qp_req:
+		if (ret < sizeof(msg.bind_ud_qp)
+				|| handle_bind_ud_qp(process,
+							&msg.bind_ud_qp) < 0) {
+			goto err;
+		}
+		break;
 	default:
 		RTE_LOG(DEBUG, USER1, "Unknown opcode %" PRIu32 " on fd %d\n",
 				rte_be_to_cpu_32(msg.hdr.opcode),
@@ -828,6 +1186,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	size_t mbuf_size;
 	int socket_id;
 	int retval;
+	unsigned int i;
 	uint16_t q;
 
 	socket_id = rte_eth_dev_socket_id(iface->portid);
@@ -839,6 +1198,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	port_conf.rxmode.max_rx_pkt_len
 			= port_config->mtu + ETHER_HDR_LEN + ETHER_CRC_LEN;
 	port_conf.rxmode.jumbo_frame = !!(port_config->mtu > 1500);
+	port_conf.intr_conf.rxq = !!port_config->rx_interrupts;
 	if ((iface->dev_info.tx_offload_capa & tx_checksum_offloads)
 			== tx_checksum_offloads) {
 		iface->flags |= port_checksum_offload;
@@ -873,10 +1233,13 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		port_conf.fdir_conf.mode = RTE_FDIR_MODE_NONE;
 	}
 
-	/* Calculate max_qp.  We map queue pairs 1:1 with hardware queues for
-	 * now, with 1 reserved for urdmad ARP/CM usage.  Note that at least
-	 * i40e reserves queues for VMDq and makes them unavailable for general
-	 * use, so we must subtract those queues from the available queues. */
+	/* Calculate the number of hardware queues, with 1 reserved for urdmad
+	 * ARP/CM usage.  Each process gets one hardware queue pair per port,
+	 * shared between all of its queue pairs, so max_qp is limited only by
+	 * memory and defaults to the number of hardware queues.  Note that at
+	 * least i40e reserves queues for VMDq and makes them unavailable for
+	 * general use, so we must subtract those queues from the available
+	 * queues. */
 	if (iface->dev_info.max_vmdq_pools > 0
 			&& iface->dev_info.vmdq_queue_base > 0) {
 		RTE_LOG(INFO, USER1,
@@ -885,23 +1248,21 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		iface->dev_info.max_rx_queues -= iface->dev_info.vmdq_queue_num;
 		iface->dev_info.max_tx_queues -= iface->dev_info.vmdq_queue_num;
 	}
-	iface->max_qp = port_config->max_qp > 0 ? port_config->max_qp
-		: RTE_MIN(iface->dev_info.max_rx_queues,
-					iface->dev_info.max_tx_queues);
-	if (iface->max_qp >= iface->dev_info.max_rx_queues) {
+	if (iface->dev_info.max_rx_queues < 2
+			|| iface->dev_info.max_tx_queues < 2) {
 		rte_exit(EXIT_FAILURE,
-			 "port %" PRIu16 " configured max_qp %" PRIu16 " > max_rx_queues %" PRIu16 "\n",
-			 iface->portid, iface->max_qp,
-			 iface->dev_info.max_rx_queues - 1);
+			 "port %" PRIu16 " has no hardware queues available for queue pairs\n",
+			 iface->portid);
 	}
-	if (iface->max_qp >= iface->dev_info.max_tx_queues) {
-		rte_exit(EXIT_FAILURE,
-			 "port %" PRIu16 " configured max_qp %" PRIu16 " > max_tx_queues %" PRIu16 "\n",
-			 iface->portid, iface->max_qp,
-			 iface->dev_info.max_tx_queues - 1);
+	iface->queue_count = RTE_MIN(iface->dev_info.max_rx_queues,
+					iface->dev_info.max_tx_queues) - 1;
+	iface->max_qp = port_config->max_qp > 0 ? port_config->max_qp
+		: iface->queue_count;
+	if (iface->queue_count > iface->max_qp) {
+		iface->queue_count = iface->max_qp;
 	}
-	fprintf(stderr, "port %" PRIu16 " max_qp %" PRIu16 "\n",
-			iface->portid, iface->max_qp);
+	fprintf(stderr, "port %" PRIu16 " max_qp %" PRIu16 " hardware queues %" PRIu16 "\n",
+			iface->portid, iface->max_qp, iface->queue_count);
 
 	/* TODO: Auto-tuning of rx_desc_count and tx_desc_count */
 	if (port_config->rx_desc_count == UINT_MAX) {
@@ -960,6 +1321,27 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 		rte_exit(EXIT_FAILURE, "Cannot allocate QP array: %s\n",
 				rte_strerror(rte_errno));
 	}
+	iface->queue_owner = rte_calloc("urdma_queue_owner",
+			iface->queue_count + 1, sizeof(*iface->queue_owner), 0);
+	if (!iface->queue_owner) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate queue owner array: %s\n",
+				rte_strerror(rte_errno));
+	}
+	iface->qp_flow = rte_calloc("urdma_qp_flow", iface->max_qp + 1,
+			sizeof(*iface->qp_flow), 0);
+	if (!iface->qp_flow) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate flow rule array: %s\n",
+				rte_strerror(rte_errno));
+	}
+	iface->ud_port_fd = rte_malloc("urdma_ud_port_fd",
+			(iface->max_qp + 1) * sizeof(*iface->ud_port_fd), 0);
+	if (!iface->ud_port_fd) {
+		rte_exit(EXIT_FAILURE, "Cannot allocate UD port socket array: %s\n",
+				rte_strerror(rte_errno));
+	}
+	for (i = 0; i <= iface->max_qp; ++i) {
+		iface->ud_port_fd[i] = -1;
+	}
 	retval = pthread_mutexattr_init(&mutexattr);
 	if (retval) {
 		rte_exit(EXIT_FAILURE,
@@ -972,17 +1354,18 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 			"Cannot enable process shared mutex attribute: %s\n",
 			rte_strerror(rte_errno));
 	}
-	for (q = 1; q <= iface->max_qp; ++q) {
-		iface->qp[q].qp_id = q;
-		iface->qp[q].tx_queue = q;
-		iface->qp[q].rx_queue = q;
-		atomic_init(&iface->qp[q].conn_state, 0);
-		retval = pthread_mutex_init(&iface->qp[q].conn_event_lock, &mutexattr);
+	for (i = 1; i <= iface->max_qp; ++i) {
+		/* The hardware queues are assigned on QP creation */
+		iface->qp[i].qp_id = i;
+		iface->qp[i].tx_queue = 0;
+		iface->qp[i].rx_queue = 0;
+		atomic_init(&iface->qp[i].conn_state, 0);
+		retval = pthread_mutex_init(&iface->qp[i].conn_event_lock, &mutexattr);
 		if (retval) {
 			rte_exit(EXIT_FAILURE, "Cannot create mutex: %s\n",
 				rte_strerror(rte_errno));
 		}
-		list_add_tail(&iface->avail_qp, &iface->qp[q].urdmad__entry);
+		list_add_tail(&iface->avail_qp, &iface->qp[i].urdmad__entry);
 	}
 	retval = pthread_mutexattr_destroy(&mutexattr);
 	if (retval) {
@@ -1003,15 +1386,15 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 			"port_%u_rx_mempool", iface->portid);
 	RTE_LOG(DEBUG, USER1, "create rx mempool for port %" PRIu16 " with %u mbufs of size %zu\n",
 				iface->portid,
-				2 * iface->max_qp * iface->rx_desc_count,
+				2 * (iface->queue_count + 1) * iface->rx_desc_count,
 				mbuf_size);
 	iface->rx_mempool = rte_pktmbuf_pool_create(name,
-		2 * iface->max_qp * iface->rx_desc_count,
+		2 * (iface->queue_count + 1) * iface->rx_desc_count,
 		0, 0, mbuf_size, socket_id);
 	if (iface->rx_mempool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create rx mempool for port %" PRIu16 " with %u mbufs: %s\n",
 				iface->portid,
-				2 * iface->max_qp * iface->rx_desc_count,
+				2 * (iface->queue_count + 1) * iface->rx_desc_count,
 				rte_strerror(rte_errno));
 
 	snprintf(name, RTE_MEMPOOL_NAMESIZE,
@@ -1033,12 +1416,12 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	iface->tx_hdr_mempool = iface->tx_ddp_mempool;
 
 	/* Configure the Ethernet device. */
-	retval = rte_eth_dev_configure(iface->portid, iface->max_qp + 1,
-			iface->max_qp + 1, &port_conf);
+	retval = rte_eth_dev_configure(iface->portid, iface->queue_count + 1,
+			iface->queue_count + 1, &port_conf);
 	if (retval != 0) {
 		rte_exit(EXIT_FAILURE,
-			"Cannot configure port %" PRIu16 " with max_qp %" PRIu16 ": %s\n",
-			iface->portid, iface->max_qp,
+			"Cannot configure port %" PRIu16 " with %" PRIu16 " queues: %s\n",
+			iface->portid, iface->queue_count + 1,
 			rte_strerror(-retval));
 	}
 
@@ -1055,7 +1438,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	/* Data RX queue startup is deferred */
 	memcpy(&rxconf, &iface->dev_info.default_rxconf, sizeof(rxconf));
 	rxconf.rx_deferred_start = 1;
-	for (q = 1; q <= iface->max_qp; q++) {
+	for (q = 1; q <= iface->queue_count; q++) {
 		retval = rte_eth_rx_queue_setup(iface->portid, q,
 				iface->rx_desc_count, socket_id, &rxconf,
 				iface->rx_mempool);
@@ -1082,7 +1465,7 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 
 	/* Defer startup of data TX queues */
 	txconf.tx_deferred_start = 1;
-	for (q = 1; q <= iface->max_qp; q++) {
+	for (q = 1; q <= iface->queue_count; q++) {
 		retval = rte_eth_tx_queue_setup(iface->portid, q,
 				iface->tx_desc_count, socket_id, &txconf);
 		if (retval < 0)
@@ -1113,6 +1496,19 @@ usiw_port_init(struct usiw_port *iface, struct usiw_port_config *port_config)
 	if (retval < 0)
 		rte_exit(EXIT_FAILURE, "Could not start port %u: %s\n",
 				iface->portid, strerror(-retval));
+
+	/* Prefer rte_flow, which can match the full 5-tuple of a connected
+	 * queue pair, over the legacy filter APIs.  Validate a sample rule,
+	 * since a PMD may implement rte_flow without supporting this
+	 * pattern or the QUEUE action. */
+	if (flow_steer_udp(iface, iface->ipv4_addr, rte_cpu_to_be_16(1),
+				rte_cpu_to_be_16(1), 1, NULL) == 0) {
+		iface->flags = (iface->flags
+				& ~(port_fdir|port_2tuple|port_5tuple))
+				| port_flow;
+	}
+	RTE_LOG(NOTICE, USER1, "port %" PRIu16 " steering mode: %s\n",
+			iface->portid, steering_mode_name(iface));
 } /* usiw_port_init */
 
 
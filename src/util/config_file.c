@@ -242,6 +242,10 @@ urdma__config_file_get_ports(struct usiw_config *config,
 					&(*port_config)[i].tx_burst_size) < 0) {
 			return -EINVAL;
 		}
+		if (get_uint_value(port, i, "rx_interrupts", 0, 1, 0,
+					&(*port_config)[i].rx_interrupts) < 0) {
+			return -EINVAL;
+		}
 	}
 
 	return port_count;
@@ -451,6 +455,44 @@ urdma__config_file_get_timer_interval(struct usiw_config *config)
 	return json_object_get_int(interval);
 } /* urdma__config_file_get_timer_interval */
 
+int
+urdma__config_file_get_idle_poll_count(struct usiw_config *config)
+{
+	struct json_object *count;
+
+	if (!json_object_object_get_ex(config->root, "idle_poll_count",
+								&count)) {
+		return 0;
+	}
+
+	if (!json_object_is_type(count, json_type_int)
+			|| json_object_get_int(count) < 0) {
+		fprintf(stderr, "Configuration error: \"idle_poll_count\" field not a non-negative integer\n");
+		return 0;
+	}
+
+	return json_object_get_int(count);
+} /* urdma__config_file_get_idle_poll_count */
+
+int
+urdma__config_file_get_idle_sleep_ms(struct usiw_config *config)
+{
+	struct json_object *sleep_ms;
+
+	if (!json_object_object_get_ex(config->root, "idle_sleep_ms",
+								&sleep_ms)) {
+		return 1;
+	}
+
+	if (!json_object_is_type(sleep_ms, json_type_int)
+			|| json_object_get_int(sleep_ms) < 1) {
+		fprintf(stderr, "Configuration error: \"idle_sleep_ms\" field not a positive integer\n");
+		return 1;
+	}
+
+	return json_object_get_int(sleep_ms);
+} /* urdma__config_file_get_idle_sleep_ms */
+
 
 /** Parses the given JSON configuration file for the IPv4 addresses to assign
  * to each interface.  An example configuration file looks like:
@@ -57,6 +57,7 @@ struct usiw_port_config {
 	unsigned int tx_desc_count;
 	unsigned int rx_burst_size;
 	unsigned int tx_burst_size;
+	unsigned int rx_interrupts;
 	int max_qp;
 	char ipv4_address[ipv4_addr_len_max];
 };
@@ -78,6 +79,12 @@ urdma__config_file_get_sock_name(struct usiw_config *config);
 int
 urdma__config_file_get_timer_interval(struct usiw_config *config);
 
+int
+urdma__config_file_get_idle_poll_count(struct usiw_config *config);
+
+int
+urdma__config_file_get_idle_sleep_ms(struct usiw_config *config);
+
 int
 urdma__config_file_open(struct usiw_config *config);
 